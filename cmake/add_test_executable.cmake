@@ -39,6 +39,17 @@ function(add_test_executable)
                        COMMAND extract-bc $<TARGET_FILE:${FN_ARGS_TARGET}>
                                -o $<TARGET_FILE:${FN_ARGS_TARGET}>.bc
                        COMMENT "\textract-bc ${FN_ARGS_TARGET}")
+
+    # Tracer tests are built again from the bitcode, with the PM tracer pass,
+    # as <target>.traced.
+    if (FN_ARGS_TOOL STREQUAL "TRACER")
+        add_custom_command(TARGET ${FN_ARGS_TARGET}
+                           POST_BUILD
+                           COMMAND ${CMAKE_BINARY_DIR}/add-tracer
+                                   $<TARGET_FILE:${FN_ARGS_TARGET}>.bc
+                                   -o $<TARGET_FILE:${FN_ARGS_TARGET}>.traced
+                           COMMENT "\tadd-tracer ${FN_ARGS_TARGET}")
+    endif()
     
     append_tool_lists(TARGET ${FN_ARGS_TARGET} 
                       TOOL ${FN_ARGS_TOOL} 
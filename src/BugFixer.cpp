@@ -2,6 +2,9 @@
 #include "FlowAnalyzer.hpp"
 #include "PassUtils.hpp"
 
+#include <algorithm>
+#include <map>
+
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/DebugInfoMetadata.h"
 #include "llvm/IR/IRBuilder.h"
@@ -128,6 +131,31 @@ bool BugFixer::addFixToMapping(const FixLoc &fl, FixDesc desc) {
     return false;
 }
 
+/**
+ * Add [start, end] to a set of disjoint ranges, merging it with any range it
+ * overlaps or touches. Returns the merged range.
+ */
+static std::pair<uint64_t, uint64_t> addRange(std::map<uint64_t, uint64_t> &ranges,
+                                              uint64_t start, uint64_t end) {
+    auto it = ranges.upper_bound(start);
+    if (it != ranges.begin()) {
+        auto prev = std::prev(it);
+        if (prev->second + 1 >= start) {
+            start = prev->first;
+            end = std::max(end, prev->second);
+            ranges.erase(prev);
+        }
+    }
+
+    while (it != ranges.end() && it->first <= end + 1) {
+        end = std::max(end, it->second);
+        it = ranges.erase(it);
+    }
+
+    ranges[start] = end;
+    return std::make_pair(start, end);
+}
+
 /**
  * If something is not persisted, that means one of three things:
  * 1. It is missing a flush.
@@ -146,91 +174,62 @@ bool BugFixer::handleAssertPersisted(const TraceEvent &te, int bug_index) {
     bool missingFence = true;
     // Need this so we know where the eventual fixes will go.
     std::list<int> opIndices;
-    // For cumulative stores.
-    AddressInfo addrInfo;
-    std::list<AddressInfo> unadded;
-    // errs() << "\t\tCHECK: " << te.addresses.front().str() << "\n";
+    // For cumulative stores, merged ranges of start -> end (inclusive).
+    std::map<uint64_t, uint64_t> stored;
+    // Where we stopped going backwards, if we did.
+    int stopIdx = -1;
+    // errs() << "\t\tCHECK: " << te.address().str() << "\n";
 
     /**
      * This can be larger than a cacheline, as it can be a bug report at the
      * end of a program.
      */
-    auto &bugAddr = te.addresses.front();
+    AddressInfo bugAddr = te.address();
 
-    // First, determine which case we are in by going backwards.
-    for (int i = bug_index - 1; i >= 0; i--) {
+    // First, determine which case we are in by going backwards. We only need
+    // to look at the operations that overlap the bug.
+    trace_.forEachOpBefore(bugAddr, bug_index, [&] (int i) {
         const TraceEvent &event = trace_[i];
-        if (!event.isOperation()) continue;
-
-        // errs() << "Current index: " <<  i << "\n";
-
-        assert(event.addresses.size() <= 1 &&
-                "Don't know how to handle more addresses!");
-        if (event.addresses.size()) {
-            auto &addr = event.addresses.front();
-
-            // if (event.type == TraceEvent::STORE && addr == bugAddr) {
-            //     assert(addr.isSingleCacheLine() && "don't know how to handle!");
-            //     /* This is the easy case, it's clear that none of the range was
-            //     persisted. */
-            //     errs() << "STORE: " << addr.str() << "\n";
-            //     missingFlush = true;
-            //     opIndices.push_back(i);
-            //     break;
-            // } else
-            if (event.type == TraceEvent::STORE && addr.overlaps(bugAddr)) {
-                // assert(addr.isSingleCacheLine() && "don't know how to handle!");
-                /* In this case, we need to validate that there are a bunch of stores that
-                    when summed together */
-                // if (!addrInfo.length)
-                //     errs() << "STORE OVERLAP: " << addr.str() << "\n";
-                if (addrInfo.canAdd(addr)) addrInfo += addr;
-                else unadded.push_back(addr);
-
-                while (!unadded.empty()) {
-                    size_t sz = unadded.size();
-                    bool added = false;
-                    for (auto u = unadded.begin(); u != unadded.end(); ++u) {
-                        if (addrInfo.canAdd(*u)) {
-                            addrInfo += *u;
-                            unadded.erase(u);
-                            added = true;
-                            break;
-                        }
-                    }
-
-                    if (!added) break;
-                    else {
-                        assert(unadded.size() < sz && "INF");
-                    }
-                }
-
-                opIndices.push_back(i);
-                // This doesn't quite make sense to me, but I'll take it.
-                // In theory, it should add up to be exact.
-                if (addrInfo.contains(bugAddr)) {
-                    // errs() << "\tACCUMULATED: " << addrInfo.str() << "\n";
-                    // errs() << "\tCOMPLETE\n";
-                    missingFlush = true;
-                    break;
-                } else {
-                    // errs() << "\tACCUMULATED: " << addrInfo.str() << "\n";
-                }
-            } else if (event.type == TraceEvent::FLUSH &&
-                        event.addresses.front().overlaps(te.addresses.front())) {
-                assert(addr.isSingleCacheLine() && "don't know how to handle!");
-                // errs() << "FLUSH: " << addr.str() << "\n";
-                // errs() << "\tACCUMULATED: " << addrInfo.str() << "\n";
-                assert(missingFence == true &&
-                        "Shouldn't be a bug in this case, has flush and fence");
-                opIndices.push_back(i);
-                break;
+        AddressInfo addr = event.address();
+
+        if (event.type == TraceEvent::STORE) {
+            /* In this case, we need to validate that there are a bunch of stores that
+                when summed together */
+            auto merged = addRange(stored, addr.start(), addr.end());
+
+            opIndices.push_back(i);
+            // This doesn't quite make sense to me, but I'll take it.
+            // In theory, it should add up to be exact.
+            if (merged.first <= bugAddr.start() && 
+                merged.second >= bugAddr.end()) {
+                // errs() << "\tCOMPLETE\n";
+                missingFlush = true;
+                stopIdx = i;
+                return false;
             }
-        } else if (event.type == TraceEvent::FENCE) {
-            // errs() << "FENCE\n";
-            missingFence = false;
-            missingFlush = true;
+
+            return true;
         }
+
+        assert(event.type == TraceEvent::FLUSH);
+        assert(addr.isSingleCacheLine() && "don't know how to handle!");
+        // errs() << "FLUSH: " << addr.str() << "\n";
+        assert(!trace_.hasFenceBetween(i, bug_index, event.thread) &&
+                "Shouldn't be a bug in this case, has flush and fence");
+        opIndices.push_back(i);
+        stopIdx = i;
+        return false;
+    });
+
+    // If there's a fence between where we stopped and the bug, we only need
+    // the flush. It has to be on the thread of the operation we stopped at,
+    // since that is where the flush goes; a fence on another thread orders
+    // nothing here.
+    uint32_t fenceThread = stopIdx >= 0 ? trace_[stopIdx].thread : te.thread;
+    if (trace_.hasFenceBetween(stopIdx, bug_index, fenceThread)) {
+        // errs() << "FENCE\n";
+        missingFence = false;
+        missingFlush = true;
     }
 
     /**
@@ -250,11 +249,11 @@ bool BugFixer::handleAssertPersisted(const TraceEvent &te, int bug_index) {
     for (int lastOpIndex : opIndices) {
         // Find where the last operation was.
         const TraceEvent &last = trace_[lastOpIndex];
-        if (mapper_.contains(last.location)) {
+        if (mapper_.contains(last.locationKey())) {
             // errs() << "Fix direct!\n";
-            // errs() << "\t\tLocation : " << last.location.str() << "\n";
-            assert(mapper_[last.location].size() && "can't have no instructions!");
-            for (const FixLoc &fLoc : mapper_[last.location]) {
+            // errs() << "\t\tLocation : " << last.location().str() << "\n";
+            assert(mapper_[last.locationKey()].size() && "can't have no instructions!");
+            for (const FixLoc &fLoc : mapper_.locate(last.callstack(), 0)) {
                 for (Instruction *i : fLoc.insts()) {
                     errs() << "\t\tInstruction : " << *i << "\n";
                     if (!isa<StoreInst>(i) && !isa<AtomicCmpXchgInst>(i)) {
@@ -267,17 +266,17 @@ bool BugFixer::handleAssertPersisted(const TraceEvent &te, int bug_index) {
                     errs() << "OG: " << fLoc.str() << "\n";
                     errs() << "CP: " << loc.str() << "\n";
 
-                    bool multiline = !last.addresses.front().isSingleCacheLine();
+                    bool multiline = !last.address().isSingleCacheLine();
                     assert(!multiline &&
                             "Don't know how to handle multi-cache line operations!");
 
                     bool res = false;
                     if (missingFlush && missingFence) {
-                        res = addFixToMapping(loc, FixDesc(ADD_FLUSH_AND_FENCE, last.callstack));
+                        res = addFixToMapping(loc, FixDesc(ADD_FLUSH_AND_FENCE, last.callstack()));
                     } else if (missingFlush) {
-                        res = addFixToMapping(loc, FixDesc(ADD_FLUSH_ONLY, last.callstack));
+                        res = addFixToMapping(loc, FixDesc(ADD_FLUSH_ONLY, last.callstack()));
                     } else if (missingFence) {
-                        res = addFixToMapping(loc, FixDesc(ADD_FENCE_ONLY, last.callstack));
+                        res = addFixToMapping(loc, FixDesc(ADD_FENCE_ONLY, last.callstack()));
                     }
 
                     // Have to do it this way, otherwise it short-circuits.
@@ -289,7 +288,7 @@ bool BugFixer::handleAssertPersisted(const TraceEvent &te, int bug_index) {
             }
         } else {
             errs() << "Forced indirect fix!\n";
-            for (const LocationInfo &li : last.callstack) {
+            for (const LocationInfo &li : last.callstack()) {
                 errs() << li.str() << " contains? " << mapper_.contains(li) << "\n";
             }
             // Here, we can take advantage of the persistent subprogram thing.
@@ -297,11 +296,11 @@ bool BugFixer::handleAssertPersisted(const TraceEvent &te, int bug_index) {
             bool res = false;
             FixDesc desc;
             if (missingFlush && missingFence) {
-                desc = FixDesc(ADD_FLUSH_AND_FENCE, last.callstack);
+                desc = FixDesc(ADD_FLUSH_AND_FENCE, last.callstack());
             } else if (missingFlush) {
-                desc = FixDesc(ADD_FLUSH_ONLY, last.callstack);
+                desc = FixDesc(ADD_FLUSH_ONLY, last.callstack());
             } else if (missingFence) {
-                desc = FixDesc(ADD_FENCE_ONLY, last.callstack);
+                desc = FixDesc(ADD_FENCE_ONLY, last.callstack());
             }
 
             res = raiseFixLocation(FixLoc::NullLoc(), desc);
@@ -329,56 +328,53 @@ bool BugFixer::handleRequiredFlush(const TraceEvent &te, int bug_index) {
 
     int redundantIdx = -1;
     int originalIdx = -1;
+    bool partial = false;
 
-    for (int i = bug_index - 1; i >= 0; i--) {
-        if (redundantIdx != -1 && originalIdx != -1) break;
+    trace_.forEachOpBefore(te.address(), bug_index, [&] (int i) {
         const TraceEvent &event = trace_[i];
-        if (!event.isOperation()) continue;
-
-        assert(event.addresses.size() <= 1 &&
-                "Don't know how to handle more addresses!");
-        if (event.addresses.size()) {
-            errs() << "IDX: " << i << "\n";
-            errs() << "EVENT: " << event.typeString << "\n";
-            errs() << "Address: " << event.addresses.front().address << "\n";
-            errs() << "Length:  " << event.addresses.front().length << "\n";
-
-            /*
-                Since we already check on the outside for multi-line flushes, we
-                don't need to re-check here.
-
-                Actually, we can likely be agnostic of size, since we will just
-                wrap the operation in a conditional regardless.
-            */
-            // assert(event.addresses.front().isSingleCacheLine() &&
-            //         "Don't know how to handle multi-cache line operations!");
-
-            if (event.type == TraceEvent::FLUSH &&
-                event.addresses.front() == te.addresses.front()) {
-                if (redundantIdx == -1) {
-                    errs() << "\tfilled redt!\n";
-                    redundantIdx = i;
-                } else {
-                    errs() << "\tfilled orig!\n";
-                    originalIdx = i;
-                    break;
-                }
-            } else if (event.type == TraceEvent::FLUSH &&
-                        event.addresses.front().overlaps(te.addresses.front())) {
-                /**
-                 * If the redundant store is not exactly equal, then we really
-                 * can't do much, because we don't want to separate out the
-                 * flush.
-                 */
-                if (redundantIdx == -1) {
-                    errs() << "Only partially redundant--abort\n";
-                    return false;
-                }
-                // Otherwise, we're good to go.
-                originalIdx = i;
-                break;
+        if (event.type != TraceEvent::FLUSH) return true;
+
+        errs() << "IDX: " << i << "\n";
+        errs() << "EVENT: " << event.typeName() << "\n";
+        errs() << "Address: " << event.address().address << "\n";
+        errs() << "Length:  " << event.address().length << "\n";
+
+        /*
+            Since we already check on the outside for multi-line flushes, we
+            don't need to re-check here.
+
+            Actually, we can likely be agnostic of size, since we will just
+            wrap the operation in a conditional regardless.
+        */
+        if (event.address() == te.address()) {
+            if (redundantIdx == -1) {
+                errs() << "\tfilled redt!\n";
+                redundantIdx = i;
+                return true;
             }
+
+            errs() << "\tfilled orig!\n";
+            originalIdx = i;
+            return false;
+        }
+
+        /**
+         * If the redundant store is not exactly equal, then we really
+         * can't do much, because we don't want to separate out the
+         * flush.
+         */
+        if (redundantIdx == -1) {
+            partial = true;
+            return false;
         }
+        // Otherwise, we're good to go.
+        originalIdx = i;
+        return false;
+    });
+
+    if (partial) {
+        errs() << "Only partially redundant--abort\n";
+        return false;
     }
 
     errs() << "\tRedundant Index : " << redundantIdx << "\n";
@@ -429,7 +425,7 @@ bool BugFixer::handleRequiredFlush(const TraceEvent &te, int bug_index) {
     }
 
     // ContextGraph<bool> graph(mapper_, orig, redt);
-    FlowAnalyzer f(module_, mapper_, orig, redt);
+    FlowAnalyzer f(ctx_, orig, redt);
     if (!f.canAnalyze()) {
         errs() << "Cannot analyze, abort\n";
         return false;
@@ -439,19 +435,19 @@ bool BugFixer::handleRequiredFlush(const TraceEvent &te, int bug_index) {
 
     // Then we can just remove the redundant flush.
     bool res = false;
-    for (auto &redtLoc : mapper_[redt.location]) {
+    for (auto &redtLoc : mapper_[redt.locationKey()]) {
         if (f.alwaysRedundant()) {
-            res = addFixToMapping(redtLoc, FixDesc(REMOVE_FLUSH_ONLY, redt.callstack));
+            res = addFixToMapping(redtLoc, FixDesc(REMOVE_FLUSH_ONLY, redt.callstack()));
             errs() << "Always redundant! " << "\n";
         } else {
             std::list<Instruction*> redundantPaths = f.redundantPaths();
 
             if (redundantPaths.size()) {
-                assert(mapper_[orig.location].size() > 0 && "can't handle!");
+                assert(mapper_[orig.locationKey()].size() > 0 && "can't handle!");
 
-                for (const FixLoc &origLoc : mapper_[orig.location]) {
+                for (const FixLoc &origLoc : mapper_[orig.locationKey()]) {
                     // Set dependent of the real fix
-                    FixDesc remove(REMOVE_FLUSH_CONDITIONAL, redt.callstack,
+                    FixDesc remove(REMOVE_FLUSH_CONDITIONAL, redt.callstack(),
                         origLoc, redundantPaths);
                     bool ret = addFixToMapping(redtLoc, remove);
                     res = res || ret;
@@ -472,7 +468,7 @@ bool BugFixer::computeAndAddFix(const TraceEvent &te, int bug_index) {
     switch(te.type) {
         case TraceEvent::ASSERT_PERSISTED: {
             errs() << "\tPersistence Bug (Universal Correctness)!\n";
-            assert(te.addresses.size() == 1 &&
+            assert(te.numAddresses() == 1 &&
                 "A persist assertion should only have 1 address!");
             return handleAssertPersisted(te, bug_index);
         }
@@ -481,9 +477,9 @@ bool BugFixer::computeAndAddFix(const TraceEvent &te, int bug_index) {
             return false;
             #if 0
             errs() << "\tPersistence Bug (Universal Performance)!\n";
-            assert(te.addresses.size() > 0 &&
+            assert(te.numAddresses() > 0 &&
                 "A redundant flush assertion needs an address!");
-            assert(te.addresses.size() == 1 &&
+            assert(te.numAddresses() == 1 &&
                 "A persist assertion should only have 1 address!");
 
             /**
@@ -491,18 +487,18 @@ bool BugFixer::computeAndAddFix(const TraceEvent &te, int bug_index) {
              * be a black box operation that we can wrap our conditional around anyways.
              */
 
-            // if (!te.addresses.front().isSingleCacheLine()) {
+            // if (!te.address().isSingleCacheLine()) {
             //     errs() << "Skip this case (multi-cache line required flush), likely an artificial flush.\n";
             //     return false;
             // }
-            // assert(te.addresses.front().isSingleCacheLine() &&
+            // assert(te.address().isSingleCacheLine() &&
             //     "Don't know how to handle non-standard ranges which cross lines!");
 
             return handleRequiredFlush(te, bug_index);
             #endif
         }
         default: {
-            errs() << "Not yet supported: " << te.typeString << "\n";
+            errs() << "Not yet supported: " << te.typeName() << "\n";
             return false;
         }
     }
@@ -613,10 +609,10 @@ bool BugFixer::raiseFixLocation(const FixLoc &fl, const FixDesc &desc) {
      * Update:
      * - We need to correlate the fix location with the input arguments
      */
-    const std::vector<LocationInfo> &stack = desc.dynStack;
+    const CallStack &stack = desc.dynStack;
     assert(!stack.empty() && "doesn't make sense!");
 
-    const FixLoc *curr = nullptr;
+    FixLoc curr;
 
     int heuristicIdx = 0;
     /**
@@ -634,7 +630,8 @@ bool BugFixer::raiseFixLocation(const FixLoc &fl, const FixDesc &desc) {
 
         for (int l = 0; l < stack.size(); ++l) {
             auto &loc = stack[l];
-            if (!mapper_.contains(loc)) {
+            const LocKey &key = stack.key(l);
+            if (!mapper_.contains(key)) {
                 scores[l] = INT64_MIN;
                 continue;
             }
@@ -645,14 +642,14 @@ bool BugFixer::raiseFixLocation(const FixLoc &fl, const FixDesc &desc) {
             // iangneal: We want unique aliases
             std::unordered_set<const llvm::Value *> volAlias, pmAlias;
 
-            if (heuristicCache_.count(loc)) {
+            if (heuristicCache_.count(key)) {
                 // errs() << "H-Cache hit!\n";
-                volAlias = heuristicCache_[loc].first;
-                pmAlias = heuristicCache_[loc].second;
+                volAlias = heuristicCache_[key].first;
+                pmAlias = heuristicCache_[key].second;
 
             } else {
 
-                for (auto &fl : mapper_[loc]) {
+                for (auto &fl : mapper_[key]) {
                     for (Instruction *inst : fl.insts()) {
 
                         Instruction *i = inst;
@@ -758,8 +755,8 @@ bool BugFixer::raiseFixLocation(const FixLoc &fl, const FixDesc &desc) {
 
             end:
 
-            heuristicCache_[loc].first = volAlias;
-            heuristicCache_[loc].second = pmAlias;
+            heuristicCache_[key].first = volAlias;
+            heuristicCache_[key].second = pmAlias;
 
             errs() << loc.str() << "\n[" << l << "] VOL: " << volAlias.size() << " PM: " << pmAlias.size() << "\n";
             // errs() << loc.str() << "\t[" << minIdx << "] VOL: " << minVolAlias << " PM: " << maxPmAlias << "\n";
@@ -814,14 +811,14 @@ bool BugFixer::raiseFixLocation(const FixLoc &fl, const FixDesc &desc) {
     // errs() << "idx=" << idx << " stacksz=" << stack.size() << "\n";
 
     while (idx < stack.size()) {
-        if (!startInst && !mapper_.contains(stack[idx])) {
+        if (!startInst && !mapper_.contains(stack.key(idx))) {
             errs() << "LI: " << stack[idx].str() << " NOT CONTAINED\n";
             raised = true;
             idx++;
             continue;
         }
 
-        auto &fixLocList = mapper_[stack[idx]];
+        std::list<FixLoc> fixLocList = mapper_.locate(stack, idx);
         if (fixLocList.size() > 1) {
             // Make sure they're all in the same function, cuz then it's fine.
             std::unordered_set<Function*> fns;
@@ -829,9 +826,9 @@ bool BugFixer::raiseFixLocation(const FixLoc &fl, const FixDesc &desc) {
             assert(fns.size() == 1 && "don't know how to handle this weird code!");
         }
 
-        curr = &fixLocList.front();
+        curr = fixLocList.front();
 
-        Function *f = curr->last->getFunction();
+        Function *f = curr.last->getFunction();
         if (immutableFns_.count(f)) {
             // Optimization 1: If it is immutable.
             errs() << "LI: " << stack[idx].str() << " RAISING ABOVE IMMUTABLE\n";
@@ -848,8 +845,8 @@ bool BugFixer::raiseFixLocation(const FixLoc &fl, const FixDesc &desc) {
         FixType ft = desc.type == ADD_FLUSH_ONLY ?
             ADD_PERSIST_CALLSTACK_OPT_NOFENCE : ADD_PERSIST_CALLSTACK_OPT;
         auto desc = FixDesc(ft, stack, idx);
-        assert(curr && "cannot be null!");
-        success = addFixToMapping(*curr, desc);
+        assert(curr.isValid() && "cannot be null!");
+        success = addFixToMapping(curr, desc);
     }
 
     if (idx > heuristicIdx) {
@@ -1072,6 +1069,15 @@ bool BugFixer::doRepair(void) {
     errs() << "Fixed " << nfixes << " of " << nbugs << " identified! ("
         << trace_.bugs().size() << " in trace)\n";
 
+    if (trace_.numSegments() > 1) {
+        size_t nreports = 0;
+        for (int bug_index : trace_.bugs()) {
+            nreports += trace_.occurrences(bug_index);
+        }
+        errs() << "\t(" << nreports << " reports across "
+            << trace_.numSegments() << " traces)\n";
+    }
+
     delete fixer;
 
     return modified;
@@ -1094,8 +1100,10 @@ void BugFixer::runTraceAA() {
 
     // Get all the functions used in the trace.
     unordered_set<Value*> used;
-    for (const TraceEvent &te : trace_.events()) {
-        for (const LocationInfo &li : te.callstack) {
+    trace_.forAllLocations([&] (const TraceEvent &te) {
+        CallStack callstack = te.callstack();
+        for (size_t i = 0; i < callstack.size(); ++i) {
+            const LocKey &li = callstack.key(i);
             if (!mapper_.contains(li)) continue;
 
             for (const FixLoc &fl : mapper_[li]) {
@@ -1108,7 +1116,7 @@ void BugFixer::runTraceAA() {
 
             }
         }
-    }
+    });
 
     // Add a small whitelist
     std::unordered_set<std::string> whitelist = {"pmemobj_open"};
@@ -1207,12 +1215,12 @@ void BugFixer::runTraceAA() {
 
     errs() << "analysis start!\n";
 
-    pmDesc_.reset(new PmDesc(*dupMod_));
+    pmDesc_.reset(new PmDesc(ctx_, *dupMod_));
 
     errs() << "analysis done!\n";
 
     // Set values
-    for (auto &te : trace_.events()) {
+    trace_.forAllLocations([&] (const TraceEvent &te) {
         for (auto *val : te.pmValues(mapper_)) {
             Value *v = vMap_[val];
             // errs() << "PMV: " << *v << "\n";
@@ -1221,7 +1229,7 @@ void BugFixer::runTraceAA() {
 
             // assert(pmDesc_->pointsToPm(v));
         }
-    }
+    });
 
     // errs() << "added pmv values!\n";
     // errs() << pmDesc_->str() << "\n";
@@ -1259,12 +1267,12 @@ void BugFixer::runReducedAllocAA() {
     errs() << "erasure done!\n";
 
     // Finally, do the analysis
-    pmDesc_.reset(new PmDesc(*dupMod_));
+    pmDesc_.reset(new PmDesc(ctx_, *dupMod_));
 
     errs() << "analysis done!\n";
 
     // Set values
-    for (auto &te : trace_.events()) {
+    trace_.forAllLocations([&] (const TraceEvent &te) {
         for (auto *val : te.pmValues(mapper_)) {
             Value *v = vMap_[val];
             // errs() << "PMV: " << *v << "\n";
@@ -1273,14 +1281,14 @@ void BugFixer::runReducedAllocAA() {
 
             // assert(pmDesc_->pointsToPm(v));
         }
-    }
+    });
 
     errs() << "added pmv values!\n";
     errs() << pmDesc_->str() << "\n";
 }
 
-BugFixer::BugFixer(llvm::Module &m, TraceInfo &ti)
-    : module_(m), trace_(ti), mapper_(BugLocationMapper::getInstance(m)),
+BugFixer::BugFixer(FixerContext &ctx, TraceInfo &ti)
+    : ctx_(ctx), module_(ctx.module()), trace_(ti), mapper_(ctx.mapper()),
       pmDesc_(nullptr), dupMod_(nullptr), summary_(SummaryFile.c_str()) {
     for (const std::string &fnName : immutableFnNames_) {
         addImmutableFunction(fnName);
@@ -1304,15 +1312,15 @@ BugFixer::BugFixer(llvm::Module &m, TraceInfo &ti)
             if (EnableMmapAA) errs() << "Running MmapAA!\n";
             else errs() << "Running VanillaAA!\n";
 
-            pmDesc_.reset(new PmDesc(module_));
+            pmDesc_.reset(new PmDesc(ctx_));
 
             // Set values
-            for (auto &te : trace_.events()) {
+            trace_.forAllLocations([&] (const TraceEvent &te) {
                 errs() << te.str() << "\n";
                 for (auto *val : te.pmValues(mapper_)) {
                     pmDesc_->addKnownPmValue(val);
                 }
-            }
+            });
         }
         // errs() << "scoping\n";
     }
@@ -14,6 +14,7 @@
 #include "FixGenerator.hpp"
 #include "BugReports.hpp"
 #include "FlowAnalyzer.hpp"
+#include "FixerContext.hpp"
 
 #include "llvm/Transforms/Utils/Cloning.h"
 
@@ -28,6 +29,7 @@ namespace pmfix {
  */
 class BugFixer final {
 private:
+    FixerContext &ctx_;
     llvm::Module &module_;
     TraceInfo &trace_;
     BugLocationMapper &mapper_;
@@ -38,10 +40,10 @@ private:
     std::ofstream summary_;
     size_t summaryNum_ = 0;
 
-    std::unordered_map<LocationInfo,
+    std::unordered_map<LocKey,
                        std::pair<std::unordered_set<const llvm::Value *>, 
                                  std::unordered_set<const llvm::Value *>>,
-                       LocationInfo::Hash> heuristicCache_;
+                       LocKey::Hash> heuristicCache_;
 
     /**
      * We're not allowed to insert fixes into some functions. These are some 
@@ -92,7 +94,7 @@ private:
      */
     struct FixDesc {
         FixType type;
-        std::vector<LocationInfo> dynStack;
+        CallStack dynStack;
         /**
          * Used for the callstack optimized version.
          */
@@ -109,10 +111,10 @@ private:
             : type(NO_FIX), dynStack(), stackIdx(0), 
             originals(), points() {}
         
-        FixDesc(FixType t, const std::vector<LocationInfo> &l, int si=0) 
+        FixDesc(FixType t, const CallStack &l, int si=0) 
             : type(t), dynStack(l), stackIdx(si), originals(), points() {}
         
-        FixDesc(FixType t, const std::vector<LocationInfo> &l, 
+        FixDesc(FixType t, const CallStack &l, 
                 const FixLoc &o, std::list<llvm::Instruction*> p) 
             : type(t), dynStack(l), stackIdx(0), originals(), points(p) {
                 originals.push_back(o);
@@ -206,7 +208,7 @@ private:
     void runReducedAllocAA(void);
 
 public:
-    BugFixer(llvm::Module &m, TraceInfo &ti);
+    BugFixer(FixerContext &ctx, TraceInfo &ti);
 
     /**
      * Do the program repair!
@@ -1,29 +1,66 @@
 #include "BugReports.hpp"
 #include "PassUtils.hpp"
+#include "TraceIO.hpp"
+#include "TraceReducer.hpp"
+#include "TraceYaml.hpp"
 
 #include <algorithm>
 #include <cctype>
 #include <iomanip>
+#include <mutex>
+#include <set>
 #include <sstream>
+#include <thread>
 #include <unistd.h>
 
+#include "llvm/ADT/Hashing.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Instruction.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/DebugInfoMetadata.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/ThreadPool.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
 
-#include "llvm/Analysis/OrderedBasicBlock.h"
 
 using namespace llvm;
 using namespace pmfix;
 using namespace std;
 
+cl::opt<bool> ReduceTrace("reduce-trace", cl::init(false),
+    cl::desc("Run the parse-trace reduction (Reports.py) on the trace before "
+             "fixing, for traces that were written without it"));
+
+cl::opt<bool> TraceWindow("trace-window", cl::init(false),
+    cl::desc("Only keep the stores and flushes that overlap a bug, and one "
+             "fence of each run (steps 2 and 4 of the -reduce-trace "
+             "reduction). Bugs and everything else are kept as they are"));
+
+cl::opt<std::string> TraceCacheDir("trace-cache-dir", cl::init(""),
+    cl::desc("Directory for snapshots of the resolved trace, keyed by the "
+             "module and trace contents. Later runs on the same inputs "
+             "load the snapshot instead of the trace."));
+
 #pragma region AddressInfo
 
-bool AddressInfo::isSingleCacheLine(void) const {
+uint64_t AddressInfo::cacheLineSize(void) {
     static uint64_t cl_sz = (uint64_t)sysconf(_SC_LEVEL1_DCACHE_LINESIZE);
+    return cl_sz;
+}
+
+bool AddressInfo::isSingleCacheLine(void) const {
+    uint64_t cl_sz = cacheLineSize();
     uint64_t cl_start = start() / cl_sz;
     uint64_t cl_end = end() / cl_sz;
     return cl_start == cl_end;
@@ -84,6 +121,17 @@ void AddressInfo::operator+=(const AddressInfo &other) {
 
 #pragma region LocationInfo
 
+uint64_t LocationInfo::Hash::operator()(const LocationInfo &li) const {
+    StringRef file(li.file);
+    size_t pos = file.find_last_of('/');
+    if (pos != StringRef::npos) file = file.substr(pos + 1);
+    return hash_combine(li.function, file, li.line);
+}
+
+uint64_t LocationInfo::ExactHash::operator()(const LocationInfo &li) const {
+    return hash_combine(li.function, li.file, li.line);
+}
+
 std::string LocationInfo::getFilename(void) const {
     size_t pos = file.find_last_of("/");
     if (pos == std::string::npos) return file;
@@ -121,6 +169,46 @@ std::string LocationInfo::str() const {
 
 #pragma endregion
 
+#pragma region StackTable
+
+uint64_t StackTable::StackHash::operator()(
+    const std::vector<FrameId> &s) const {
+    return hash_combine_range(s.begin(), s.end());
+}
+
+StackTable::FrameId StackTable::internFrame(const LocationInfo &li) {
+    auto it = frameIds_.find(li);
+    if (it != frameIds_.end()) return it->second;
+
+    FrameId id = frames_.size();
+    frames_.push_back(li);
+    keys_.emplace_back();
+    frameIds_.emplace(li, id);
+    return id;
+}
+
+StackTable::StackId StackTable::internStack(const std::vector<FrameId> &frames) {
+    auto it = stackIds_.find(frames);
+    if (it != stackIds_.end()) return it->second;
+
+    StackId id = stacks_.size();
+    stacks_.push_back(frames);
+    stackIds_.emplace(frames, id);
+    return id;
+}
+
+CallStack::const_iterator CallStack::begin() const {
+    if (!table_) return const_iterator(nullptr, {});
+    return const_iterator(table_, frames().begin());
+}
+
+CallStack::const_iterator CallStack::end() const {
+    if (!table_) return const_iterator(nullptr, {});
+    return const_iterator(table_, frames().end());
+}
+
+#pragma endregion
+
 #pragma region FixLoc
 
 uint64_t FixLoc::Hash::operator()(const FixLoc &fl) const {
@@ -163,6 +251,10 @@ std::string FixLoc::str() const {
     ss << "<FixLoc>\n";
     ss << "\tFunction:\t" << first->getFunction()->getName() << "\n";
     ss << "\tSource Location: " << dbgLoc.str() << "\n";
+    if (inlinedAt) {
+        ss << "\tInlined At: " << inlinedAt->getFilename() << ":" << 
+            inlinedAt->getLine() << ":" << inlinedAt->getColumn() << "\n";
+    }
     ss << "\tInstructions:\n";
     for (Instruction *i : insts()) {
         ss << "\t\t" << *i << "\n";
@@ -174,32 +266,149 @@ std::string FixLoc::str() const {
 
 #pragma endregion
 
+#pragma region CallSites
+
+const char *CallSites::memKindName(MemKind kind) {
+    switch (kind) {
+        case MEMCPY: return "memcpy";
+        case MEMSET: return "memset";
+        case MEMMOVE: return "memmove";
+        case STRNCPY: return "strncpy";
+        default: return nullptr;
+    }
+}
+
+void CallSites::add(CallBase *cb) {
+    if (isa<DbgInfoIntrinsic>(cb)) return;
+    all.push_back(cb);
+
+    Function *f = cb->getCalledFunction();
+    if (!f) {
+        indirect.push_back(cb);
+        return;
+    }
+
+    byCallee[f].push_back(cb);
+
+    // Mangled names have the identifiers as they are, so no need to demangle.
+    for (int kind = 0; kind < NUM_MEM_KINDS; ++kind) {
+        if (f->getName().contains(memKindName((MemKind)kind))) {
+            memory[kind].push_back(cb);
+            break;
+        }
+    }
+}
+
+#pragma endregion
+
 #pragma region BugLocationMapper
 
-std::unique_ptr<BugLocationMapper> BugLocationMapper::instance(nullptr);
+uint32_t BugLocationMapper::intern(StringMap<uint32_t> &ids, 
+                                   std::vector<std::string> &names,
+                                   StringRef s) {
+    auto it = ids.find(s);
+    if (it != ids.end()) return it->second;
+
+    uint32_t id = names.size();
+    names.push_back(s.str());
+    ids[s] = id;
+    return id;
+}
+
+const std::vector<uint32_t> &BugLocationMapper::matchFile(
+    const std::string &path) const {
+    // Files are added as functions are mapped, so only check the new ones.
+    FileMatches &matches = fileMatches_[path];
+    for (; matches.scanned < files_.size(); ++matches.scanned) {
+        // Same as LocationInfo::operator==: the directories can vary, so if
+        // the shorter path fits in the longer, it's good enough.
+        const std::string &file = files_[matches.scanned];
+        size_t pos = file.size() < path.size() ? 
+                     path.find(file) : file.find(path);
+        if (pos != std::string::npos) matches.ids.push_back(matches.scanned);
+    }
+
+    return matches.ids;
+}
+
+LocKey BugLocationMapper::key(const LocationInfo &li) const {
+    auto it = keys_.find(li);
+    if (it != keys_.end()) return it->second;
+
+    LocKey k;
+    k.line = li.line;
+
+    auto fit = fnIds_.find(li.function);
+    if (fit != fnIds_.end()) {
+        k.function = fit->second;
+        mapFunction(k.function);
+
+        // If several files match, prefer one that actually has the location.
+        const std::vector<uint32_t> &matches = matchFile(li.file);
+        for (uint32_t fileId : matches) {
+            LocKey cand = k;
+            cand.file = fileId;
+            if (locMap_.count(cand)) {
+                k.file = fileId;
+                break;
+            }
+        }
 
-BugLocationMapper &BugLocationMapper::getInstance(Module &m) {
-    if (!instance) {
-        instance.reset(new BugLocationMapper(m));
+        if (k.file == LocKey::NONE && !matches.empty()) {
+            k.file = matches.front();
+        }
     }
 
-    return *instance;
+    keys_.emplace(li, k);
+    return k;
+}
+
+StringRef BugLocationMapper::inlinedFunctionName(const DILocation *loc) {
+    DISubprogram *sp = loc->getScope()->getSubprogram();
+    StringRef name = sp->getLinkageName();
+    return name.empty() ? sp->getName() : name;
+}
+
+uint32_t BugLocationMapper::partFunction(Partial &part, StringRef name) const {
+    // Nothing adds to fnIds_ while workers run, see mapFunctions().
+    auto it = fnIds_.find(name);
+    if (it != fnIds_.end()) return it->second;
+    return LOCAL_FN | intern(part.fnIds, part.functions, name);
+}
+
+const std::string &BugLocationMapper::functionName(const Partial &part, 
+                                                   uint32_t id) const {
+    return id & LOCAL_FN ? part.functions[id & ~LOCAL_FN] : functions_[id];
 }
 
-void BugLocationMapper::insertMapping(Instruction *i) {
+void BugLocationMapper::addMapping(FunctionLocs &locs, const LocKey &k, 
+                                   Instruction *i, const DILocation *site) {
+    std::list<Instruction*> &insts = locs.insts[k];
+    if (insts.empty()) locs.keys.push_back(k);
+    // Levels of the chain can have the same key.
+    if (!insts.empty() && insts.back() == i) return;
+    insts.push_back(i);
+    locs.sites[k].push_back(site);
+}
+
+void BugLocationMapper::insertMapping(uint32_t fn, Instruction *i,
+                                      Partial &part,
+                                      FunctionLocs &locs) const {
     // Essentially, need to get the line number and file name from the 
-    // instruction debug information.
+    // instruction debug information. By kind ID, since looking the kind up
+    // by name goes through the (shared) context.
     if (!i->hasMetadata()) return;
-    if (!i->getMetadata("dbg")) return;
+    MDNode *md = i->getMetadata(LLVMContext::MD_dbg);
+    if (!md) return;
 
-    if (DILocation *di = dyn_cast<DILocation>(i->getMetadata("dbg"))) {
-        LocationInfo li;
-        li.function = i->getFunction()->getName();
+    if (DILocation *di = dyn_cast<DILocation>(md)) {
+        LocKey li;
+        li.function = fn;
         li.line = di->getLine();
 
         DILocalScope *ls = di->getScope();
         DIFile *df = ls->getFile();
-        li.file = df->getFilename();
+        li.file = intern(part.fileIds, part.files, df->getFilename());
 
         // if ("memset_mov_sse2_empty" == li.function) {
         //     errs() << "DBG: " << li.str() << " ===== " << *i << '\n';
@@ -219,84 +428,368 @@ void BugLocationMapper::insertMapping(Instruction *i) {
         //     assert(locMap_[li]->getParent() == i->getParent() && 
         //            "Assumptions violated, instructions not in same basic block!");
         // }
-        locMap_[li].push_back(i);
+
+        // The innermost line in the function the code ended up in, which is
+        // what traces without inlined frames report.
+        addMapping(locs, li, i, di->getInlinedAt());
+
+        // Then each level of the inlined-at chain: the line in the inlined
+        // function, then the line of each call it was inlined at, out to
+        // the line in fn.
+        if (!di->getInlinedAt()) return;
+        for (const DILocation *loc = di; loc; loc = loc->getInlinedAt()) {
+            const DILocation *site = loc->getInlinedAt();
+
+            LocKey k;
+            k.function = site ? partFunction(part, inlinedFunctionName(loc)) 
+                              : fn;
+            k.file = intern(part.fileIds, part.files, loc->getFilename());
+            k.line = loc->getLine();
+            addMapping(locs, k, i, site);
+        }
     }
 }
 
-void BugLocationMapper::createMappings(Module &m) {
+StringRef BugLocationMapper::stripCloneSuffix(StringRef name) {
+    // Never a leading '.', so ".str"-style names stay as they are.
+    size_t dot = name.find('.', 1);
+    return dot == StringRef::npos ? name : name.substr(0, dot);
+}
+
+void BugLocationMapper::indexFunctions(Module &m) {
+    assert(m.debug_compile_units_begin() != m.debug_compile_units_end() &&
+           "no debug information found!!!");
+
     for (Function &f : m) {
-        for (BasicBlock &b : f) {
-            for (Instruction &i : b) {
-                // Ignore instructions we don't care too much about.
-                // if (!isa<StoreInst>(&i) && !isa<CallBase>(&i)) continue;
-                // Turns out we DO care.
-                insertMapping(&i);
+        if (f.isIntrinsic()) continue;
+
+        StringRef name = f.getName();
+        if (!f.isDeclaration()) {
+            uint32_t id = intern(fnIds_, functions_, name);
+            assert(id == fnDefs_.size() && "duplicate function name!");
+            fnDefs_.push_back(&f);
+            numDefs_++;
+        }
+
+        StringRef base = stripCloneSuffix(name);
+        fnsByName_[base].push_back(&f);
+
+        std::string demangledBase = utils::demangle(base.str().c_str());
+        if (demangledBase != base) {
+            fnsByName_[demangledBase].push_back(&f);
+        }
+    }
+    mapped_.resize(fnDefs_.size());
+}
+
+const std::string &BugLocationMapper::demangledName(const Function *f) const {
+    assert(f->getParent() == &m_ && "function not in the module!");
+    auto it = demangled_.find(f);
+    if (it == demangled_.end()) {
+        std::string name = utils::demangle(f->getName().str().c_str());
+        it = demangled_.insert(std::make_pair(f, std::move(name))).first;
+    }
+    return it->second;
+}
+
+Function *BugLocationMapper::findFunction(StringRef name) const {
+    if (Function *f = m_.getFunction(name)) return f;
+
+    // Demangled names can contain dots ("foo(int, ...)"), so only strip
+    // the name if it isn't found as it is.
+    auto it = fnsByName_.find(name);
+    if (it == fnsByName_.end()) it = fnsByName_.find(stripCloneSuffix(name));
+    if (it == fnsByName_.end() || it->second.size() != 1) return nullptr;
+    return it->second.front();
+}
+
+std::list<FixLoc> BugLocationMapper::createFixLocs(
+    const LocKey &location,
+    const std::list<Instruction*> &instructions,
+    const std::vector<const DILocation*> &sites,
+    const Partial &part,
+    const DenseMap<const Instruction*, unsigned> &ordinals) const {
+
+    // Copies of inlined code get their own FixLocs, even in the same block.
+    // The inlined-at location has the column, so two calls on one line are
+    // told apart too.
+    std::map<std::pair<BasicBlock*, const DILocation*>, 
+             std::list<Instruction*>> blocks;
+    auto site = sites.begin();
+    for (Instruction *q : instructions) {
+        const DILocation *inlinedAt = *site++;
+        if (auto *cb = dyn_cast<CallBase>(q)) {
+            Function *f = cb->getCalledFunction();
+            if (f && f->getIntrinsicID() == Intrinsic::dbg_declare) {
+                continue;
             }
         }
+
+        blocks[std::make_pair(q->getParent(), inlinedAt)].push_back(q);
     }
 
-    assert(locMap_.size() && "no debug information found!!!");
+    std::list<FixLoc> locs;
+    for (auto &p : blocks) {
+        auto &insts = p.second;
+        assert(insts.size() && "wat");
+        // Need to find the first and last instruction
+        Instruction *first = insts.front();
+        Instruction *last = insts.front();
+        unsigned firstOrd = ordinals.lookup(first);
+        unsigned lastOrd = firstOrd;
+
+        for (auto *ii : insts) {
+            unsigned ord = ordinals.lookup(ii);
+            if (ord < firstOrd) {
+                first = ii;
+                firstOrd = ord;
+            }
+            if (ord > lastOrd) {
+                last = ii;
+                lastOrd = ord;
+            }
+        }
+
+        LocationInfo li;
+        li.function = functionName(part, location.function);
+        li.file = part.files[location.file];
+        li.line = location.line;
+        locs.emplace_back(first, last, li);
+        locs.back().inlinedAt = p.first.second;
+    }
+
+    return locs;
+}
+
+void BugLocationMapper::mapInto(uint32_t fn, Partial &part) const {
+    FunctionLocs locs;
+    // Position of each instruction in its block, numbered once for the
+    // function rather than per location.
+    DenseMap<const Instruction*, unsigned> ordinals;
+    ordinals.reserve(fnDefs_[fn]->getInstructionCount());
+
+    for (BasicBlock &b : *fnDefs_[fn]) {
+        unsigned ord = 0;
+        for (Instruction &i : b) {
+            ordinals[&i] = ord++;
+            // Ignore instructions we don't care too much about.
+            // if (!isa<StoreInst>(&i) && !isa<CallBase>(&i)) continue;
+            // Turns out we DO care.
+            insertMapping(fn, &i, part, locs);
+        }
+    }
 
     /**
      * Now, we do the fix mapping.
      */
-    for (auto &p : locMap_) {
-        auto &location = p.first;
-        auto &instructions = p.second;
-
-        std::unordered_map<BasicBlock*, std::list<Instruction*>> blocks;
-        for (Instruction *q : instructions) {
-            if (auto *cb = dyn_cast<CallBase>(q)) {
-                Function *f = cb->getCalledFunction();
-                if (f && f->getIntrinsicID() == Intrinsic::dbg_declare) {
-                    continue;
-                }
+    for (const LocKey &location : locs.keys) {
+        std::list<Instruction*> &insts = locs.insts[location];
+        std::list<FixLoc> fixLocs = createFixLocs(
+            location, insts, locs.sites[location], part, ordinals);
+
+        // Index the calls in the same ranges consumers used to scan.
+        CallSites &sites = part.callSites[location];
+        for (const FixLoc &fl : fixLocs) {
+            for (Instruction *i : fl.insts()) {
+                if (auto *cb = dyn_cast<CallBase>(i)) sites.add(cb);
             }
+        }
+        if (sites.empty()) part.callSites.erase(location);
+
+        // Inlined functions can already have locations from elsewhere.
+        part.fixLocMap[location].splice(part.fixLocMap[location].end(), 
+                                        fixLocs);
+        part.locMap[location].splice(part.locMap[location].end(), insts);
+    }
+}
 
-            blocks[q->getParent()].push_back(q);
+void BugLocationMapper::merge(Partial &part) const {
+    size_t numFunctions = functions_.size();
+    size_t numFiles = files_.size();
+    size_t numLocations = locMap_.size();
+
+    std::vector<uint32_t> fnIds;
+    for (const std::string &name : part.functions) {
+        uint32_t id = intern(fnIds_, functions_, name);
+        if (id == fnDefs_.size()) {
+            // Only inlined, so there is nothing of its own to map.
+            fnDefs_.push_back(nullptr);
+            mapped_.push_back(true);
         }
+        fnIds.push_back(id);
+    }
 
-        std::list<FixLoc> locs;
-        for (auto &p : blocks) {
-            auto &insts = p.second;
-            assert(insts.size() && "wat");
-            // Need to find the first and last instruction
-            Instruction *first = insts.front();
-            Instruction *last = insts.back();
+    std::vector<uint32_t> fileIds;
+    for (const std::string &file : part.files) {
+        fileIds.push_back(intern(fileIds_, files_, file));
+    }
 
-            OrderedBasicBlock obb(p.first);
+    auto remap = [&] (LocKey k) {
+        if (k.function & LOCAL_FN) k.function = fnIds[k.function & ~LOCAL_FN];
+        k.file = fileIds[k.file];
+        return k;
+    };
 
-            for (auto *ii : insts) {
-                if (obb.dominates(ii, first)) first = ii;
-                if (obb.dominates(last, ii)) last = ii;
-            }
+    for (auto &p : part.locMap) {
+        std::list<Instruction*> &insts = locMap_[remap(p.first)];
+        insts.splice(insts.end(), p.second);
+    }
+
+    for (auto &p : part.fixLocMap) {
+        std::list<FixLoc> &locs = fixLocMap_[remap(p.first)];
+        locs.splice(locs.end(), p.second);
+    }
 
-            locs.emplace_back(first, last, location);
+    for (auto &p : part.callSites) {
+        CallSites &sites = callSites_[remap(p.first)];
+        for (CallBase *cb : p.second.all) sites.add(cb);
+    }
+
+    // A function that was unknown, or a file that now has the location, can
+    // change the keys computed so far.
+    if (functions_.size() != numFunctions || files_.size() != numFiles ||
+        locMap_.size() != numLocations) {
+        keys_.clear();
+    }
+}
+
+void BugLocationMapper::mapFunction(uint32_t fn) const {
+    if (mapped_[fn]) return;
+    mapped_[fn] = true;
+    numMapped_++;
+
+    Partial part;
+    mapInto(fn, part);
+    merge(part);
+}
+
+void BugLocationMapper::mapFunctions(
+    const std::vector<StringRef> &names) const {
+    std::vector<uint32_t> fns;
+    for (StringRef name : names) {
+        auto it = fnIds_.find(name);
+        if (it == fnIds_.end() || mapped_[it->second]) continue;
+        mapped_[it->second] = true;
+        fns.push_back(it->second);
+    }
+    if (fns.empty()) return;
+    numMapped_ += fns.size();
+
+    // Functions are independent, so each worker maps its share into its own
+    // partial map, and only the merge touches the mapper.
+    size_t numWorkers = std::min<size_t>(fns.size(), 
+        std::max(1u, std::thread::hardware_concurrency()));
+    std::vector<Partial> parts(numWorkers);
+    {
+        ThreadPool pool;
+        for (size_t w = 0; w < numWorkers; ++w) {
+            pool.async([this, &fns, &parts, numWorkers, w] {
+                // Interleaved, so one worker doesn't get a run of big
+                // functions.
+                for (size_t i = w; i < fns.size(); i += numWorkers) {
+                    mapInto(fns[i], parts[w]);
+                }
+            });
         }
+        pool.wait();
+    }
 
-        fixLocMap_[location] = locs;
+    for (Partial &part : parts) {
+        merge(part);
     }
+}
 
-    // errs() << "fix map size: " << fixLocMap_.size() << "\n";
-    // const char fnHack[] = "do_slabs_free";
-    // errs() << *m.getFunction(fnHack) << "\n";
-    // for (auto &p : fixLocMap_) {
-    //     if (p.first.function == fnHack) {
-    //         errs() << p.first.str() << "\n";
-    //         for (FixLoc &fl : p.second) {
-    //             errs() << "\t" << fl.str() << "\n";
-    //         }
-    //     }
-    // }
-    // errs() << "inst map size " << locMap_.size() << "\n";
-    // for (auto &p : locMap_) {
-    //     if (p.first.function == fnHack) {
-    //         errs() << p.first.str() << "\n";
-    //     }
-    // }
-    // assert(false);
-    
-    assert(!fixLocMap_.empty() && "wat");
+const CallSites &BugLocationMapper::callSites(const LocKey &k) const {
+    static const CallSites none;
+    auto it = callSites_.find(k);
+    return it == callSites_.end() ? none : it->second;
+}
+
+std::vector<CallBase*> BugLocationMapper::callsTo(const LocKey &k, 
+                                                  StringRef callee) const {
+    const CallSites &sites = callSites(k);
+
+    if (Function *f = findFunction(callee)) {
+        auto it = sites.byCallee.find(f);
+        if (it != sites.byCallee.end()) return it->second;
+    }
+
+    // Trace names can be partial, so fall back to matching them against
+    // each distinct callee once.
+    DenseMap<const Function*, bool> matches;
+    for (auto &p : sites.byCallee) {
+        matches[p.first] = StringRef(demangledName(p.first)).contains(callee);
+    }
+
+    std::vector<CallBase*> calls;
+    for (CallBase *cb : sites.all) {
+        Function *f = cb->getCalledFunction();
+        if (!f || matches.lookup(f)) calls.push_back(cb);
+    }
+    return calls;
+}
+
+LocKey BugLocationMapper::siteKey(const DILocation *site, 
+                                  const Function *f) const {
+    // The key insertMapping gave this level of the chain.
+    LocKey k;
+    k.line = site->getLine();
+
+    auto fn = fnIds_.find(site->getInlinedAt() ? inlinedFunctionName(site) 
+                                               : f->getName());
+    auto file = fileIds_.find(site->getFilename());
+    if (fn == fnIds_.end() || file == fileIds_.end()) return k;
+
+    k.function = fn->second;
+    k.file = file->second;
+    return k;
+}
+
+bool BugLocationMapper::inlinedAlong(const FixLoc &fl, const CallStack &cs,
+                                     size_t idx) const {
+    size_t frame = idx + 1;
+    for (const DILocation *site = fl.inlinedAt; site; 
+         site = site->getInlinedAt(), ++frame) {
+        if (frame >= cs.size()) return false;
+
+        LocKey k = siteKey(site, fl.first->getFunction());
+        if (!k.valid() || k != cs.key(frame)) return false;
+    }
+
+    return true;
+}
+
+std::list<FixLoc> BugLocationMapper::locate(const CallStack &cs, 
+                                            size_t idx) const {
+    const std::list<FixLoc> &all = (*this)[cs.key(idx)];
+
+    std::list<FixLoc> inlined, outOfLine;
+    for (const FixLoc &fl : all) {
+        if (!fl.inlinedAt) {
+            outOfLine.push_back(fl);
+        } else if (inlinedAlong(fl, cs, idx)) {
+            inlined.push_back(fl);
+        }
+    }
+
+    if (!inlined.empty()) return inlined;
+    if (!outOfLine.empty()) return outOfLine;
+    return all;
+}
+
+bool BugLocationMapper::isInlinedAt(const LocationInfo &callee, 
+                                    const LocationInfo &caller) const {
+    LocKey calleeKey = key(callee), callerKey = key(caller);
+    if (!contains(calleeKey)) return false;
+
+    for (const FixLoc &fl : (*this)[calleeKey]) {
+        if (!fl.inlinedAt) continue;
+        if (siteKey(fl.inlinedAt, fl.first->getFunction()) == callerKey) {
+            return true;
+        }
+    }
+
+    return false;
 }
 
 #pragma endregion
@@ -304,16 +797,30 @@ void BugLocationMapper::createMappings(Module &m) {
 #pragma region TraceEvent
 
 TraceEvent::Type TraceEvent::getType(string typeString) {
-    transform(typeString.begin(), typeString.end(), typeString.begin(), 
-              [](unsigned char c) -> unsigned char { return std::tolower(c); });
-    if (typeString == "store") return TraceEvent::STORE;
-    if (typeString == "flush") return TraceEvent::FLUSH;
-    if (typeString == "fence") return TraceEvent::FENCE;
-    if (typeString == "assert_persisted") return TraceEvent::ASSERT_PERSISTED;
-    if (typeString == "assert_ordered") return TraceEvent::ASSERT_ORDERED;
-    if (typeString == "required_flush") return TraceEvent::REQUIRED_FLUSH;
-    
-    return TraceEvent::INVALID;
+    trace::EventKind kind = trace::kindFromString(typeString);
+    if (kind == trace::EventKind::INVALID) return TraceEvent::INVALID;
+
+    return static_cast<TraceEvent::Type>(kind);
+}
+
+const char *TraceEvent::typeName(void) const {
+    return trace::kindName(static_cast<trace::EventKind>(type));
+}
+
+void TraceEvent::setCallStack(const CallStack &cs) {
+    assert(cs.id() < (1u << 30) && "too many stacks!");
+    stacks_ = cs.table();
+    stack_ = cs.id();
+}
+
+void TraceEvent::addAddress(const AddressInfo &ai) {
+    assert(numAddresses_ < MAX_ADDRESSES && "too many addresses!");
+    assert(ai.length <= UINT32_MAX && "address range too long!");
+    assert(ai.address < (1ull << 48) && "address out of range!");
+    addressLow_[numAddresses_] = (uint32_t)ai.address;
+    addressHigh_[numAddresses_] = (uint16_t)(ai.address >> 32);
+    length_[numAddresses_] = ai.length;
+    numAddresses_++;
 }
 
 template< typename T >
@@ -329,19 +836,19 @@ std::string int_to_hex( T i )
 std::string TraceEvent::str() const {
     std::stringstream buffer;
 
-    buffer << "Event (time=" << timestamp << ")\n";
-    buffer << "\tType: " << typeString << '\n';
-    buffer << "\tLocation: " << location.str() << '\n';
-    if (addresses.size()) {
+    buffer << "Event (time=" << timestamp << ", thread=" << thread << ")\n";
+    buffer << "\tType: " << typeName() << '\n';
+    buffer << "\tLocation: " << location().str() << '\n';
+    if (numAddresses()) {
         buffer << "\tAddress Info:\n";
-        for (const auto &ai : addresses) {
-            buffer << "\t\tAddress: " << int_to_hex(ai.address) << '\n';
-            buffer << "\t\tLength: " << ai.length << '\n';
+        for (size_t i = 0; i < numAddresses(); ++i) {
+            buffer << "\t\tAddress: " << int_to_hex(address(i).address) << '\n';
+            buffer << "\t\tLength: " << address(i).length << '\n';
         }
     }
     buffer << "\tCall Stack:\n";
     int i = 0;
-    for (const LocationInfo &li : callstack) {
+    for (const LocationInfo &li : callstack()) {
         buffer << "[" << i << "] " << li.str() << '\n';
         i++;
     }
@@ -350,20 +857,20 @@ std::string TraceEvent::str() const {
 }
 
 bool TraceEvent::callStacksEqual(const TraceEvent &a, const TraceEvent &b) {
-    if (a.callstack.size() != b.callstack.size()) {
-        return false;
-    }
-
-    for (int i = 0; i < a.callstack.size(); i++) {
-        const LocationInfo &la = a.callstack[i];
-        const LocationInfo &lb = b.callstack[i];
-        errs() << "\t\t" << la.str() << " ?= " << lb.str() << '\n';
-        if (la.function != lb.function) return false;
-        if (la.file != lb.file) return false;
-        if (i > 0 && la.line != lb.line) return false;
+    CallStack as = a.callstack(), bs = b.callstack();
+    if (as == bs) return true;
+    if (as.size() != bs.size()) return false;
+    if (as.empty()) return true;
+
+    // The frames are interned, so the callers are equal iff their IDs are.
+    for (size_t i = 1; i < as.size(); i++) {
+        if (as.frameId(i) != bs.frameId(i)) return false;
     }
 
-    return true;
+    // The line of the innermost frame is allowed to differ.
+    const LocationInfo &la = as[0];
+    const LocationInfo &lb = bs[0];
+    return la.function == lb.function && la.file == lb.file;
 }
 
 static list<Value*> getGenericPmValues(
@@ -480,6 +987,7 @@ std::list<Value*> TraceEvent::pmValues(const BugLocationMapper &mapper) const {
     // }
     // assert(location == callstack[0] && "wat");
 
+    const LocationInfo &location = this->location();
     if (!mapper.contains(location)) return pmAddrs;
     if (type == FENCE || type == ASSERT_PERSISTED ||
         type == ASSERT_ORDERED || type == REQUIRED_FLUSH) return pmAddrs;
@@ -535,8 +1043,8 @@ std::list<Value*> TraceEvent::pmValues(const BugLocationMapper &mapper) const {
                     default:
                         errs() << "DEFAULT\n";
                         errs() << str() << "\n";
-                        for (auto &ai : addresses) {
-                            errs() << ai.str() << "\n";
+                        for (size_t i = 0; i < numAddresses(); ++i) {
+                            errs() << address(i).str() << "\n";
                         }
                         errs() << "FIRST:" << *fLoc.first << 
                             "\nLAST:" << *fLoc.last << "\n";
@@ -565,7 +1073,13 @@ std::list<Value*> TraceEvent::pmValues(const BugLocationMapper &mapper) const {
 
 #pragma region TraceInfo
 
-TraceInfo::TraceInfo(YAML::Node m) : meta_(m), source_(TraceEvent::UNKNOWN) {
+TraceInfo::TraceInfo(YAML::Node m) 
+    : source_(TraceEvent::UNKNOWN), stacks_(new StackTable()) {
+    setMetadata(m);
+}
+
+void TraceInfo::setMetadata(YAML::Node m) {
+    meta_ = m;
     std::string bugReportSrc = getMetadata<std::string>("source");
     if ("PMTEST" == bugReportSrc) {
         source_ = TraceEvent::PMTEST;
@@ -582,6 +1096,125 @@ void TraceInfo::addEvent(TraceEvent &&event) {
     events_.emplace_back(event); 
 }
 
+void TraceInfo::buildIndex(void) {
+    uint64_t cl_sz = AddressInfo::cacheLineSize();
+    lineOps_.clear();
+    fences_.clear();
+
+    for (int i = 0; i < (int)events_.size(); ++i) {
+        const TraceEvent &e = events_[i];
+        if (e.type == TraceEvent::FENCE) {
+            fences_[e.thread].push_back(i);
+            continue;
+        }
+
+        if (e.type != TraceEvent::STORE && e.type != TraceEvent::FLUSH) continue;
+        if (!e.numAddresses() || !e.address().length) continue;
+
+        AddressInfo ai = e.address();
+        for (uint64_t cl = ai.start() / cl_sz; cl <= ai.end() / cl_sz; ++cl) {
+            lineOps_[cl].push_back(i);
+        }
+    }
+}
+
+void TraceInfo::forEachOpBefore(const AddressInfo &addr, int before,
+                                function_ref<bool(int)> fn) const {
+    if (!addr.length) return;
+    uint64_t cl_sz = AddressInfo::cacheLineSize();
+    // Don't look back into a different trace.
+    int first = segmentStart(before);
+
+    // Merge the per-line lists, latest first. Each cursor is (begin, end) of 
+    // the events on that line before the given index.
+    typedef std::pair<const int*, const int*> Cursor;
+    std::vector<Cursor> cursors;
+    for (uint64_t cl = addr.start() / cl_sz; cl <= addr.end() / cl_sz; ++cl) {
+        auto it = lineOps_.find(cl);
+        if (it == lineOps_.end()) continue;
+
+        const std::vector<int> &ops = it->second;
+        auto begin = std::lower_bound(ops.begin(), ops.end(), first);
+        auto end = std::lower_bound(begin, ops.end(), before);
+        if (end == begin) continue;
+        cursors.emplace_back(ops.data() + (begin - ops.begin()), 
+                             ops.data() + (end - ops.begin()));
+    }
+
+    auto later = [] (const Cursor &a, const Cursor &b) {
+        return *(a.second - 1) < *(b.second - 1);
+    };
+    std::make_heap(cursors.begin(), cursors.end(), later);
+
+    int prev = -1;
+    while (!cursors.empty()) {
+        std::pop_heap(cursors.begin(), cursors.end(), later);
+        Cursor &c = cursors.back();
+        int idx = *(--c.second);
+        if (c.second == c.first) cursors.pop_back();
+        else std::push_heap(cursors.begin(), cursors.end(), later);
+
+        // Multi-line events show up once per line.
+        if (idx == prev) continue;
+        prev = idx;
+
+        // Sharing a cache line doesn't mean they overlap.
+        if (!events_[idx].address().overlaps(addr)) continue;
+
+        if (!fn(idx)) return;
+    }
+}
+
+int TraceInfo::segmentStart(int idx) const {
+    auto it = std::upper_bound(segments_.begin(), segments_.end(), idx);
+    return it == segments_.begin() ? 0 : *(it - 1);
+}
+
+uint32_t TraceInfo::occurrences(int idx) const {
+    auto it = occurrences_.find(idx);
+    return it == occurrences_.end() ? 1 : it->second;
+}
+
+bool TraceInfo::hasFenceBetween(int after, int before, uint32_t thread) const {
+    auto fences = fences_.find(thread);
+    if (fences == fences_.end()) return false;
+
+    const std::vector<int> &idx = fences->second;
+    after = std::max(after, segmentStart(before) - 1);
+    auto it = std::upper_bound(idx.begin(), idx.end(), after);
+    return it != idx.end() && *it < before;
+}
+
+void TraceInfo::printMemoryStats(raw_ostream &os) const {
+    const double MB = 1024.0 * 1024.0;
+
+    size_t indexBytes = 0;
+    for (const auto &p : fences_) {
+        indexBytes += sizeof(p) + p.second.capacity() * sizeof(int);
+    }
+    for (const auto &p : lineOps_) {
+        indexBytes += sizeof(p) + p.second.capacity() * sizeof(int);
+    }
+
+    os << "Trace memory:\n";
+    os << "\tEvents: " << events_.size() << " x " << sizeof(TraceEvent) << 
+        " bytes = " << format("%.1f", events_.capacity() * sizeof(TraceEvent) / MB) << 
+        " MB\n";
+    if (!omitted_.empty()) {
+        os << "\tOmitted: " << omitted_.size() << " x " << 
+            sizeof(TraceEvent) << " bytes\n";
+    }
+    os << "\tFrames: " << stacks_->numFrames() << ", stacks: " << 
+        stacks_->numStacks() << "\n";
+    os << "\tAddress index: " << lineOps_.size() << " cache lines, " << 
+        format("%.1f", indexBytes / MB) << " MB\n";
+}
+
+void TraceInfo::forAllLocations(function_ref<void(const TraceEvent&)> fn) const {
+    for (const TraceEvent &e : events_) fn(e);
+    for (const TraceEvent &e : omitted_) fn(e);
+}
+
 std::string TraceInfo::str(void) const {
     std::stringstream buffer;
 
@@ -596,31 +1229,145 @@ std::string TraceInfo::str(void) const {
 
 #pragma region TraceInfoBuilder
 
+TraceInfoBuilder::TraceInfoBuilder(BugLocationMapper &mapper, 
+                                   const std::string &traceFile)
+    : mapper_(mapper) {
+    open(traceFile);
+}
+
+TraceInfoBuilder::TraceInfoBuilder(BugLocationMapper &mapper, 
+                                   const std::vector<std::string> &traceFiles)
+    : mapper_(mapper) {
+    assert(!traceFiles.empty() && "no traces!");
+    if (traceFiles.size() == 1) {
+        open(traceFiles.front());
+        return;
+    }
+
+    for (const std::string &traceFile : traceFiles) {
+        parts_.emplace_back(new TraceInfoBuilder(mapper, traceFile));
+    }
+}
+
+void TraceInfoBuilder::open(const std::string &traceFile) {
+    if (trace::BinaryTrace::isBinaryTrace(traceFile)) {
+        if (!openBinary(traceFile)) {
+            report_fatal_error(Twine("could not open binary trace ") + 
+                               traceFile, /*gen_crash_diag*/ false);
+        }
+    }
+    traceFile_ = traceFile;
+}
+
+bool TraceInfoBuilder::openBinary(const std::string &path) {
+    binary_ = trace::BinaryTrace::open(path);
+    if (!binary_) return false;
+
+    frames_.assign(binary_->numFrames(), 0);
+    framesDecoded_.assign(binary_->numFrames(), false);
+    binaryStacks_.assign(binary_->numStacks(), 0);
+    stacksDecoded_.assign(binary_->numStacks(), false);
+    return true;
+}
+
+StackTable::FrameId TraceInfoBuilder::frame(TraceInfo &ti, uint32_t id) {
+    if (!framesDecoded_[id]) {
+        trace::BinaryTrace::FrameRef fr = binary_->frame(id);
+        LocationInfo li;
+        li.function = fr.function.str();
+        li.file = fr.file.str();
+        li.line = fr.line;
+        frames_[id] = ti.stacks_->internFrame(li);
+        framesDecoded_[id] = true;
+    }
+
+    return frames_[id];
+}
+
+trace::TraceSymbolizer &TraceInfoBuilder::symbolizer(TraceInfo &ti) {
+    if (!symbolizerCreated_) {
+        symbolizer_ = trace::TraceSymbolizer::create(ti.meta_);
+        symbolizerCreated_ = true;
+    }
+    return *symbolizer_;
+}
+
+StackTable::FrameId TraceInfoBuilder::internFrame(TraceInfo &ti, 
+                                                  const trace::Frame &f) {
+    LocationInfo li;
+    li.function = f.function;
+    li.file = f.file;
+    li.line = f.line;
+    return ti.stacks_->internFrame(li);
+}
+
+CallStack TraceInfoBuilder::stack(TraceInfo &ti, uint32_t id) {
+    if (!stacksDecoded_[id]) {
+        scratch_.clear();
+        ArrayRef<uint32_t> fids = binary_->stack(id);
+        for (size_t i = 0; i < fids.size(); ++i) {
+            trace::BinaryTrace::FrameRef fr = binary_->frame(fids[i]);
+            if (!fr.pc || !fr.function.empty()) {
+                scratch_.push_back(frame(ti, fids[i]));
+                continue;
+            }
+
+            // Return addresses after the first frame.
+            for (const trace::Frame &f : symbolizer(ti).symbolize(fr.pc, i > 0)) {
+                scratch_.push_back(internFrame(ti, f));
+            }
+        }
+        binaryStacks_[id] = ti.stacks_->internStack(scratch_);
+        stacksDecoded_[id] = true;
+    }
+
+    return CallStack(ti.stacks_.get(), binaryStacks_[id]);
+}
+
+CallStack TraceInfoBuilder::stack(TraceInfo &ti, 
+                                  const std::vector<trace::Frame> &frames) {
+    const std::vector<trace::Frame> *stack = &frames;
+    if (std::any_of(frames.begin(), frames.end(), 
+                    [] (const trace::Frame &f) { return f.unsymbolized(); })) {
+        expanded_.clear();
+        symbolizer(ti).expand(frames, expanded_);
+        stack = &expanded_;
+    }
+
+    scratch_.clear();
+    for (const trace::Frame &f : *stack) {
+        scratch_.push_back(internFrame(ti, f));
+    }
+
+    return CallStack(ti.stacks_.get(), ti.stacks_->internStack(scratch_));
+}
+
 void TraceInfoBuilder::processEvent(TraceInfo &ti, YAML::Node event) {
     TraceEvent e;
     e.source = ti.getSource();
-    e.typeString = event["event"].as<string>();
-
-    TraceEvent::Type event_type = TraceEvent::getType(e.typeString);
+    TraceEvent::Type event_type = 
+        TraceEvent::getType(event["event"].as<string>());
 
     assert(event_type != TraceEvent::INVALID);
     
     e.type = event_type;
-    e.timestamp = event["timestamp"].as<uint64_t>();
-    e.location.function = event["function"].as<string>();
-    e.location.file = event["file"].as<string>();
-    e.location.line = event["line"].as<int64_t>();
+    e.setTime(event["timestamp"].as<uint64_t>(), 
+              event["thread"].as<uint64_t>(0));
     e.isBug = event["is_bug"].as<bool>();
 
     assert(event["stack"].IsSequence() && "Don't know what to do!");
+    scratch_.clear();
+    std::vector<trace::Frame> frames;
     for (size_t i = 0; i < event["stack"].size(); ++i) {
         YAML::Node sf = event["stack"][i];
-        LocationInfo li;
-        li.function = sf["function"].as<string>();
-        li.file = sf["file"].as<string>();
-        li.line = sf["line"].as<int64_t>();
-        e.callstack.emplace_back(li);
+        trace::Frame f;
+        f.function = sf["function"].as<string>("");
+        f.file = sf["file"].as<string>("");
+        f.line = sf["line"].as<int64_t>(-1);
+        f.pc = sf["pc"].as<uint64_t>(0);
+        frames.push_back(std::move(f));
     }
+    e.setCallStack(stack(ti, frames));
 
     switch (e.type) {
         case TraceEvent::STORE:
@@ -630,7 +1377,7 @@ void TraceInfoBuilder::processEvent(TraceInfo &ti, YAML::Node event) {
             AddressInfo ai;
             ai.address = event["address"].as<uint64_t>();
             ai.length = event["length"].as<uint64_t>();
-            e.addresses.push_back(ai);
+            e.addAddress(ai);
             break;
         }    
         case TraceEvent::ASSERT_ORDERED: {
@@ -639,8 +1386,8 @@ void TraceInfoBuilder::processEvent(TraceInfo &ti, YAML::Node event) {
             a.length = event["length_a"].as<uint64_t>();
             b.address = event["address_b"].as<uint64_t>();
             b.length = event["length_b"].as<uint64_t>();
-            e.addresses.push_back(a);
-            e.addresses.push_back(b);
+            e.addAddress(a);
+            e.addAddress(b);
             break;
         } 
         default:
@@ -650,155 +1397,643 @@ void TraceInfoBuilder::processEvent(TraceInfo &ti, YAML::Node event) {
     /**
      * Sanity checking.
      */
-    assert(e.callstack[0] == e.location);
+    assert((frames[0].unsymbolized() ||
+            (e.location().function == event["function"].as<string>() &&
+             e.location().line == event["line"].as<int64_t>())) &&
+           "location is not the top of the stack!");
 
     ti.addEvent(std::move(e));
 }
 
-void TraceInfoBuilder::resolveLocations(TraceEvent &te) {
+void TraceInfoBuilder::processEvent(TraceInfo &ti,
+                                    const trace::EventRecord &event) {
+    TraceEvent e;
+    e.source = ti.getSource();
+    e.type = TraceEvent::getType(trace::kindName(event.getKind()));
 
-    std::vector<LocationInfo> &stack = te.callstack;
+    assert(e.type != TraceEvent::INVALID);
 
-    // [0] is the current location, which we use to set up the node itself.
-    for (int i = stack.size() - 1; i >= 1; --i) {
-        LocationInfo &caller = stack[i];
-        LocationInfo &callee = stack[i-1];
-
-        // errs() << "\nCALLER [" << i << "]: " << caller.str() << "\n";
-        // errs() << "CALLEE [" << (i-1) <<"]: " << callee.str() << "\n";
-        
-        if (!caller.valid() || !mapper_.contains(caller)) {
-            // errs() << "SKIP: " << caller.valid() << " " << 
-            //     mapper_.contains(caller) << "\n";
-            // Function *f = mapper_.module().getFunction(caller.function);
-            // if (!f) {
-            //     errs() << "\tnull!\n";
-            //     f = mapper_.module().getFunction("obj_alloc_construct.1488");
-            //     if (!f) errs() << "\t\talso null!\n";
-            //     else errs() << *f << "\n";
-            //     errs() << "DEMANGLES: " << utils::demangle("obj_alloc_construct.1488") << "\n";
-            // }
-            // else errs() << *f << "\n";
+    e.setTime(event.timestamp, event.thread);
+    e.isBug = event.isBug();
 
-            continue;
+    e.setCallStack(stack(ti, event.stack));
+    assert(!e.callstack().empty() && "event without a location!");
+
+    for (uint32_t i = 0; i < event.numRanges; ++i) {
+        AddressInfo ai;
+        ai.address = event.address[i];
+        ai.length = event.length[i];
+        e.addAddress(ai);
+    }
+
+    ti.addEvent(std::move(e));
+}
+
+void TraceInfoBuilder::processEvent(TraceInfo &ti, const trace::Record &event) {
+    TraceEvent e;
+    e.source = ti.getSource();
+    e.type = TraceEvent::getType(trace::kindName(event.kind));
+
+    assert(e.type != TraceEvent::INVALID);
+
+    e.setTime(event.timestamp, event.thread);
+    e.isBug = event.isBug;
+
+    e.setCallStack(stack(ti, event.stack));
+    assert(!e.callstack().empty() && "event without a location!");
+
+    for (uint32_t i = 0; i < event.numRanges; ++i) {
+        AddressInfo ai;
+        ai.address = event.address[i];
+        ai.length = event.length[i];
+        e.addAddress(ai);
+    }
+
+    ti.addEvent(std::move(e));
+}
+
+void TraceInfoBuilder::processOmitted(TraceInfo &ti, 
+                                      const trace::Record &event) {
+    // Most of the dropped events come from a few places, so check before
+    // interning anything.
+    hash_code h = hash_combine(static_cast<int>(event.kind), event.stack.size());
+    for (const trace::Frame &f : event.stack) {
+        h = hash_combine(h, f.function, f.file, f.line, f.pc);
+    }
+    if (!omittedSeen_.insert(h).second) return;
+
+    TraceEvent e;
+    e.type = TraceEvent::getType(trace::kindName(event.kind));
+    assert(e.type != TraceEvent::INVALID);
+    e.setTime(event.timestamp, event.thread);
+    e.setCallStack(stack(ti, event.stack));
+    assert(!e.callstack().empty() && "event without a location!");
+
+    ti.omitted_.push_back(e);
+}
+
+void TraceInfoBuilder::streamTrace(TraceInfo &ti, bool reduce) {
+    struct Sink : public trace::RecordSink {
+        TraceInfoBuilder &builder;
+        TraceInfo &ti;
+
+        Sink(TraceInfoBuilder &b, TraceInfo &t) : builder(b), ti(t) {}
+
+        void onMetadata(const YAML::Node &metadata) override {
+            ti.setMetadata(metadata);
         }
 
-        if (mapper_.contains(callee)) {
-            // No reason to repair.
-            continue;
+        void onRecord(const trace::Record &r) override {
+            builder.processEvent(ti, r);
         }
+    } sink(*this, ti);
 
-        // The location in the caller calls the function of the callee
+    struct OmittedSink : public trace::RecordSink {
+        TraceInfoBuilder &builder;
+        TraceInfo &ti;
 
-        std::list<CallBase*> possibleCallSites;
+        OmittedSink(TraceInfoBuilder &b, TraceInfo &t) : builder(b), ti(t) {}
 
-        for (auto &fLoc : mapper_[caller]) {
-            assert(fLoc.isValid() && "wat");
-            // errs() << "START LOC: \n";
-            // errs() << "\tFUNC NAME: "<< fLoc.insts().front()->getFunction()->getName() << "\n";
-            for (Instruction *inst : fLoc.insts()) {
-                errs() << *inst << "\n";
-                if (auto *cb = dyn_cast<CallBase>(inst)) {
-                    // errs() << *inst << "\n";
-                    Function *f = cb->getCalledFunction();
-                    if (f) {
-                        if (f->getIntrinsicID() == Intrinsic::dbg_declare) {
-                            continue;
-                        }
+        void onRecord(const trace::Record &r) override {
+            builder.processOmitted(ti, r);
+        }
+    } omitted(*this, ti);
+
+    bool success;
+    if (reduce) {
+        trace::TraceReducer::Options opts;
+        if (!ReduceTrace) {
+            // Just the window around the bugs.
+            opts.dedupBugs = false;
+            opts.dropFlushes = false;
+        }
 
-                        std::string fname = utils::demangle(f->getName().data());
-                        if (fname.find(callee.function) == std::string::npos) {
-                            // errs() << fname << " !find " << callee.function << "\n";
-                            if (fname.find("memset") == std::string::npos &&
-                                fname.find("memcpy") == std::string::npos &&
-                                fname.find("memmove") == std::string::npos &&
-                                fname.find("strncpy") == std::string::npos) {
-                                continue;
-                            }
-                        }
-                    } 
+        trace::TraceReducer reducer(opts);
+        reducer.setDroppedSink(&omitted);
+        success = reducer.reduce(traceFile_, sink);
 
-                    // errs() << "POSSIBLE: " << *cb << "\n";
-                    possibleCallSites.push_back(cb);
-                }
+        // Several traces may be loading at once.
+        static std::mutex printLock;
+        std::lock_guard<std::mutex> guard(printLock);
+        errs() << traceFile_ << ":\n";
+        reducer.stats().print(errs());
+    } else {
+        success = trace::readTrace(traceFile_, sink);
+    }
+    if (!success) {
+        report_fatal_error(Twine("could not read trace ") + traceFile_, 
+                           /*gen_crash_diag*/ false);
+    }
+
+    // In case the metadata came after the trace.
+    for (TraceEvent &e : ti.events_) {
+        e.source = ti.getSource();
+    }
+    for (TraceEvent &e : ti.omitted_) {
+        e.source = ti.getSource();
+    }
+}
+
+const TraceInfoBuilder::CallResolution &TraceInfoBuilder::resolveCall(
+    TraceInfo &ti, StackTable::FrameId callerId, StackTable::FrameId calleeId) {
+
+    auto memo = resolvedCalls_.find(std::make_pair(callerId, calleeId));
+    if (memo != resolvedCalls_.end()) return memo->second;
+
+    CallResolution &res = resolvedCalls_[std::make_pair(callerId, calleeId)];
+    res.callSite = nullptr;
+
+    const LocationInfo &caller = ti.stacks_->frame(callerId);
+    const LocationInfo &callee = ti.stacks_->frame(calleeId);
+
+    // errs() << "\nCALLER: " << caller.str() << "\n";
+    // errs() << "CALLEE: " << callee.str() << "\n";
+
+    if (!caller.valid() || !mapper_.contains(caller)) {
+        // errs() << "SKIP: " << caller.valid() << " " << 
+        //     mapper_.contains(caller) << "\n";
+        return res;
+    }
+
+    if (mapper_.contains(callee)) {
+        // No reason to repair.
+        return res;
+    }
+
+    // The location in the caller calls the function of the callee
+
+    std::vector<CallBase*> possibleCallSites = 
+        mapper_.callsTo(caller, callee.function);
+
+    // The trace may name a memory function differently than the module
+    // does (e.g. llvm.memcpy), so look for the same kind of call. If the
+    // name doesn't say which kind, take any memory call; the check below
+    // makes sure they all call the same function.
+    if (possibleCallSites.empty()) {
+        const CallSites &sites = mapper_.callSites(caller);
+        for (int kind = 0; kind < CallSites::NUM_MEM_KINDS; ++kind) {
+            const char *name = CallSites::memKindName((CallSites::MemKind)kind);
+            if (callee.function.find(name) != std::string::npos) {
+                possibleCallSites = sites.memory[kind];
+                break;
             }
         }
-
         if (possibleCallSites.empty()) {
-            errs() << "No calls to " << callee.function << "!\n";
-        }
-
-        assert(possibleCallSites.size() > 0 && "don't know how to handle!");
-        if (possibleCallSites.size() > 1) {
-            // If the functions are both the same, it shouldn't matter, 
-            // since we're only reseting on the front of the path.
-            Function *f = possibleCallSites.front()->getCalledFunction();
-            for (auto *cb : possibleCallSites) {
-                Function *called = cb->getCalledFunction();
-                assert(called && called == f);
-                // errs() << "Multiple call sites:" << *cb << "\n";
+            for (int kind = 0; kind < CallSites::NUM_MEM_KINDS; ++kind) {
+                possibleCallSites.insert(possibleCallSites.end(),
+                                         sites.memory[kind].begin(), 
+                                         sites.memory[kind].end());
             }
-            // We should be able to do something about this with debug info
-            // errs() << "Too many options! Abort.\n";
-            // assert(false && "TODO!");
-            // return nullptr;
-        }
-        // assert(possibleCallSites.size() == 1 && "don't know how to handle!");
-
-        Instruction *possible = possibleCallSites.front();
-        CallBase *callInst = dyn_cast<CallBase>(possible);
-        assert(callInst && "don't know how to handle a non-call!");
-
-        Function *f = callInst->getCalledFunction();
-        if (!f) {
-            errs() << "Try get function pointer function (" << callee.function << ")\n";
-            f = mapper_.module().getFunction(callee.function);
-            if (!f) {
-                std::list<Function*> fnCandidates;
-                for (Function &fn : mapper_.module()) {
-                    std::string fnName(fn.getName().data());
-                    if (fnName.find(callee.function) != std::string::npos) {
-                        // Skip false matches
-                        auto ending = fnName.substr(fnName.find(callee.function) + callee.function.size());
-                        if (ending[0] != '.') continue; // name mangling
-                        errs() << "\t\t--- " << fnName << "\n"; 
-                        fnCandidates.push_back(&fn);
-                    }
-                }
-                assert(fnCandidates.size() == 1 && "wat");
-                f = fnCandidates.front();
+        }
+    }
+
+    if (possibleCallSites.empty()) {
+        errs() << "No calls to " << callee.function << "!\n";
+    }
+
+    assert(possibleCallSites.size() > 0 && "don't know how to handle!");
+    if (possibleCallSites.size() > 1) {
+        // If the functions are both the same, it shouldn't matter, 
+        // since we're only reseting on the front of the path.
+        Function *f = possibleCallSites.front()->getCalledFunction();
+        for (auto *cb : possibleCallSites) {
+            Function *called = cb->getCalledFunction();
+            assert(called && called == f);
+            // errs() << "Multiple call sites:" << *cb << "\n";
+        }
+        // We should be able to do something about this with debug info
+        // errs() << "Too many options! Abort.\n";
+        // assert(false && "TODO!");
+        // return nullptr;
+    }
+    // assert(possibleCallSites.size() == 1 && "don't know how to handle!");
+
+    Instruction *possible = possibleCallSites.front();
+    CallBase *callInst = dyn_cast<CallBase>(possible);
+    assert(callInst && "don't know how to handle a non-call!");
+
+    Function *f = callInst->getCalledFunction();
+    if (!f) {
+        errs() << "Try get function pointer function (" << callee.function << ")\n";
+        f = mapper_.findFunction(callee.function);
+        assert(f && "wat");
+    }
+    assert(f && "don't know what's going on!!");
+
+    res.callSite = callInst;
+    if (f->getName() != callee.function) {
+        res.function = f->getName();
+    }
+
+    return res;
+}
+
+StackTable::StackId TraceInfoBuilder::resolveStack(TraceInfo &ti, 
+                                                   const CallStack &cs) {
+    std::vector<StackTable::FrameId> frames(cs.size());
+    for (size_t i = 0; i < cs.size(); ++i) {
+        frames[i] = cs.frameId(i);
+    }
+
+    bool changed = false;
+
+    // [0] is the current location, which we use to set up the node itself.
+    // A repaired callee is the caller of the next pair, so go outside-in.
+    for (int i = frames.size() - 1; i >= 1; --i) {
+        const CallResolution &res = resolveCall(ti, frames[i], frames[i-1]);
+        if (res.function.empty()) continue;
+
+        LocationInfo callee = ti.stacks_->frame(frames[i-1]);
+        callee.function = res.function;
+        frames[i-1] = ti.stacks_->internFrame(callee);
+        changed = true;
+    }
+
+    return changed ? ti.stacks_->internStack(frames) : cs.id();
+}
+
+void TraceInfoBuilder::resolveLocations(TraceInfo &ti, TraceEvent &te) {
+    StackTable::StackId id = te.callstack().id();
+
+    auto it = resolvedStacks_.find(id);
+    if (it == resolvedStacks_.end()) {
+        StackTable::StackId resolved = resolveStack(ti, te.callstack());
+        it = resolvedStacks_.insert(std::make_pair(id, resolved)).first;
+    }
+
+    // The location is the innermost frame, so it follows along.
+    if (it->second != id) {
+        te.setCallStack(CallStack(ti.stacks_.get(), it->second));
+    }
+}
+
+void TraceInfoBuilder::load(TraceInfo &ti) {
+    if ((ReduceTrace || TraceWindow) && !traceFile_.empty()) {
+        streamTrace(ti, true);
+    } else if (binary_) {
+        ti.setMetadata(YAML::Load(binary_->metadata().str()));
+        ti.events_.reserve(binary_->numEvents());
+        for (size_t i = 0; i < binary_->numEvents(); ++i) {
+            processEvent(ti, binary_->event(i));
+        }
+    } else if (!traceFile_.empty()) {
+        streamTrace(ti, false);
+    } else {
+        ti.setMetadata(doc_["metadata"]);
+        auto trace = doc_["trace"];
+        assert(trace.IsSequence() && "Don't know what to do otherwise!");
+        for (size_t i = 0; i < trace.size(); ++i) {
+            processEvent(ti, trace[i]);
+        }
+    }
+}
+
+void TraceInfoBuilder::merge(TraceInfo &ti, TraceInfo &part) {
+    if (ti.segments_.empty()) {
+        ti.setMetadata(part.meta_);
+    }
+    assert(part.getSource() == ti.getSource() && 
+           "can't mix traces from different bug finders!");
+
+    int segment = ti.events_.size();
+    ti.segments_.push_back(segment);
+
+    // Re-intern the part's (few) frames and stacks.
+    std::vector<StackTable::FrameId> frameMap(part.stacks_->numFrames());
+    for (StackTable::FrameId id = 0; id < frameMap.size(); ++id) {
+        frameMap[id] = ti.stacks_->internFrame(part.stacks_->frame(id));
+    }
+
+    std::vector<StackTable::StackId> stackMap(part.stacks_->numStacks());
+    for (StackTable::StackId id = 0; id < stackMap.size(); ++id) {
+        scratch_.clear();
+        for (StackTable::FrameId fid : part.stacks_->stack(id)) {
+            scratch_.push_back(frameMap[fid]);
+        }
+        stackMap[id] = ti.stacks_->internStack(scratch_);
+    }
+
+    uint64_t cl_sz = AddressInfo::cacheLineSize();
+    for (TraceEvent &e : part.events_) {
+        e.setCallStack(CallStack(ti.stacks_.get(), 
+                                 stackMap[e.callstack().id()]));
+
+        if (e.isBug) {
+            // Bugs with the same type and stack, on the same shape of
+            // address range, get the same fix.
+            std::vector<uint64_t> addrClass;
+            for (size_t i = 0; i < e.numAddresses(); ++i) {
+                addrClass.push_back(e.address(i).length);
+                addrClass.push_back(e.address(i).address % cl_sz);
+            }
+            BugKey key(static_cast<int>(e.type), e.callstack().id(), addrClass);
+
+            auto it = firstBugs_.find(key);
+            if (it != firstBugs_.end()) {
+                // Already seen, in an earlier trace or earlier in this one.
+                ti.occurrences_[it->second] = ti.occurrences(it->second) + 1;
+                continue;
             }
+            firstBugs_[key] = ti.events_.size();
         }
-        assert(f && "don't know what's going on!!");
 
-        if (f->getName() != callee.function) {
-            callee.function = f->getName();
+        ti.addEvent(std::move(e));
+    }
+
+    for (TraceEvent &e : part.omitted_) {
+        e.setCallStack(CallStack(ti.stacks_.get(), 
+                                 stackMap[e.callstack().id()]));
+        ti.omitted_.push_back(e);
+    }
+
+    part.events_.clear();
+    part.omitted_.clear();
+}
+
+void TraceInfoBuilder::loadParts(TraceInfo &ti) {
+    // Reading is independent per trace; only the merge touches shared state.
+    std::vector<std::unique_ptr<TraceInfo>> infos;
+    for (size_t i = 0; i < parts_.size(); ++i) {
+        infos.emplace_back(new TraceInfo());
+    }
+
+    {
+        ThreadPool pool;
+        for (size_t i = 0; i < parts_.size(); ++i) {
+            pool.async([this, &infos, i] { parts_[i]->load(*infos[i]); });
         }
+        pool.wait();
     }
 
-    /**
-     * Now, we set up arguments so we can call the other create() function.
-     */ 
+    size_t total = 0;
+    for (size_t i = 0; i < parts_.size(); ++i) {
+        total += infos[i]->size();
+    }
+    ti.events_.reserve(total);
+
+    for (size_t i = 0; i < parts_.size(); ++i) {
+        merge(ti, *infos[i]);
+        infos[i].reset();
+    }
+
+    errs() << "Merged " << parts_.size() << " traces: " << total << 
+        " events, " << ti.bugs().size() << " distinct bugs\n";
+}
+
+#pragma region Snapshots
 
-    if (stack[0] != te.location) {
-        te.location = stack[0];
+/**
+ * The size and modification time of a file, or empty if it can't be read.
+ */
+static std::string fileStamp(const std::string &path) {
+    sys::fs::file_status status;
+    if (path.empty() || sys::fs::status(path, status) || 
+        !sys::fs::is_regular_file(status)) {
+        return std::string();
     }
+    return utohexstr(status.getSize()) + "@" + 
+        utohexstr(status.getLastModificationTime().time_since_epoch().count());
+}
+
+/**
+ * A hash of the file's contents, or empty if it can't be read.
+ */
+static std::string contentHash(const std::string &path) {
+    auto bufOrErr = MemoryBuffer::getFile(path, /*FileSize*/ -1,
+                                          /*RequiresNullTerminator*/ false);
+    if (!bufOrErr) return std::string();
+    return utohexstr(xxHash64((*bufOrErr)->getBuffer()));
 }
 
+std::string TraceInfoBuilder::snapshotPath(void) const {
+    std::vector<std::string> files;
+    if (!parts_.empty()) {
+        for (const auto &part : parts_) files.push_back(part->traceFile_);
+    } else if (!traceFile_.empty()) {
+        files.push_back(traceFile_);
+    }
+    if (files.empty()) return std::string();
+
+    // The key covers everything ingestion depends on.
+    std::string key = "v" + std::to_string(SNAPSHOT_VERSION);
+    key += ReduceTrace ? "r" : (TraceWindow ? "w" : "-");
+
+    // Files are identified by their size and modification time, so a run
+    // doesn't have to read them all. The module only has to be serialized if
+    // it didn't come from a file (e.g. stdin).
+    const std::string &bcFile = mapper_.module().getModuleIdentifier();
+    std::string bcStamp = fileStamp(bcFile);
+    if (!bcStamp.empty()) {
+        key += bcFile + "=" + bcStamp;
+    } else {
+        SmallVector<char, 0> bitcode;
+        raw_svector_ostream bcStream(bitcode);
+        WriteBitcodeToFile(mapper_.module(), bcStream);
+        key += utohexstr(xxHash64(StringRef(bitcode.data(), bitcode.size())));
+    }
+
+    for (const std::string &file : files) {
+        std::string stamp = fileStamp(file);
+        if (stamp.empty()) return std::string();
+        key += ":" + file + "=" + stamp;
+    }
+
+    SmallString<128> path(TraceCacheDir);
+    sys::path::append(path, utohexstr(xxHash64(key)) + ".pmtrace");
+    return std::string(path.str());
+}
+
+bool TraceInfoBuilder::loadSnapshot(TraceInfo &ti, const std::string &path) {
+    if (!trace::BinaryTrace::isBinaryTrace(path) || !openBinary(path)) {
+        return false;
+    }
+
+    YAML::Node meta = YAML::Load(binary_->metadata().str());
+    YAML::Node snap = meta["snapshot"];
+    if (!snap || snap["version"].as<int>(-1) != SNAPSHOT_VERSION) {
+        binary_.reset();
+        return false;
+    }
+    // The modules the PCs were symbolized from aren't in the key, since
+    // finding them means reading the traces.
+    for (const YAML::Node &mod : snap["modules"]) {
+        std::string modPath = mod["path"].as<std::string>();
+        if (contentHash(modPath) != mod["hash"].as<std::string>()) {
+            errs() << "Trace snapshot " << path << " is stale: " << modPath << 
+                " changed\n";
+            binary_.reset();
+            return false;
+        }
+    }
+
+    meta.remove("snapshot");
+    ti.setMetadata(meta);
+
+    for (const YAML::Node &seg : snap["segments"]) {
+        ti.segments_.push_back(seg.as<int>());
+    }
+    for (const YAML::Node &occ : snap["occurrences"]) {
+        ti.occurrences_[occ[0].as<int>()] = occ[1].as<uint32_t>();
+    }
+
+    ti.events_.reserve(binary_->numEvents());
+    for (size_t i = 0; i < binary_->numEvents(); ++i) {
+        processEvent(ti, binary_->event(i));
+    }
+
+    // The omitted events come last. They are never bugs, so bugs_ is right.
+    size_t numOmitted = snap["omitted"].as<size_t>(0);
+    assert(numOmitted <= ti.events_.size() && "bad snapshot!");
+    ti.omitted_.assign(ti.events_.end() - numOmitted, ti.events_.end());
+    ti.events_.resize(ti.events_.size() - numOmitted);
+
+    return true;
+}
+
+void TraceInfoBuilder::saveSnapshot(const TraceInfo &ti, 
+                                    const std::string &path) const {
+    // Write to the side and rename, so concurrent runs never see half a file.
+    std::string tmp = path + ".tmp" + std::to_string(sys::Process::getProcessId());
+    auto writer = trace::BinaryTraceWriter::create(tmp);
+    if (!writer) return;
+
+    YAML::Node meta = YAML::Clone(ti.meta_);
+    YAML::Node snap;
+    snap["version"] = SNAPSHOT_VERSION;
+    for (int seg : ti.segments_) snap["segments"].push_back(seg);
+    for (const auto &p : ti.occurrences_) {
+        YAML::Node occ;
+        occ.push_back(p.first);
+        occ.push_back(p.second);
+        snap["occurrences"].push_back(occ);
+    }
+    snap["omitted"] = ti.omitted_.size();
+
+    std::vector<const trace::TraceSymbolizer*> symbolizers;
+    if (symbolizer_) symbolizers.push_back(symbolizer_.get());
+    for (const auto &part : parts_) {
+        if (part->symbolizer_) symbolizers.push_back(part->symbolizer_.get());
+    }
+    std::set<std::string> modules;
+    for (const trace::TraceSymbolizer *s : symbolizers) {
+        for (const trace::TraceSymbolizer::Module &mod : s->modules()) {
+            if (!modules.insert(mod.path).second) continue;
+            YAML::Node node;
+            node["path"] = mod.path;
+            node["hash"] = contentHash(mod.path);
+            snap["modules"].push_back(node);
+        }
+    }
+
+    meta["snapshot"] = snap;
+
+    YAML::Emitter emitter;
+    emitter << meta;
+    writer->setMetadata(emitter.c_str());
+
+    trace::Record r;
+    auto write = [&] (const TraceEvent &te) {
+        r.clear();
+        r.kind = static_cast<trace::EventKind>(te.type);
+        r.timestamp = te.timestamp;
+        r.thread = te.thread;
+        r.isBug = te.isBug;
+        r.numRanges = te.numAddresses();
+        for (size_t i = 0; i < te.numAddresses(); ++i) {
+            r.address[i] = te.address(i).address;
+            r.length[i] = te.address(i).length;
+        }
+        for (const LocationInfo &li : te.callstack()) {
+            trace::Frame f;
+            f.function = li.function;
+            f.file = li.file;
+            f.line = li.line;
+            r.stack.push_back(f);
+        }
+        writer->addEvent(r);
+    };
+    for (const TraceEvent &te : ti.events_) write(te);
+    for (const TraceEvent &te : ti.omitted_) write(te);
+
+    if (!writer->close() || sys::fs::rename(tmp, path)) {
+        errs() << "Could not save trace snapshot " << path << "\n";
+        sys::fs::remove(tmp);
+        return;
+    }
+
+    errs() << "Saved trace snapshot " << path << "\n";
+}
+
+#pragma endregion
+
 TraceInfo TraceInfoBuilder::build(void) {
-    TraceInfo ti(doc_["metadata"]);
+    TraceInfo ti;
+
+    std::string snapshot;
+    if (!TraceCacheDir.empty()) {
+        snapshot = snapshotPath();
+    }
+
+    if (!snapshot.empty() && loadSnapshot(ti, snapshot)) {
+        // Already resolved.
+        errs() << "Loaded trace snapshot " << snapshot << "\n";
+        finish(ti);
+        return ti;
+    }
+
+    if (parts_.empty()) {
+        load(ti);
+    } else {
+        loadParts(ti);
+    }
 
-    auto trace = doc_["trace"];
-    assert(trace.IsSequence() && "Don't know what to do otherwise!");
-    for (size_t i = 0; i < trace.size(); ++i) {
-        processEvent(ti, trace[i]);
+    size_t symbolized = symbolizer_ ? symbolizer_->numSymbolized() : 0;
+    for (const auto &part : parts_) {
+        if (part->symbolizer_) symbolized += part->symbolizer_->numSymbolized();
     }
+    if (symbolized) {
+        errs() << "Symbolized " << symbolized << " unique PCs\n";
+    }
+
+    // Resolving looks at the call sites in the callers.
+    mapFunctions(ti);
 
     for (size_t i = 0; i < ti.size(); ++i) {
-        resolveLocations(ti[i]);
+        resolveLocations(ti, ti[i]);
+    }
+    for (TraceEvent &e : ti.omitted_) {
+        resolveLocations(ti, e);
     }
 
+    if (!snapshot.empty()) {
+        saveSnapshot(ti, snapshot);
+    }
+
+    finish(ti);
     return ti;
 }
 
+void TraceInfoBuilder::mapFunctions(TraceInfo &ti) {
+    // In parallel, before key() would get to them one by one.
+    std::vector<StringRef> functions;
+    for (StackTable::FrameId id = 0; id < ti.stacks_->numFrames(); ++id) {
+        functions.push_back(ti.stacks_->frame(id).function);
+    }
+    mapper_.mapFunctions(functions);
+}
+
+void TraceInfoBuilder::finish(TraceInfo &ti) {
+    ti.buildIndex();
+
+    // Resolving frames may have added functions, and snapshots skip it.
+    mapFunctions(ti);
+
+    // Canonicalize every frame once, so later lookups don't touch strings.
+    for (StackTable::FrameId id = 0; id < ti.stacks_->numFrames(); ++id) {
+        ti.stacks_->setKey(id, mapper_.key(ti.stacks_->frame(id)));
+    }
+    errs() << "Mapped the locations of " << mapper_.numMappedFunctions() <<
+        " of " << mapper_.numFunctions() << " functions\n";
+}
+
 #pragma endregion
\ No newline at end of file
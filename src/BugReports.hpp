@@ -4,18 +4,31 @@
  */
 
 #include <cstdint>
+#include <iterator>
 #include <list>
+#include <map>
+#include <memory>
 #include <string>
+#include <tuple>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/Hashing.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/IR/Module.h"
+#include "llvm/IR/InstrTypes.h"
 #include "llvm/IR/Instruction.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/DebugInfoMetadata.h"
 
 #include "yaml-cpp/yaml.h"
 
+#include "TraceFormat.hpp"
+#include "TraceSymbolizer.hpp"
+
 namespace pmfix {
 
 /**
@@ -32,6 +45,7 @@ struct AddressInfo {
     uint64_t end(void) const { return address + length - 1llu; }
 
     // Methods for checking overlap with others/cache lines.
+    static uint64_t cacheLineSize(void);
     bool isSingleCacheLine(void) const;
     bool overlaps(const AddressInfo &other) const;
     // Returns true if this fully encompasses other.
@@ -68,10 +82,20 @@ struct LocationInfo {
     struct Hash {
         // We only want to hash the last part of the file to avoid 
         // hash issues when the directories differ.
-        uint64_t operator()(const LocationInfo &li) const {
-            return std::hash<std::string>{}(li.function) ^
-                   std::hash<std::string>{}(li.getFilename()) ^ 
-                   std::hash<int64_t>{}(li.line);
+        uint64_t operator()(const LocationInfo &li) const;
+    };
+
+    /**
+     * Exact matching, unlike operator==. For intern tables and caches.
+     */
+    struct ExactHash {
+        uint64_t operator()(const LocationInfo &li) const;
+    };
+
+    struct ExactEqual {
+        bool operator()(const LocationInfo &a, const LocationInfo &b) const {
+            return a.line == b.line && a.function == b.function && 
+                   a.file == b.file;
         }
     };
 
@@ -83,6 +107,157 @@ struct LocationInfo {
     std::string str() const;
 };
 
+/**
+ * A canonical source location, as resolved by the BugLocationMapper. The
+ * function and file are IDs assigned by the mapper, so keys are only
+ * comparable if they come from the same mapper.
+ */
+struct LocKey {
+    static const uint32_t NONE = UINT32_MAX;
+
+    uint32_t function = NONE;
+    uint32_t file = NONE;
+    int64_t line = -1;
+
+    struct Hash {
+        uint64_t operator()(const LocKey &k) const {
+            return llvm::hash_combine(k.function, k.file, k.line);
+        }
+    };
+
+    // Keys for locations that aren't in the module are not valid.
+    bool valid(void) const { return function != NONE && file != NONE; }
+
+    bool operator==(const LocKey &o) const {
+        return function == o.function && file == o.file && line == o.line;
+    }
+    bool operator!=(const LocKey &o) const { return !(*this == o); }
+};
+
+/**
+ * Intern tables for trace stack frames and call stacks.
+ * 
+ * Traces have millions of events, but only a few thousand distinct call
+ * stacks, so each distinct frame and stack is stored once and events just
+ * refer to them by ID. Since the tables are exact, two stacks are equal iff
+ * their IDs are equal.
+ */
+class StackTable {
+public:
+    typedef uint32_t FrameId;
+    typedef uint32_t StackId;
+
+private:
+    struct StackHash {
+        uint64_t operator()(const std::vector<FrameId> &s) const;
+    };
+
+    std::vector<LocationInfo> frames_;
+    std::unordered_map<LocationInfo, FrameId, 
+                       LocationInfo::ExactHash, 
+                       LocationInfo::ExactEqual> frameIds_;
+    // Canonical mapper keys for each frame, see TraceInfoBuilder::build.
+    std::vector<LocKey> keys_;
+
+    std::vector<std::vector<FrameId>> stacks_;
+    std::unordered_map<std::vector<FrameId>, StackId, StackHash> stackIds_;
+
+public:
+    FrameId internFrame(const LocationInfo &li);
+
+    StackId internStack(const std::vector<FrameId> &frames);
+
+    const LocationInfo &frame(FrameId id) const { return frames_[id]; }
+
+    const LocKey &key(FrameId id) const { return keys_[id]; }
+
+    void setKey(FrameId id, const LocKey &k) { keys_[id] = k; }
+
+    const std::vector<FrameId> &stack(StackId id) const { return stacks_[id]; }
+
+    size_t numFrames() const { return frames_.size(); }
+
+    size_t numStacks() const { return stacks_.size(); }
+};
+
+/**
+ * A view of an interned call stack. Cheap to copy, and compares by ID.
+ * [0] is the innermost frame (i.e., the location of the event).
+ */
+class CallStack {
+private:
+    const StackTable *table_;
+    StackTable::StackId id_;
+
+    const std::vector<StackTable::FrameId> &frames() const {
+        return table_->stack(id_);
+    }
+
+public:
+    class const_iterator {
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef LocationInfo value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const LocationInfo *pointer;
+        typedef const LocationInfo &reference;
+
+    private:
+        const StackTable *table_;
+        std::vector<StackTable::FrameId>::const_iterator it_;
+
+    public:
+        const_iterator(const StackTable *t, 
+                       std::vector<StackTable::FrameId>::const_iterator it)
+            : table_(t), it_(it) {}
+
+        const LocationInfo &operator*() const { return table_->frame(*it_); }
+        const LocationInfo *operator->() const { return &**this; }
+        const_iterator &operator++() { ++it_; return *this; }
+        bool operator==(const const_iterator &o) const { return it_ == o.it_; }
+        bool operator!=(const const_iterator &o) const { return it_ != o.it_; }
+    };
+
+    CallStack() : table_(nullptr), id_(0) {}
+    CallStack(const StackTable *t, StackTable::StackId id) 
+        : table_(t), id_(id) {}
+
+    const StackTable *table() const { return table_; }
+
+    StackTable::StackId id() const { return id_; }
+
+    StackTable::FrameId frameId(size_t i) const { return frames()[i]; }
+
+    size_t size() const { return table_ ? frames().size() : 0; }
+    bool empty() const { return size() == 0; }
+
+    const LocationInfo &operator[](size_t i) const { 
+        return table_->frame(frames()[i]); 
+    }
+
+    /**
+     * The canonical mapper key of the i-th frame.
+     */
+    const LocKey &key(size_t i) const { return table_->key(frames()[i]); }
+
+    const_iterator begin() const;
+    const_iterator end() const;
+
+    /**
+     * Copy the frames out, for code that needs to modify them.
+     */
+    std::vector<LocationInfo> vec() const { 
+        std::vector<LocationInfo> v;
+        for (const LocationInfo &li : *this) v.push_back(li);
+        return v;
+    }
+
+    bool operator==(const CallStack &o) const { 
+        return table_ == o.table_ && id_ == o.id_; 
+    }
+    bool operator!=(const CallStack &o) const { return !(*this == o); }
+};
+
 /**
  * Location for a fix to generate.
  * 
@@ -95,6 +270,12 @@ struct FixLoc {
 
     LocationInfo dbgLoc;
 
+    /**
+     * For a copy of inlined code, the call it was inlined at (whose own
+     * getInlinedAt() continues the chain). Null for code in its own function.
+     */
+    const llvm::DILocation *inlinedAt = nullptr;
+
     struct Hash {
         uint64_t operator()(const FixLoc &fl) const;
     };
@@ -125,6 +306,37 @@ struct FixLoc {
     std::string str() const;
 };
 
+/**
+ * The calls at a source location (in the ranges of its FixLocs), grouped so
+ * a trace frame's callee can be found without scanning instructions.
+ * 
+ * Recorded when the location is mapped. Fixes may point a call at a new
+ * function later, so check getCalledFunction() before relying on byCallee.
+ */
+struct CallSites {
+    /**
+     * Functions that show up in traces under other names (e.g. the
+     * llvm.memcpy intrinsics, or PMDK's wrappers), matched by name.
+     */
+    enum MemKind { MEMCPY, MEMSET, MEMMOVE, STRNCPY, NUM_MEM_KINDS };
+
+    // Every call except to debug intrinsics, in program order.
+    std::vector<llvm::CallBase*> all;
+    // Direct calls, by callee.
+    llvm::DenseMap<const llvm::Function*, 
+                   std::vector<llvm::CallBase*>> byCallee;
+    // Direct calls to functions of each MemKind.
+    std::vector<llvm::CallBase*> memory[NUM_MEM_KINDS];
+    // Calls through function pointers.
+    std::vector<llvm::CallBase*> indirect;
+
+    static const char *memKindName(MemKind kind);
+
+    void add(llvm::CallBase *cb);
+
+    bool empty() const { return all.empty(); }
+};
+
 /**
  * Creates a map of source code location -> LLVM IR location. Then allows lookups
  * so that bugs can be mapped from trace info (which are at source level) to
@@ -134,55 +346,297 @@ struct FixLoc {
  * code---not just multiple assembly instructions, but multiple locations. The
  * solution I think is just apply fixes to both locations. The instructions 
  * should be identical.
+ *
+ * Only the function names are indexed up front. A function's instructions are
+ * mapped the first time key() resolves a location in it, so the cost follows
+ * the functions the trace touches, not the size of the module. Since
+ * TraceInfoBuilder::finish takes the key of every trace frame, that happens
+ * before anything is fixed.
+ *
+ * In optimized code, an instruction inlined from g into f (at f's line L2)
+ * is found both under g's own line, like a trace with inlined frames
+ * reports it, and under f:L2, the call it replaced. Every copy of inlined
+ * code gets its own FixLocs, told apart by the inlined-at location (line
+ * and column), and locate() picks the copies a call stack went through.
+ * Inlined functions are only known once a function they were inlined into
+ * is mapped.
+ *
+ * There is one mapper per module, owned by the module's FixerContext.
  */
 class BugLocationMapper {
 private:
 
+    /**
+     * Module files matching a trace file path, out of the first `scanned`
+     * files (more are added as functions are mapped).
+     */
+    struct FileMatches {
+        size_t scanned = 0;
+        std::vector<uint32_t> ids;
+    };
+
+    typedef std::unordered_map<LocKey, 
+                               std::list<llvm::Instruction*>, 
+                               LocKey::Hash> InstMap;
+
+    typedef std::unordered_map<LocKey, 
+                               std::list<FixLoc>, 
+                               LocKey::Hash> FixLocMap;
+
+    typedef std::unordered_map<LocKey, CallSites, LocKey::Hash> CallSiteMap;
+
+    // Marks function IDs local to a Partial, for inlined functions the
+    // mapper hadn't seen yet.
+    static const uint32_t LOCAL_FN = 1u << 31;
+
+    /**
+     * The locations of some functions, mapped apart from the rest so
+     * functions can be mapped in parallel. The file IDs in the keys are
+     * local to it until merge() renumbers them.
+     */
+    struct Partial {
+        llvm::StringMap<uint32_t> fnIds;
+        std::vector<std::string> functions;
+        llvm::StringMap<uint32_t> fileIds;
+        std::vector<std::string> files;
+        InstMap locMap;
+        FixLocMap fixLocMap;
+        CallSiteMap callSites;
+    };
+
+    /**
+     * The locations of the function being mapped, before they go into a
+     * Partial. Inlined code can add to the same key from many functions.
+     */
+    struct FunctionLocs {
+        std::vector<LocKey> keys;
+        InstMap insts;
+        // The inlined-at site of each instruction in insts, for that key.
+        std::unordered_map<LocKey, 
+                           std::vector<const llvm::DILocation*>,
+                           LocKey::Hash> sites;
+    };
+
     llvm::Module &m_;
 
-    std::unordered_map<LocationInfo, 
-                       std::list<llvm::Instruction*>, 
-                       LocationInfo::Hash> locMap_;
-    
-    std::unordered_map<LocationInfo, 
-                       std::list<FixLoc>, 
-                       LocationInfo::Hash> fixLocMap_;
+    // IDs for the debug info files in the module.
+    mutable llvm::StringMap<uint32_t> fileIds_;
+    mutable std::vector<std::string> files_;
+
+    // Function ID -> its definition, and whether its locations are mapped.
+    // Functions that only exist inlined have no definition.
+    mutable llvm::StringMap<uint32_t> fnIds_;
+    mutable std::vector<std::string> functions_;
+    mutable std::vector<llvm::Function*> fnDefs_;
+    size_t numDefs_ = 0;
+    mutable std::vector<bool> mapped_;
+    mutable size_t numMapped_ = 0;
+
+    // Filled in as functions are mapped, see mapFunction().
+    mutable InstMap locMap_;
+    mutable FixLocMap fixLocMap_;
+    mutable CallSiteMap callSites_;
+
+    // Memoized results of key(). A key depends on the functions, files and
+    // locations mapped so far, so merge() clears these when it adds any.
+    mutable std::unordered_map<LocationInfo, LocKey, 
+                               LocationInfo::ExactHash, 
+                               LocationInfo::ExactEqual> keys_;
+    // Trace file path -> module files it could refer to.
+    mutable llvm::StringMap<FileMatches> fileMatches_;
+
+    // Function names without clone suffixes, both as-is and demangled ->
+    // the functions with that name.
+    llvm::StringMap<std::vector<llvm::Function*>> fnsByName_;
+    // Demangled names of the functions asked about, so callers don't
+    // demangle per use.
+    mutable llvm::DenseMap<const llvm::Function*, std::string> demangled_;
+
+    void indexFunctions(llvm::Module &m);
+
+    static uint32_t intern(llvm::StringMap<uint32_t> &ids, 
+                           std::vector<std::string> &names,
+                           llvm::StringRef s);
+
+    const std::vector<uint32_t> &matchFile(const std::string &path) const;
+
+    /**
+     * The name a trace gives the function of an inlined location: its
+     * linkage name, or its plain name for C.
+     */
+    static llvm::StringRef inlinedFunctionName(const llvm::DILocation *loc);
+
+    uint32_t partFunction(Partial &part, llvm::StringRef name) const;
 
-    void insertMapping(llvm::Instruction *i);
+    const std::string &functionName(const Partial &part, uint32_t id) const;
 
-    void createMappings(llvm::Module &m);
+    static void addMapping(FunctionLocs &locs, const LocKey &k, 
+                           llvm::Instruction *i, 
+                           const llvm::DILocation *site);
 
-    static std::unique_ptr<BugLocationMapper> instance;
+    /**
+     * Add i to the locations of its function fn. Instructions of inlined
+     * code are added at each level of their inlined-at chain.
+     */
+    void insertMapping(uint32_t fn, llvm::Instruction *i, Partial &part,
+                       FunctionLocs &locs) const;
 
-    BugLocationMapper(llvm::Module &m) : m_(m) { createMappings(m); }
+    std::list<FixLoc> createFixLocs(
+        const LocKey &location,
+        const std::list<llvm::Instruction*> &instructions,
+        const std::vector<const llvm::DILocation*> &sites,
+        const Partial &part,
+        const llvm::DenseMap<const llvm::Instruction*, unsigned> &ordinals) 
+        const;
+
+    /**
+     * The key of an inlined-at location in function f. Not valid if the
+     * mapper doesn't know its function or file.
+     */
+    LocKey siteKey(const llvm::DILocation *site, 
+                   const llvm::Function *f) const;
+
+    /**
+     * Whether the copy fl is inlined along frames idx+1... of cs.
+     */
+    bool inlinedAlong(const FixLoc &fl, const CallStack &cs, 
+                      size_t idx) const;
+
+    /**
+     * Map the locations of function fn into part. Only reads the module and
+     * the function index, so workers can do this at the same time.
+     */
+    void mapInto(uint32_t fn, Partial &part) const;
+
+    void merge(Partial &part) const;
+
+    /**
+     * Map the locations of function fn, if that hasn't been done yet.
+     */
+    void mapFunction(uint32_t fn) const;
 
     BugLocationMapper(const BugLocationMapper &) = delete;
 
 public:
-    
-    static BugLocationMapper &getInstance(llvm::Module &m);
+
+    explicit BugLocationMapper(llvm::Module &m) : m_(m) { indexFunctions(m); }
+
+    /**
+     * Resolve a source location (e.g. from a trace) to the module's location
+     * IDs. Trace file paths only have to match the debug info file name
+     * partially (see LocationInfo::operator==); this is done once per
+     * distinct location, after which lookups are just integer hashing.
+     */
+    LocKey key(const LocationInfo &li) const;
+
+    /**
+     * Map the locations of the named functions up front, spread over a
+     * thread pool, instead of one at a time as key() gets to them.
+     */
+    void mapFunctions(const std::vector<llvm::StringRef> &names) const;
+
+    const std::list<FixLoc> &operator[](const LocKey &k) const 
+        { return fixLocMap_.at(k); }
+
+    bool contains(const LocKey &k) const 
+        { return fixLocMap_.count(k); }
+
+    const std::list<llvm::Instruction*> &insts(const LocKey &k) const 
+        { return locMap_.at(k); }
+
+    bool instsContains(const LocKey &k) const 
+        { return locMap_.count(k); }
 
     const std::list<FixLoc> &operator[](const LocationInfo &li) const 
-        { return fixLocMap_.at(li); }
+        { return (*this)[key(li)]; }
+
+    /**
+     * The fix locations of frame idx of cs. In optimized code a location
+     * has a copy in every function it was inlined into; this keeps the
+     * copies inlined along the rest of the stack. If there are none (e.g.
+     * the trace has no inlined frames), it keeps the code in its own
+     * function, and failing that, returns every copy.
+     */
+    std::list<FixLoc> locate(const CallStack &cs, size_t idx) const;
+
+    /**
+     * Whether the callee frame is code inlined at the caller frame, i.e.
+     * there is no call between them.
+     */
+    bool isInlinedAt(const LocationInfo &callee, 
+                     const LocationInfo &caller) const;
 
     bool contains(const LocationInfo &li) const 
-        { return fixLocMap_.count(li); }
+        { return contains(key(li)); }
 
     const std::list<llvm::Instruction*> &insts(const LocationInfo &li) const 
-        { return locMap_.at(li); }
+        { return insts(key(li)); }
 
     bool instsContains(const LocationInfo &li) const 
-        { return fixLocMap_.count(li); }
+        { return instsContains(key(li)); }
+
+    /**
+     * The calls at a location; empty if there are none or k isn't mapped.
+     */
+    const CallSites &callSites(const LocKey &k) const;
+
+    const CallSites &callSites(const LocationInfo &li) const
+        { return callSites(key(li)); }
+
+    /**
+     * The calls at k that can be the call to the trace function `callee`:
+     * direct calls to the function findFunction(callee) names if there are
+     * any, otherwise direct calls to functions whose demangled name contains
+     * it, and calls through function pointers. In program order.
+     */
+    std::vector<llvm::CallBase*> callsTo(const LocKey &k, 
+                                         llvm::StringRef callee) const;
+
+    std::vector<llvm::CallBase*> callsTo(const LocationInfo &li, 
+                                         llvm::StringRef callee) const
+        { return callsTo(key(li), callee); }
 
     llvm::Module &module() const { return m_; }
 
+    /**
+     * How many of the module's functions have had their locations mapped.
+     */
+    size_t numMappedFunctions() const { return numMapped_; }
+
+    size_t numFunctions() const { return numDefs_; }
+
+    /**
+     * Strips the suffixes LLVM adds to cloned or renamed local symbols,
+     * e.g. "foo.1488" or "foo.constprop.0" -> "foo".
+     */
+    static llvm::StringRef stripCloneSuffix(llvm::StringRef name);
+
+    /**
+     * The demangled name of f (suffixes and all). Computed once per function,
+     * when first asked for.
+     */
+    const std::string &demangledName(const llvm::Function *f) const;
+
+    /**
+     * Find the function a trace frame refers to: either by its exact symbol
+     * name, or by its name without clone suffixes (mangled or demangled).
+     * Returns nullptr if there is no match or the match is ambiguous.
+     */
+    llvm::Function *findFunction(llvm::StringRef name) const;
+
 };
 
+/**
+ * One trace event. Traces have millions of these, so they are kept compact:
+ * the stack (and so the location) is an interned ID, the address ranges are
+ * stored inline and there are no per-event strings. See the static_assert
+ * below.
+ */
 struct TraceEvent {
     /**
      * The type of event, i.e. the kind of operation.
      */
-    enum Type {
+    enum Type : int8_t {
         INVALID = -1,
         STORE = 0, FLUSH, FENCE, 
         ASSERT_PERSISTED, ASSERT_ORDERED, REQUIRED_FLUSH
@@ -191,23 +645,82 @@ struct TraceEvent {
     /**
      * Which bug finder the source came from.
      */
-    enum Source {
+    enum Source : int8_t {
         UNKNOWN = -1, PMTEST = 0, GENERIC = 1
     };
 
+    /**
+     * Only ASSERT_ORDERED uses both.
+     */
+    static const size_t MAX_ADDRESSES = 2;
+
     static Type getType(std::string typeString);
 
-    // Event data.
-    Source source;
-    Type type;
-    uint64_t timestamp;
-    std::vector<AddressInfo> addresses;
-    LocationInfo location;
-    bool isBug;
-    std::vector<LocationInfo> callstack;
+private:
+    // The table the call stack is interned in, as in CallStack.
+    const StackTable *stacks_ = nullptr;
+
+public:
+    // Event data, packed into one word with the time; see setTime.
+    uint64_t timestamp : 40;
+    // The thread that ran the event, 0 if the trace doesn't say.
+    uint64_t thread : 16;
+    Type type : 4;
+    Source source : 2;
+    bool isBug : 1;
+
+private:
+    // The stack ID, with the number of addresses in the top bits.
+    uint32_t stack_ : 30;
+    uint32_t numAddresses_ : 2;
+
+    // Lengths are stored in 32 bits, which is plenty for a single store,
+    // flush or assertion. Addresses are split in their low 32 and high 16
+    // bits, as user-space addresses only have 48.
+    uint32_t length_[MAX_ADDRESSES] = {0, 0};
+    uint32_t addressLow_[MAX_ADDRESSES] = {0, 0};
+    uint16_t addressHigh_[MAX_ADDRESSES] = {0, 0};
+
+public:
+    TraceEvent() : timestamp(0), thread(0), type(INVALID), source(UNKNOWN), 
+                   isBug(false), stack_(0), numAddresses_(0) {}
+
+    /**
+     * Set the timestamp and thread, which have to fit in their fields.
+     */
+    void setTime(uint64_t ts, uint64_t tid) {
+        assert(ts < (1ull << 40) && "timestamp too large!");
+        assert(tid < (1ull << 16) && "thread ID too large!");
+        timestamp = ts;
+        thread = tid;
+    }
+
+public:
+    CallStack callstack(void) const { return CallStack(stacks_, stack_); }
 
-    // Debug
-    std::string typeString;
+    void setCallStack(const CallStack &cs);
+
+    /**
+     * The innermost frame of the call stack.
+     */
+    const LocationInfo &location(void) const { return callstack()[0]; }
+
+    size_t numAddresses(void) const { return numAddresses_; }
+
+    AddressInfo address(size_t i = 0) const {
+        assert(i < numAddresses_ && "no such address!");
+        AddressInfo ai;
+        ai.address = (uint64_t)addressHigh_[i] << 32 | addressLow_[i];
+        ai.length = length_[i];
+        return ai;
+    }
+
+    void addAddress(const AddressInfo &ai);
+
+    /**
+     * The name of the type, as in the trace.
+     */
+    const char *typeName(void) const;
 
     // Helper
 
@@ -219,6 +732,11 @@ struct TraceEvent {
 
     static bool callStacksEqual(const TraceEvent &a, const TraceEvent &b);
 
+    /**
+     * The canonical mapper key of the event location.
+     */
+    const LocKey &locationKey(void) const { return callstack().key(0); }
+
     std::string str() const;
 
     /**
@@ -227,6 +745,7 @@ struct TraceEvent {
     std::list<llvm::Value*> pmValues(const BugLocationMapper &mapper) const;
 };
 
+static_assert(sizeof(TraceEvent) < 48, "TraceEvent should stay compact");
 
 class TraceInfo {
 private:
@@ -237,17 +756,39 @@ private:
     std::list<int> bugs_; 
     // -- the actual events
     std::vector<TraceEvent> events_;
+    // -- one event per (type, stack) dropped by the reduction, see omitted()
+    std::vector<TraceEvent> omitted_;
     // -- the source of the trace
     TraceEvent::Source source_;
+    // -- the frames and stacks the events refer to. On the heap so the
+    // CallStacks stay valid when the TraceInfo is moved.
+    std::unique_ptr<StackTable> stacks_;
 
     // Metadata. For stuff like which fix generator to use.
     YAML::Node meta_;
 
+    // Address index, so bug handlers don't have to scan the whole trace.
+    // -- cache line -> indices of the STOREs and FLUSHes touching it, ascending
+    std::unordered_map<uint64_t, std::vector<int>> lineOps_;
+    // -- thread -> indices of its FENCEs, ascending. An sfence only orders
+    // the flushes of the thread that runs it.
+    std::unordered_map<uint32_t, std::vector<int>> fences_;
+
+    // When several traces are merged:
+    // -- index of the first event of each trace
+    std::vector<int> segments_;
+    // -- bug index -> times it was reported, if more than once
+    std::unordered_map<int, uint32_t> occurrences_;
+
+    void buildIndex(void);
+
     // Don't want direct construction of this class.
-    TraceInfo() {}
+    TraceInfo() : source_(TraceEvent::UNKNOWN), stacks_(new StackTable()) {}
 
     void addEvent(TraceEvent &&event);
 
+    void setMetadata(YAML::Node m);
+
     TraceInfo(YAML::Node m);
 
 public:
@@ -259,16 +800,73 @@ public:
 
     const std::vector<TraceEvent> &events() const { return events_; }
 
+    /**
+     * With -reduce-trace or -trace-window, the events that were dropped, one
+     * per type and call stack and without addresses. Analyses that look at
+     * every location in the trace (e.g., seeding the PM values) should visit
+     * these too; see forAllLocations.
+     */
+    const std::vector<TraceEvent> &omitted() const { return omitted_; }
+
+    /**
+     * Visit events(), then omitted().
+     */
+    void forAllLocations(llvm::function_ref<void(const TraceEvent&)> fn) const;
+
     size_t size() const { return events_.size(); }
 
     bool empty() const { return events_.empty(); }
 
     std::string str() const;
 
+    /**
+     * Sizes of the events, stacks and address index, for -trace-mem-stats.
+     */
+    void printMemoryStats(llvm::raw_ostream &os) const;
+
     template<typename T>
     T getMetadata(const char *key) const { return meta_[key].as<T>(); }
 
     TraceEvent::Source getSource() const { return source_; }
+
+    const StackTable &stacks() const { return *stacks_; }
+
+    /**
+     * Visit the STOREs and FLUSHes that overlap addr and come before the 
+     * given index (in the same trace), latest first, until fn returns false.
+     * Finding the first event is logarithmic in the number of events on each
+     * cache line.
+     */
+    void forEachOpBefore(const AddressInfo &addr, int before,
+                         llvm::function_ref<bool(int)> fn) const;
+
+    /**
+     * Is there a FENCE on the given thread with after < index < before? Only
+     * FENCEs from the same trace as before count.
+     */
+    bool hasFenceBetween(int after, int before, uint32_t thread) const;
+
+    /**
+     * Number of threads that ran a FENCE.
+     */
+    size_t numFencingThreads() const { return fences_.size(); }
+
+    /**
+     * Number of traces merged into this one.
+     */
+    size_t numSegments() const { return segments_.empty() ? 1 : segments_.size(); }
+
+    /**
+     * Index of the first event of the trace that event idx came from.
+     * Orderings (and so bug back-scans) never cross traces.
+     */
+    int segmentStart(int idx) const;
+
+    /**
+     * How many times the bug at index idx was reported across all the
+     * merged traces (see TraceInfoBuilder::merge).
+     */
+    uint32_t occurrences(int idx) const;
 };
 
 /**
@@ -280,19 +878,175 @@ private:
     YAML::Node doc_;
     BugLocationMapper &mapper_;
 
+    // Set instead of doc_ when the trace comes from a file.
+    std::string traceFile_;
+
+    // Set instead of doc_ when reading a binary trace.
+    std::unique_ptr<trace::BinaryTrace> binary_;
+    // Frames of the binary trace, interned the first time they are used.
+    std::vector<StackTable::FrameId> frames_;
+    std::vector<bool> framesDecoded_;
+    // Binary trace stack ID -> interned stack.
+    std::vector<StackTable::StackId> binaryStacks_;
+    std::vector<bool> stacksDecoded_;
+
+    StackTable::FrameId frame(TraceInfo &ti, uint32_t id);
+
+    CallStack stack(TraceInfo &ti, uint32_t id);
+
+    CallStack stack(TraceInfo &ti, const std::vector<trace::Frame> &frames);
+
+    // For traces with PC-only frames, created from the metadata on first use.
+    std::unique_ptr<trace::TraceSymbolizer> symbolizer_;
+    bool symbolizerCreated_ = false;
+    // Scratch space for symbolized stacks.
+    std::vector<trace::Frame> expanded_;
+
+    trace::TraceSymbolizer &symbolizer(TraceInfo &ti);
+
+    StackTable::FrameId internFrame(TraceInfo &ti, const trace::Frame &f);
+
+    // Hashes of the (type, stack)s already in TraceInfo::omitted_.
+    std::unordered_set<size_t> omittedSeen_;
+
+    /**
+     * An event the reduction dropped.
+     */
+    void processOmitted(TraceInfo &ti, const trace::Record &event);
+
+    // Scratch space for interning stacks.
+    std::vector<StackTable::FrameId> scratch_;
+
+    // One builder per trace, when there are several.
+    std::vector<std::unique_ptr<TraceInfoBuilder>> parts_;
+
+    // (type, stack, (length, offset in cache line) of each range) -> the
+    // first merged bug with that key.
+    typedef std::tuple<int, StackTable::StackId, std::vector<uint64_t>> BugKey;
+    std::map<BugKey, int> firstBugs_;
+
+    void open(const std::string &traceFile);
+
+    bool openBinary(const std::string &path);
+
+    /**
+     * Resolved traces can be cached in -trace-cache-dir, as binary traces
+     * with the merge state in the metadata. Bump this when the resolution
+     * or the snapshot contents change.
+     */
+    static const int SNAPSHOT_VERSION = 5;
+
+    /**
+     * Where the snapshot for this module and these traces lives, or empty
+     * if there are no trace files. The files are keyed by path, size and
+     * modification time; the modules the traces were symbolized from are
+     * checked by hash when the snapshot loads.
+     */
+    std::string snapshotPath(void) const;
+
+    bool loadSnapshot(TraceInfo &ti, const std::string &path);
+
+    void saveSnapshot(const TraceInfo &ti, const std::string &path) const;
+
+    /**
+     * Have the mapper map every function in the trace, in parallel.
+     */
+    void mapFunctions(TraceInfo &ti);
+
+    /**
+     * Build the address index and the mapper keys.
+     */
+    void finish(TraceInfo &ti);
+
+    /**
+     * Read the trace events, without resolving them.
+     */
+    void load(TraceInfo &ti);
+
+    /**
+     * Load every part in parallel, then merge them in order.
+     */
+    void loadParts(TraceInfo &ti);
+
+    /**
+     * Append a loaded trace as a new segment. Bugs with the BugKey of an
+     * earlier bug, from this trace or an earlier one, get the same fix, so
+     * they are dropped and counted on the first one instead.
+     */
+    void merge(TraceInfo &ti, TraceInfo &part);
+
     /**
      * Convert the YAML node into a proper trace event.
      */
     void processEvent(TraceInfo &ti, YAML::Node event);
 
+    /**
+     * Convert a binary trace record into a proper trace event.
+     */
+    void processEvent(TraceInfo &ti, const trace::EventRecord &event);
+
+    /**
+     * Convert a streamed trace record into a proper trace event.
+     */
+    void processEvent(TraceInfo &ti, const trace::Record &event);
+
+    /**
+     * Read the trace one event at a time, without building a document.
+     * If reduce is set, the trace goes through trace::TraceReducer first.
+     */
+    void streamTrace(TraceInfo &ti, bool reduce);
+
+    /**
+     * How resolveCall fixed up a callee frame.
+     */
+    struct CallResolution {
+        // The callee's name in the module, or empty if the frame was fine.
+        std::string function;
+        // The call in the caller that the callee was matched to, if any.
+        llvm::CallBase *callSite;
+    };
+
+    // Keyed on the (caller, callee) frames. The same pairs and stacks show
+    // up in a huge number of events, so each is only resolved once.
+    llvm::DenseMap<std::pair<StackTable::FrameId, StackTable::FrameId>,
+                   CallResolution> resolvedCalls_;
+    llvm::DenseMap<StackTable::StackId, StackTable::StackId> resolvedStacks_;
+
+    /**
+     * Work out which function the caller frame actually calls, in case the
+     * callee's name in the trace doesn't match the module (e.g. ".NNN" clones).
+     */
+    const CallResolution &resolveCall(TraceInfo &ti,
+                                      StackTable::FrameId caller,
+                                      StackTable::FrameId callee);
+
+    /**
+     * Returns the stack with all of its callee frames resolved.
+     */
+    StackTable::StackId resolveStack(TraceInfo &ti, const CallStack &cs);
+
     /**
      * Fixes up slight naming differences in trace event stack traces.
      */
-    void resolveLocations(TraceEvent &te);
+    void resolveLocations(TraceInfo &ti, TraceEvent &te);
 
 public:
-    TraceInfoBuilder(llvm::Module &m, YAML::Node document) 
-        : mapper_(BugLocationMapper::getInstance(m)), doc_(document) {};
+    TraceInfoBuilder(BugLocationMapper &mapper, YAML::Node document) 
+        : mapper_(mapper), doc_(document) {};
+
+    /**
+     * Load the trace from a file, which may either be YAML or a binary trace
+     * (see trace/TraceFormat.hpp). Binary traces are mmap'd rather than read,
+     * and YAML traces are streamed rather than loaded as a document.
+     */
+    TraceInfoBuilder(BugLocationMapper &mapper, const std::string &traceFile);
+
+    /**
+     * Load and merge several traces. They are read in parallel, and bugs are
+     * deduplicated across them (see TraceInfo::occurrences).
+     */
+    TraceInfoBuilder(BugLocationMapper &mapper, 
+                     const std::vector<std::string> &traceFiles);
 
     TraceInfo build(void);
 };
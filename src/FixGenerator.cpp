@@ -496,7 +496,7 @@ Instruction *GenericFixGenerator::insertFence(const FixLoc &fl) {
 Instruction *GenericFixGenerator::insertPersistentSubProgram(
     BugLocationMapper &mapper,
     const FixLoc &fl,
-    const std::vector<LocationInfo> &callstack, 
+    const CallStack &callstack, 
     int idx,
     bool addFlushes,
     bool addFence) {
@@ -509,24 +509,20 @@ Instruction *GenericFixGenerator::insertPersistentSubProgram(
     for (int i = 0; i < idx; ++i) {
         errs() << "GFLI IDX " << i << ": " << callstack[i].str() << "\n";
 
-        if (!mapper.contains(callstack[i])) {
+        if (!mapper.contains(callstack.key(i))) {
             // assert(0 == i && "don't know how to handle nested unknowns!");
             if (i > 0) {
                 for (const auto &li : callstack) {
                     errs() << li.str() << "---contains? " << mapper.contains(li) << "\n";
                 }
                 errs() << "don't know how to handle nested unknowns, abort!\n";
-                errs() << "idx=" << idx << ", contains=" << mapper.contains(callstack[0]) << "\n";
+                errs() << "idx=" << idx << ", contains=" << mapper.contains(callstack.key(0)) << "\n";
                 return nullptr;
             }
 
-            std::list<CallBase*> candidates;
-            auto &nextFixLoc = mapper[callstack[i+1]];
-            assert(!nextFixLoc.empty());
-            assert(nextFixLoc.size() == 1);
-            for (Instruction *i : nextFixLoc.front().insts()) {
-                if (auto *c = dyn_cast<CallBase>(i)) candidates.push_back(c);
-            }
+            assert(mapper[callstack.key(i+1)].size() == 1);
+            const std::vector<CallBase*> &candidates = 
+                mapper.callSites(callstack.key(i+1)).all;
             assert(!candidates.empty() && "has to be calling something!");
             assert(candidates.size() == 1 && "don't know how to handle multiple calls yet!");
 
@@ -595,7 +591,14 @@ Instruction *GenericFixGenerator::insertPersistentSubProgram(
             continue;
         }
 
-        auto &fixLocList = mapper[callstack[i]];
+        std::list<FixLoc> fixLocList = mapper.locate(callstack, i);
+        if (fixLocList.front().inlinedAt) {
+            // Inlined into the next frame, so there is no call to redirect
+            // here; the function it was inlined into gets the copy.
+            errs() << "INLINED: " << callstack[i].str() << "\n";
+            continue;
+        }
+
         if (fixLocList.size() > 1) {
             // Make sure they're all in the same function, cuz then it's fine.
             std::unordered_set<Function*> fns;
@@ -621,32 +624,30 @@ Instruction *GenericFixGenerator::insertPersistentSubProgram(
         }
         
         // Now we need to replace the call.
-        auto &nextFixLoc = mapper[callstack[i+1]];
         // assert(nextInstLoc.size() == 1 && "next still too big");
-        assert(!nextFixLoc.empty());
-
-        for (const FixLoc &nFix : nextFixLoc) {
-            for (Instruction *ni : nFix.insts()) {
-                errs() << *ni << " @ " << ni->getFunction()->getName() << "\n";
-                if (auto *cb = dyn_cast<CallBase>(ni)) {
-                    errs() << "\tCALL\n";
-                    Function *cbFn = cb->getCalledFunction();
-                    // Replace this value with a call to the new function.
-                    if (cbFn == fn) {
-                        cb->setCalledFunction(pmFn);
-                        retInst = cb;
-                    } else if (cbFn) {
-                        continue;
-                    } else {
-                        /**
-                         * For function pointers, we need a conditional mapping, a-la
-                         * if (f == old_fn) new_fn(...)
-                         */
-                        errs() << "FUNCTION POINTER: " << *cb << "\n";
-                        assert(false && "function pointer unhandled!");
-                    }
-                } 
-            }  
+        assert(!mapper[callstack.key(i+1)].empty());
+        const CallSites &nextCalls = mapper.callSites(callstack.key(i+1));
+
+        for (CallBase *cb : nextCalls.indirect) {
+            /**
+             * For function pointers, we need a conditional mapping, a-la
+             * if (f == old_fn) new_fn(...)
+             */
+            errs() << "FUNCTION POINTER: " << *cb << "\n";
+            assert(false && "function pointer unhandled!");
+        }
+
+        auto calls = nextCalls.byCallee.find(fn);
+        if (calls != nextCalls.byCallee.end()) {
+            for (CallBase *cb : calls->second) {
+                // Skip calls an earlier fix already pointed elsewhere.
+                if (cb->getCalledFunction() != fn) continue;
+
+                // Replace this value with a call to the new function.
+                errs() << *cb << " @ " << cb->getFunction()->getName() << "\n";
+                cb->setCalledFunction(pmFn);
+                retInst = cb;
+            }
         }
     }
     
@@ -847,7 +848,7 @@ Instruction *PMTestFixGenerator::insertFence(const FixLoc &fl) {
 Instruction *PMTestFixGenerator::insertPersistentSubProgram(
     BugLocationMapper &mapper,
     const FixLoc &fl,
-    const std::vector<LocationInfo> &callstack,
+    const CallStack &callstack,
     int idx,
     bool addFlush,
     bool addFence) {
@@ -93,7 +93,7 @@ public:
     virtual llvm::Instruction *insertPersistentSubProgram(
         BugLocationMapper &mapper,
         const FixLoc &fl,
-        const std::vector<LocationInfo> &callstack,
+        const CallStack &callstack,
         int idx,
         bool insertFlushes,
         bool insertFence) = 0;
@@ -148,7 +148,7 @@ public:
     virtual llvm::Instruction *insertPersistentSubProgram(
         BugLocationMapper &mapper,
         const FixLoc &fl,
-        const std::vector<LocationInfo> &callstack, 
+        const CallStack &callstack, 
         int idx,
         bool insertFlushes,
         bool insertFence) override;
@@ -183,7 +183,7 @@ public:
     virtual llvm::Instruction *insertPersistentSubProgram(
         BugLocationMapper &mapper,
         const FixLoc &fl,
-        const std::vector<LocationInfo> &callstack, 
+        const CallStack &callstack, 
         int idx,
         bool insertFlush,
         bool insertFence) override;
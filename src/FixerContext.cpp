@@ -0,0 +1,23 @@
+#include "FixerContext.hpp"
+
+#include <vector>
+
+using namespace llvm;
+using namespace pmfix;
+
+FixerContext::FixerContext(Module &m)
+    : module_(m), mapper_(m), anders_(nullptr),
+      cache_(std::make_shared<AndersenCache>()) {}
+
+SharedAndersen FixerContext::andersen(Module &m) {
+    if (!anders_) {
+        anders_ = std::make_shared<AndersenAAWrapperPass>();
+        assert(!anders_->runOnModule(m) && "failed!");
+
+        std::vector<const llvm::Value *> allocSites;
+        anders_->getResult().getAllAllocationSites(allocSites);
+        assert(!allocSites.empty());
+    }
+
+    return anders_;
+}
@@ -0,0 +1,53 @@
+#pragma once
+/**
+ * The state of one fixing session.
+ */
+
+#include "llvm/IR/Module.h"
+
+#include "BugReports.hpp"
+#include "FlowAnalyzer.hpp"
+
+namespace pmfix {
+
+/**
+ * Owns everything the fixer computes about one module: the location mapper
+ * and the alias analysis shared by every PmDesc. Nothing is kept in statics,
+ * so a process can fix several modules, one after the other or at the same
+ * time on different threads (each module in its own LLVMContext, as LLVM
+ * requires).
+ */
+class FixerContext final {
+private:
+    llvm::Module &module_;
+    BugLocationMapper mapper_;
+
+    SharedAndersen anders_;
+    SharedAndersenCache cache_;
+
+    FixerContext(const FixerContext &) = delete;
+
+public:
+    explicit FixerContext(llvm::Module &m);
+
+    llvm::Module &module(void) { return module_; }
+
+    BugLocationMapper &mapper(void) { return mapper_; }
+    const BugLocationMapper &mapper(void) const { return mapper_; }
+
+    /**
+     * The Andersen analysis behind the session's PmDescs. It is run on m the
+     * first time it is needed, and reused for the rest of the session
+     * whichever module is passed; m may be a trimmed copy of module() (see
+     * BugFixer::runTraceAA).
+     */
+    SharedAndersen andersen(llvm::Module &m);
+
+    /**
+     * Points-to sets already computed from the analysis (see
+     * PmDesc::getPointsToSet).
+     */
+    SharedAndersenCache andersenCache(void) { return cache_; }
+};
+
+}
@@ -8,6 +8,7 @@
 #include "llvm/IR/CFG.h"
 
 #include "FlowAnalyzer.hpp"
+#include "FixerContext.hpp"
 #include "PassUtils.hpp"
 
 using namespace llvm;
@@ -16,9 +17,6 @@ using namespace std;
 
 #pragma region PmDesc
 
-SharedAndersen PmDesc::anders_(nullptr);
-SharedAndersenCache PmDesc::cache_(nullptr);
-
 bool PmDesc::getPointsToSet(const llvm::Value *v,                                  
                             std::unordered_set<const llvm::Value *> &ptsSet) const {
     assert(v);
@@ -43,21 +41,10 @@ bool PmDesc::getPointsToSet(const llvm::Value *v,
     return ret;
 }
 
-PmDesc::PmDesc(Module &m) {
-    if (!anders_) {
-        anders_ = std::make_shared<AndersenAAWrapperPass>();
-        assert(!anders_->runOnModule(m) && "failed!");
+PmDesc::PmDesc(FixerContext &ctx, Module &m)
+    : anders_(ctx.andersen(m)), cache_(ctx.andersenCache()) {}
 
-        std::vector<const llvm::Value *> allocSites;
-        anders_->getResult().getAllAllocationSites(allocSites);
-        assert(!allocSites.empty());
-        // errs() << "ALLOC: " << allocSites.size() << "\n";
-        // assert(false);
-    }
-    if (!cache_) {
-        cache_ = std::make_shared<AndersenCache>();
-    }
-}
+PmDesc::PmDesc(FixerContext &ctx) : PmDesc(ctx, ctx.module()) {}
 
 void PmDesc::addKnownPmValue(Value *pmv) {
     std::unordered_set<const llvm::Value *> ptsSet, filtered;
@@ -273,16 +260,16 @@ ContextBlock::Shared ContextBlock::create(FnContext::Shared ctx,
     return node;
 }
 
-ContextBlock::Shared ContextBlock::create(const BugLocationMapper &mapper, 
-                                          TraceEvent &te) {
+ContextBlock::Shared ContextBlock::create(FixerContext &fctx, TraceEvent &te) {
+    const BugLocationMapper &mapper = fctx.mapper();
 
     // Start from the top down.
-    FnContext::Shared parent = FnContext::create(mapper.module());
+    FnContext::Shared parent = FnContext::create(fctx);
 
     errs() << te.str() << "\n\n";
 
     // Copy. So we can modify.
-    std::vector<LocationInfo> &stack = te.callstack;
+    std::vector<LocationInfo> stack = te.callstack().vec();
 
     // [0] is the current location, which we use to set up the node itself.
     for (int i = stack.size() - 1; i >= 1; --i) {
@@ -295,14 +282,8 @@ ContextBlock::Shared ContextBlock::create(const BugLocationMapper &mapper,
         if (!caller.valid() || !mapper.contains(caller)) {
             errs() << "SKIP: " << caller.valid() << " " << 
                 mapper.contains(caller) << "\n";
-            Function *f = mapper.module().getFunction(caller.function);
-            if (!f) {
-                errs() << "\tnull!\n";
-                f = mapper.module().getFunction("obj_alloc_construct.1488");
-                if (!f) errs() << "\t\talso null!\n";
-                else errs() << *f << "\n";
-                errs() << "DEMANGLES: " << utils::demangle("obj_alloc_construct.1488") << "\n";
-            }
+            Function *f = mapper.findFunction(caller.function);
+            if (!f) errs() << "\tnull!\n";
             else errs() << *f << "\n";
 
             continue;
@@ -310,32 +291,16 @@ ContextBlock::Shared ContextBlock::create(const BugLocationMapper &mapper,
 
         // The location in the caller calls the function of the callee
 
-        std::list<CallBase*> possibleCallSites;
-
-        for (auto &fLoc : mapper[caller]) {
-            assert(fLoc.isValid() && "wat");
-            errs() << "START LOC: \n";
-            // errs() << *fLoc.insts().front()->getFunction() << "\n";
-            for (Instruction *inst : fLoc.insts()) {
-                errs() << *inst << "\n";
-                if (auto *cb = dyn_cast<CallBase>(inst)) {
-                    Function *f = cb->getCalledFunction();
-                    if (f) {
-                        if (f->getIntrinsicID() == Intrinsic::dbg_declare) {
-                            continue;
-                        }
-
-                        std::string fname = utils::demangle(f->getName().data());
-                        if (fname.find(callee.function) == std::string::npos) {
-                            errs() << fname << " !find " << callee.function << "\n";
-                            continue;
-                        }
-                    } 
-
-                    errs() << "POSSIBLE: " << *cb << "\n";
-                    possibleCallSites.push_back(cb);
-                }
-            }
+        if (mapper.isInlinedAt(callee, caller)) {
+            // No call, the callee's code is in the caller's function.
+            errs() << "INLINED: " << callee.str() << "\n";
+            continue;
+        }
+
+        std::vector<CallBase*> possibleCallSites = 
+            mapper.callsTo(caller, callee.function);
+        for (CallBase *cb : possibleCallSites) {
+            errs() << "POSSIBLE: " << *cb << "\n";
         }
 
         if (possibleCallSites.empty()) {
@@ -366,22 +331,8 @@ ContextBlock::Shared ContextBlock::create(const BugLocationMapper &mapper,
         Function *f = callInst->getCalledFunction();
         if (!f) {
             errs() << "Try get function pointer function (" << callee.function << ")\n";
-            f = mapper.module().getFunction(callee.function);
-            if (!f) {
-                std::list<Function*> fnCandidates;
-                for (Function &fn : mapper.module()) {
-                    std::string fnName(fn.getName().data());
-                    if (fnName.find(callee.function) != std::string::npos) {
-                        // Skip false matches
-                        auto ending = fnName.substr(fnName.find(callee.function) + callee.function.size());
-                        if (ending[0] != '.') continue; // name mangling
-                        errs() << "\t\t--- " << fnName << "\n"; 
-                        fnCandidates.push_back(&fn);
-                    }
-                }
-                assert(fnCandidates.size() == 1 && "wat");
-                f = fnCandidates.front();
-            }
+            f = mapper.findFunction(callee.function);
+            assert(f && "wat");
         }
         assert(f && "don't know what's going on!!");
 
@@ -398,15 +349,14 @@ ContextBlock::Shared ContextBlock::create(const BugLocationMapper &mapper,
      * Now, we set up arguments so we can call the other create() function.
      */ 
 
-    if (stack[0] != te.location) {
+    if (stack[0] != te.location()) {
         errs() << "DING\n";
-        te.location = stack[0];
     }
 
     const LocationInfo &curr = stack[0];
     if (!mapper.contains(curr)) {
         errs() << "stack[0] " << curr.str() << "\n";
-        errs() << "location " << te.location.str() << "\n";
+        errs() << "location " << te.location().str() << "\n";
 
         LocationInfo dup = curr;
         dup.function = "memset_mov2x64b.896";
@@ -655,17 +605,17 @@ void ContextGraph<T>::construct(ContextBlock::Shared end) {
 }
 
 template <typename T>
-ContextGraph<T>::ContextGraph(const BugLocationMapper &mapper, 
+ContextGraph<T>::ContextGraph(FixerContext &ctx, 
                               TraceEvent &start, 
                               TraceEvent &end) {
     errs() << "CONSTRUCT ME\n\n";
 
-    ContextBlock::Shared sblk = ContextBlock::create(mapper, start);
+    ContextBlock::Shared sblk = ContextBlock::create(ctx, start);
     if (!sblk) {
         errs() << "\tCONSTRUCT ABORT!\n";
         return;
     }
-    ContextBlock::Shared eblk = ContextBlock::create(mapper, end);
+    ContextBlock::Shared eblk = ContextBlock::create(ctx, end);
     // errs() << sblk->str() << "\n";
     // errs() << eblk->str() << "\n";
 
@@ -694,6 +644,12 @@ template struct pmfix::ContextGraph<pmfix::FlowAnalyzer::Info>;
 
 #pragma region FlowAnalyzer
 
+FlowAnalyzer::FlowAnalyzer(FixerContext &ctx, 
+                           TraceEvent &start, 
+                           TraceEvent &end) 
+    : m_(ctx.module()), mapper_(ctx.mapper()), start_(start), end_(end),
+      graph_(ctx, start, end) {}
+
 bool FlowAnalyzer::interpret(ContextGraph<Info>::GraphNodePtr node,
                              Instruction *start, Instruction *end) {
     Info &info = node->metadata;
@@ -24,6 +24,8 @@ namespace pmfix {
                                std::unordered_set<const llvm::Value*>> AndersenCache;
     typedef std::shared_ptr<AndersenCache> SharedAndersenCache;     
 
+    class FixerContext;
+
     /**
      * Description of the state of persistent memory in the program.
      * 
@@ -32,8 +34,9 @@ namespace pmfix {
      */
     class PmDesc {
     private:
-        static SharedAndersen anders_;
-        static SharedAndersenCache cache_;
+        // Shared by all the PmDescs of a FixerContext.
+        SharedAndersen anders_;
+        SharedAndersenCache cache_;
 
         /**
          * There should be no need to clear/reset anything, only on a return when
@@ -45,7 +48,12 @@ namespace pmfix {
         std::unordered_set<const llvm::Value *> pm_globals_;
 
     public:
-        PmDesc(llvm::Module &m);
+        /**
+         * Uses the analysis of ctx, running it on m if it hasn't been run yet.
+         */
+        PmDesc(FixerContext &ctx, llvm::Module &m);
+
+        PmDesc(FixerContext &ctx);
 
         /**
          * Sometimes for trace alias stuff, we may not have alias info for some
@@ -118,9 +126,9 @@ namespace pmfix {
             std::unordered_map<llvm::CallBase*, FnContextPtr>
         > callBaseCache_;
 
-        FnContext(llvm::Module &m) 
+        FnContext(FixerContext &ctx) 
             : callBaseCache_(new std::unordered_map<llvm::CallBase*, FnContextPtr>), 
-              callStack_(), parent_(nullptr), pm_(m) {}
+              callStack_(), parent_(nullptr), pm_(ctx) {}
 
     public:
 
@@ -154,8 +162,8 @@ namespace pmfix {
 
         PmDesc &pm(void) { return pm_; }
 
-        static FnContextPtr create(llvm::Module &m) {
-            return std::shared_ptr<FnContext>(new FnContext(m));
+        static FnContextPtr create(FixerContext &ctx) {
+            return std::shared_ptr<FnContext>(new FnContext(ctx));
         }
 
         bool operator==(const FnContext &f) const;
@@ -186,8 +194,7 @@ namespace pmfix {
         // want to indicate the interpretation start/end as well.
         llvm::Instruction *traceInst = nullptr;
  
-        static ContextBlockPtr create(const BugLocationMapper &mapper, 
-                                      TraceEvent &te);
+        static ContextBlockPtr create(FixerContext &ctx, TraceEvent &te);
 
         /** 
          * Just finds the last instruction.
@@ -259,7 +266,7 @@ namespace pmfix {
 
         bool empty() const { return roots.empty() && leaves.empty(); }
 
-        ContextGraph(const BugLocationMapper &mapper, 
+        ContextGraph(FixerContext &ctx, 
                      TraceEvent &start, 
                      TraceEvent &end);
     };
@@ -302,12 +309,9 @@ namespace pmfix {
                        llvm::Instruction *start, llvm::Instruction *end);
 
     public:
-        FlowAnalyzer(llvm::Module &m, 
-                     const BugLocationMapper &mapper, 
+        FlowAnalyzer(FixerContext &ctx, 
                      TraceEvent &start, 
-                     TraceEvent &end) 
-            : m_(m), mapper_(mapper), start_(start), end_(end),
-              graph_(mapper, start, end) {}
+                     TraceEvent &end);
 
         /**
          * Return true if we can do anything at all, false otherwise.
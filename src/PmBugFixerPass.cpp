@@ -8,6 +8,8 @@
 
 #include "llvm/Support/CommandLine.h"
 
+#include <sys/resource.h>
+
 #include <set>
 #include <map>
 #include <stack>
@@ -19,13 +21,29 @@
 
 #include "BugReports.hpp"
 #include "BugFixer.hpp"
+#include "FixerContext.hpp"
 
 using namespace llvm;
 using namespace std;
 
 namespace pmfix {
 
-cl::opt<std::string> TraceFile("trace-file", cl::desc("<trace file>"));
+cl::list<std::string> TraceFiles("trace-file", 
+    cl::desc("<trace file, either YAML or binary (see trace-convert)>. "
+             "Can be given more than once; the traces are merged."),
+    cl::ZeroOrMore, cl::CommaSeparated);
+
+cl::opt<bool> TraceMemStats("trace-mem-stats", cl::init(false),
+    cl::desc("Report how much memory the loaded trace takes"));
+
+/**
+ * Peak resident set size so far, in KB.
+ */
+static long peakRss(void) {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage)) return 0;
+    return usage.ru_maxrss;
+}
 
 cl::list<std::string> Immutables("immutable-fns", cl::desc("Something"), 
                                  cl::ZeroOrMore, cl::CommaSeparated);
@@ -42,20 +60,30 @@ struct PmBugFixerPass : public ModulePass {
     }
 
     bool runOnModule(Module &m) override {
-        // {
-        //     auto &mapper = BugLocationMapper::getInstance(m);
-        // }
+        if (TraceFiles.empty()) {
+            errs() << "Err: no -trace-file given!!!\n";
+            return false;
+        }
 
-        YAML::Node trace_info_doc = YAML::LoadFile(TraceFile);
-        TraceInfo ti = TraceInfoBuilder(m, trace_info_doc).build();
+        std::vector<std::string> traceFiles(TraceFiles.begin(), 
+                                            TraceFiles.end());
+        long rssBefore = peakRss();
+        FixerContext ctx(m);
+        TraceInfo ti = TraceInfoBuilder(ctx.mapper(), traceFiles).build();
         // errs() << "TraceInfo string:\n" << ti.str() << '\n';
+        if (TraceMemStats) {
+            ti.printMemoryStats(errs());
+            long rssAfter = peakRss();
+            errs() << "Peak RSS: " << rssAfter / 1024 << " MB (+" << 
+                (rssAfter - rssBefore) / 1024 << " MB loading the trace)\n";
+        }
         if (ti.empty()) {
             errs() << "Err: trace is empty!!!\n";;
             return false;
         }
         
         // Construct bug fixer
-        BugFixer fixer(m, ti);
+        BugFixer fixer(ctx, ti);
         errs() << "fixer built!\n";
         for (const std::string &fnName : Immutables) {
             fixer.addImmutableFunction(fnName);
@@ -0,0 +1,299 @@
+#include "DurabilityChecker.hpp"
+
+#include <algorithm>
+#include <cassert>
+
+using namespace llvm;
+using namespace pmfix::trace;
+
+static const size_t MIN_SLOTS = 1024;
+
+void DurabilityChecker::Stats::print(raw_ostream &os) const {
+    os << "Checked " << operations << " operations: " << notPersisted <<
+        " stores not made persistent, " << redundantFlushes <<
+        " unnecessary flushes (at most " << peakLines <<
+        " dirty cache lines)\n";
+}
+
+DurabilityChecker::DurabilityChecker(RecordSink &out) : out_(out) {
+    slots_.resize(MIN_SLOTS);
+}
+
+#pragma region Line table
+
+size_t DurabilityChecker::find(uint64_t line) const {
+    size_t i = hash(line) & mask();
+    while (slots_[i].line != EMPTY && slots_[i].line != line) {
+        i = (i + 1) & mask();
+    }
+    return i;
+}
+
+DurabilityChecker::Slot &DurabilityChecker::insert(uint64_t line) {
+    // Keep the load under 3/4.
+    if ((numLines_ + 1) * 4 > slots_.size() * 3) resize(slots_.size() * 2);
+
+    Slot &s = slots_[find(line)];
+    if (s.line == EMPTY) {
+        s.line = line;
+        s.first = NONE;
+        numLines_++;
+        stats_.peakLines = std::max<uint64_t>(stats_.peakLines, numLines_);
+    }
+    return s;
+}
+
+void DurabilityChecker::erase(size_t idx) {
+    // Shift back the entries that probed past idx, so lookups still find
+    // them without tombstones.
+    size_t i = idx, j = idx;
+    while (true) {
+        j = (j + 1) & mask();
+        if (slots_[j].line == EMPTY) break;
+
+        size_t home = hash(slots_[j].line) & mask();
+        bool between = i <= j ? (i < home && home <= j)
+                              : (i < home || home <= j);
+        if (between) continue;
+
+        slots_[i] = slots_[j];
+        i = j;
+    }
+    slots_[i] = Slot();
+    numLines_--;
+
+    // Give the memory back once most of the dirty lines are persisted.
+    if (slots_.size() > MIN_SLOTS && numLines_ * 8 < slots_.size()) {
+        resize(slots_.size() / 2);
+    }
+}
+
+void DurabilityChecker::resize(size_t capacity) {
+    std::vector<Slot> old(capacity);
+    old.swap(slots_);
+    for (const Slot &s : old) {
+        if (s.line != EMPTY) slots_[find(s.line)] = s;
+    }
+}
+
+#pragma endregion
+
+#pragma region Stores
+
+uint32_t DurabilityChecker::internStack(const std::vector<Frame> &stack) {
+    key_.clear();
+    for (const Frame &f : stack) {
+        key_ += f.function;
+        key_.push_back('\0');
+        key_ += f.file;
+        key_.push_back('\0');
+        key_ += std::to_string(f.line);
+        key_.push_back('\0');
+        key_ += std::to_string(f.pc);
+        key_.push_back('\n');
+    }
+
+    auto it = stackIds_.insert(std::make_pair(key_, stacks_.size()));
+    if (it.second) stacks_.push_back(stack);
+    return it.first->second;
+}
+
+uint32_t DurabilityChecker::allocStore(void) {
+    if (freeStores_ == NONE) {
+        stores_.emplace_back();
+        return stores_.size() - 1;
+    }
+
+    uint32_t idx = freeStores_;
+    freeStores_ = stores_[idx].next;
+    return idx;
+}
+
+void DurabilityChecker::freeStore(uint32_t idx) {
+    stores_[idx].next = freeStores_;
+    freeStores_ = idx;
+}
+
+#pragma endregion
+
+#pragma region Operations
+
+void DurabilityChecker::store(const Record &r) {
+    uint64_t start = r.address[0];
+    uint64_t end = start + r.length[0];
+    if (start == end) return;
+    uint32_t stack = internStack(r.stack);
+
+    for (uint64_t line = start & ~(CACHE_LINE - 1); line < end;
+         line += CACHE_LINE) {
+        uint64_t s = std::max(start, line);
+        uint64_t e = std::min(end, line + CACHE_LINE);
+        Slot &slot = insert(line);
+
+        uint32_t idx = slot.first;
+        for (; idx != NONE; idx = stores_[idx].next) {
+            Store &st = stores_[idx];
+            if (st.stack == stack && st.state == DIRTY) break;
+        }
+
+        if (idx != NONE) {
+            Store &st = stores_[idx];
+            st.start = std::min(st.start, s);
+            st.end = std::max(st.end, e);
+            continue;
+        }
+
+        idx = allocStore();
+        Store &st = stores_[idx];
+        st.start = s;
+        st.end = e;
+        st.timestamp = r.timestamp;
+        st.stack = stack;
+        st.thread = r.thread;
+        st.state = DIRTY;
+        st.next = slot.first;
+        slot.first = idx;
+    }
+}
+
+void DurabilityChecker::flush(const Record &r) {
+    uint64_t start = r.address[0];
+    uint64_t end = start + std::max<uint64_t>(r.length[0], 1);
+    bool flushedAny = false;
+
+    for (uint64_t line = start & ~(CACHE_LINE - 1); line < end;
+         line += CACHE_LINE) {
+        const Slot &slot = slots_[find(line)];
+        if (slot.line == EMPTY) continue;
+
+        // A store this thread already flushed means the line is already
+        // pending, so a line is only listed once however often it's flushed.
+        bool flushed = false, pending = false;
+        for (uint32_t idx = slot.first; idx != NONE; idx = stores_[idx].next) {
+            Store &st = stores_[idx];
+            if (st.state != DIRTY) {
+                pending |= st.thread == r.thread;
+                continue;
+            }
+            st.state = FLUSHED;
+            st.thread = r.thread;
+            flushed = true;
+        }
+
+        if (flushed && !pending) pendingFlushes_[r.thread].push_back(line);
+        flushedAny |= flushed;
+    }
+
+    if (flushedAny) return;
+
+    // Nothing dirty, so the flush was not needed.
+    stats_.redundantFlushes++;
+    bug_.clear();
+    bug_.kind = EventKind::REQUIRED_FLUSH;
+    bug_.timestamp = r.timestamp;
+    bug_.isBug = true;
+    bug_.numRanges = 1;
+    bug_.address[0] = r.address[0];
+    bug_.length[0] = r.length[0];
+    bug_.thread = r.thread;
+    bug_.stack = r.stack;
+    out_.onRecord(bug_);
+}
+
+void DurabilityChecker::fence(const Record &r) {
+    // A fence only persists the flushes of its own thread.
+    auto it = pendingFlushes_.find(r.thread);
+    if (it == pendingFlushes_.end()) return;
+
+    for (uint64_t line : it->second) {
+        size_t idx = find(line);
+        Slot &slot = slots_[idx];
+        if (slot.line == EMPTY) continue;
+
+        uint32_t *link = &slot.first;
+        while (*link != NONE) {
+            uint32_t cur = *link;
+            Store &st = stores_[cur];
+            if (st.state == FLUSHED && st.thread == r.thread) {
+                *link = st.next;
+                freeStore(cur);
+            } else {
+                link = &st.next;
+            }
+        }
+
+        if (slot.first == NONE) erase(idx);
+    }
+
+    it->second.clear();
+}
+
+#pragma endregion
+
+void DurabilityChecker::onMetadata(const YAML::Node &metadata) {
+    out_.onMetadata(metadata);
+}
+
+void DurabilityChecker::onRecord(const Record &r) {
+    switch (r.kind) {
+        case EventKind::ASSERT_PERSISTED:
+        case EventKind::ASSERT_ORDERED:
+        case EventKind::REQUIRED_FLUSH:
+            // Re-derived.
+            return;
+        default:
+            break;
+    }
+
+    out_.onRecord(r);
+    stats_.operations++;
+    lastTimestamp_ = std::max(lastTimestamp_, r.timestamp);
+
+    switch (r.kind) {
+        case EventKind::STORE:
+            store(r);
+            break;
+        case EventKind::FLUSH:
+            flush(r);
+            break;
+        case EventKind::FENCE:
+            fence(r);
+            break;
+        default:
+            break;
+    }
+}
+
+void DurabilityChecker::finish(void) {
+    std::vector<uint32_t> left;
+    for (const Slot &slot : slots_) {
+        if (slot.line == EMPTY) continue;
+        for (uint32_t idx = slot.first; idx != NONE; idx = stores_[idx].next) {
+            left.push_back(idx);
+        }
+    }
+
+    // Like pmemcheck, which reports them in the order they were stored.
+    std::sort(left.begin(), left.end(), [this] (uint32_t a, uint32_t b) {
+        const Store &x = stores_[a], &y = stores_[b];
+        return x.timestamp != y.timestamp ? x.timestamp < y.timestamp
+                                          : x.start < y.start;
+    });
+
+    uint64_t timestamp = lastTimestamp_;
+    for (uint32_t idx : left) {
+        const Store &st = stores_[idx];
+        bug_.clear();
+        bug_.kind = EventKind::ASSERT_PERSISTED;
+        bug_.timestamp = ++timestamp;
+        bug_.isBug = true;
+        bug_.numRanges = 1;
+        bug_.address[0] = st.start;
+        bug_.length[0] = st.end - st.start;
+        bug_.thread = st.thread;
+        bug_.stack = stacks_[st.stack];
+        bug_.state = st.state == DIRTY ? "DIRTY" : "FLUSHED";
+        out_.onRecord(bug_);
+    }
+    stats_.notPersisted += left.size();
+}
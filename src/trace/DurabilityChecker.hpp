@@ -0,0 +1,157 @@
+#pragma once
+/**
+ * Derives the bug events (ASSERT_PERSISTED and REQUIRED_FLUSH) from a raw
+ * STORE/FLUSH/FENCE stream, the way pmemcheck's end-of-run report does, so
+ * traces from the PM tracer (or any other source of operations) can be fixed
+ * without pmemcheck.
+ *
+ * Only stores that are not yet persistent are tracked: a shadow entry per
+ * cache line with unpersisted stores, in an open-addressing table, and the
+ * stores themselves. A line leaves the table when its last store is fenced,
+ * so memory use follows the number of live dirty lines, not the trace size.
+ */
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "TraceFormat.hpp"
+#include "TraceYaml.hpp"
+
+namespace pmfix {
+namespace trace {
+
+/**
+ * A sink that passes every operation on to another sink, adding bug events
+ * as it finds them:
+ *
+ *  - A REQUIRED_FLUSH right after each flush that covers no dirty store.
+ *  - On finish(), an ASSERT_PERSISTED for each store that was not flushed
+ *    and then fenced (by the thread that flushed it), with the call stack of
+ *    the store.
+ *
+ * Bug events already in the input are dropped, since they are re-derived.
+ */
+class DurabilityChecker : public RecordSink {
+public:
+    static const uint64_t CACHE_LINE = 64;
+
+    struct Stats {
+        uint64_t operations = 0;
+        uint64_t notPersisted = 0;
+        uint64_t redundantFlushes = 0;
+        // Most lines with unpersisted stores at any one time.
+        uint64_t peakLines = 0;
+
+        void print(llvm::raw_ostream &os) const;
+    };
+
+private:
+    static const uint32_t NONE = UINT32_MAX;
+    static const uint64_t EMPTY = UINT64_MAX;
+
+    enum State : uint8_t { DIRTY, FLUSHED };
+
+    /**
+     * An unpersisted store, or the part of it on one cache line. Stores to
+     * the same line from the same stack (and still in the same state) are
+     * merged.
+     */
+    struct Store {
+        uint64_t start;
+        uint64_t end;
+        // Of the first merged store, to report in trace order.
+        uint64_t timestamp;
+        uint32_t stack;
+        // The flushing thread, once FLUSHED.
+        uint32_t thread;
+        // Next store on the same line, or in the free list.
+        uint32_t next;
+        State state;
+    };
+
+    /**
+     * A slot of the line table. Linear probing, with backward-shift
+     * deletion so there are no tombstones.
+     */
+    struct Slot {
+        uint64_t line = EMPTY;
+        uint32_t first = NONE;
+    };
+
+    RecordSink &out_;
+    Stats stats_;
+
+    std::vector<Slot> slots_;
+    size_t numLines_ = 0;
+
+    std::vector<Store> stores_;
+    uint32_t freeStores_ = NONE;
+
+    // Interned call stacks of the stores.
+    std::vector<std::vector<Frame>> stacks_;
+    llvm::StringMap<uint32_t> stackIds_;
+    std::string key_;
+
+    // Thread -> lines it flushed since its last fence, each listed once.
+    llvm::DenseMap<uint32_t, std::vector<uint64_t>> pendingFlushes_;
+
+    uint64_t lastTimestamp_ = 0;
+    Record bug_;
+
+    static uint64_t hash(uint64_t line) {
+        // Lines are 64-byte aligned, so mix in the high bits.
+        line >>= 6;
+        return (line ^ (line >> 29)) * 0x9E3779B97F4A7C15ull;
+    }
+
+    size_t mask() const { return slots_.size() - 1; }
+
+    // Index of the line's slot, or of the empty slot where it would go.
+    size_t find(uint64_t line) const;
+
+    Slot &insert(uint64_t line);
+
+    void erase(size_t idx);
+
+    void resize(size_t capacity);
+
+    uint32_t internStack(const std::vector<Frame> &stack);
+
+    uint32_t allocStore(void);
+
+    void freeStore(uint32_t idx);
+
+    void store(const Record &r);
+
+    void flush(const Record &r);
+
+    void fence(const Record &r);
+
+public:
+    DurabilityChecker(RecordSink &out);
+
+    void onMetadata(const YAML::Node &metadata) override;
+
+    void onRecord(const Record &r) override;
+
+    /**
+     * Report the stores that never became persistent. Call once, after the
+     * last record.
+     */
+    void finish(void);
+
+    const Stats &stats() const { return stats_; }
+
+    /**
+     * Lines that currently have unpersisted stores.
+     */
+    size_t numDirtyLines() const { return numLines_; }
+};
+
+}
+}
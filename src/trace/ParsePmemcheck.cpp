@@ -0,0 +1,74 @@
+/**
+ * parse-pmemcheck: the native version of "parse-trace pmemcheck". Reads a
+ * pmemcheck log as a stream and writes the reduced trace, without ever
+ * holding the log or the trace in memory.
+ *
+ * The log is read twice (see TraceReducer), so it must be a regular file.
+ * The output is a binary trace, unless its name ends in .yaml or .yml or
+ * -format says otherwise.
+ *
+ *  parse-pmemcheck pmemcheck.log -o trace.bin
+ *  parse-pmemcheck pmemcheck.log -o trace.yaml
+ */
+
+#include <string>
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "PmemcheckLog.hpp"
+#include "TraceIO.hpp"
+#include "TraceReducer.hpp"
+
+using namespace llvm;
+using namespace pmfix::trace;
+
+static cl::opt<std::string> InputFile(cl::Positional,
+    cl::desc("<pmemcheck log>"), cl::Required);
+
+static cl::opt<std::string> OutputFile("o",
+    cl::desc("Output trace file"), cl::value_desc("filename"), cl::Required);
+
+enum OutputFormat { BY_NAME, YAML_FORMAT, BINARY_FORMAT };
+
+static cl::opt<OutputFormat> Format("format",
+    cl::desc("Output format (default: YAML for *.yaml/*.yml, else binary)"),
+    cl::values(clEnumValN(YAML_FORMAT, "yaml", "YAML, as from parse-trace"),
+               clEnumValN(BINARY_FORMAT, "binary", "The binary format")),
+    cl::init(BY_NAME));
+
+static cl::opt<bool> NoReduce("no-reduce",
+    cl::desc("Write every event, without the Reports.py reduction"),
+    cl::init(false));
+
+int main(int argc, char **argv) {
+    cl::ParseCommandLineOptions(argc, argv,
+        "Convert a pmemcheck log into a PM trace\n");
+
+    bool binary = Format == BINARY_FORMAT;
+    if (Format == BY_NAME) {
+        StringRef out(OutputFile);
+        binary = !out.endswith(".yaml") && !out.endswith(".yml");
+    }
+
+    auto out = TraceOutput::create(OutputFile, binary);
+    if (!out) return 1;
+
+    if (NoReduce) {
+        if (!readPmemcheckLog(InputFile, *out)) return 1;
+    } else {
+        TraceReducer reducer;
+        bool success = reducer.reduce([] (RecordSink &s) {
+                return readPmemcheckLog(InputFile, s);
+            }, *out);
+        if (!success) return 1;
+        reducer.stats().print(outs());
+    }
+
+    if (!out->close()) return 1;
+    outs() << "Report written to " << OutputFile << " (" <<
+        out->numEvents() << " events)\n";
+
+    return 0;
+}
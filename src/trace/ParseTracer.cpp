@@ -0,0 +1,98 @@
+/**
+ * parse-tracer: converts the log of a program built with the -pm-tracer pass
+ * into a PM trace. The bugs are derived from the operations by the
+ * DurabilityChecker, and then the trace is reduced like parse-pmemcheck's.
+ * The events keep their raw PCs, which the fixer symbolizes from the modules
+ * listed in the metadata, so run the fixer on the same machine (or with the
+ * same binaries) as the traced program.
+ *
+ * The output is a binary trace, unless its name ends in .yaml or .yml or
+ * -format says otherwise.
+ *
+ *  PMTRACER_PM_DIR=/dev/shm PMTRACER_LOG=run.log ./traced-program
+ *  parse-tracer run.log -o trace.bin
+ */
+
+#include <string>
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "DurabilityChecker.hpp"
+#include "TraceIO.hpp"
+#include "TraceReducer.hpp"
+#include "TracerLog.hpp"
+
+using namespace llvm;
+using namespace pmfix::trace;
+
+static cl::opt<std::string> InputFile(cl::Positional,
+    cl::desc("<tracer log>"), cl::Required);
+
+static cl::opt<std::string> OutputFile("o",
+    cl::desc("Output trace file"), cl::value_desc("filename"), cl::Required);
+
+enum OutputFormat { BY_NAME, YAML_FORMAT, BINARY_FORMAT };
+
+static cl::opt<OutputFormat> Format("format",
+    cl::desc("Output format (default: YAML for *.yaml/*.yml, else binary)"),
+    cl::values(clEnumValN(YAML_FORMAT, "yaml", "YAML, as from parse-trace"),
+               clEnumValN(BINARY_FORMAT, "binary", "The binary format")),
+    cl::init(BY_NAME));
+
+static cl::opt<bool> NoCheck("no-check",
+    cl::desc("Just convert the operations, without looking for bugs"),
+    cl::init(false));
+
+static cl::opt<bool> NoReduce("no-reduce",
+    cl::desc("Write every event, without the Reports.py reduction"),
+    cl::init(false));
+
+/**
+ * The log, with the bugs the checker finds.
+ */
+static bool readChecked(RecordSink &sink, DurabilityChecker::Stats *stats) {
+    if (NoCheck) return readTracerLog(InputFile, sink);
+
+    DurabilityChecker checker(sink);
+    if (!readTracerLog(InputFile, checker)) return false;
+    checker.finish();
+    if (stats) *stats = checker.stats();
+    return true;
+}
+
+int main(int argc, char **argv) {
+    cl::ParseCommandLineOptions(argc, argv,
+        "Convert a PM tracer log into a PM trace\n");
+
+    bool binary = Format == BINARY_FORMAT;
+    if (Format == BY_NAME) {
+        StringRef out(OutputFile);
+        binary = !out.endswith(".yaml") && !out.endswith(".yml");
+    }
+
+    auto out = TraceOutput::create(OutputFile, binary);
+    if (!out) return 1;
+
+    DurabilityChecker::Stats stats;
+    if (NoReduce || NoCheck) {
+        // Without bugs, the reduction would drop everything.
+        if (!readChecked(*out, &stats)) return 1;
+    } else {
+        TraceReducer reducer;
+        // The reducer reads the trace twice; the stats are the same both times.
+        bool success = reducer.reduce([&stats] (RecordSink &s) {
+                return readChecked(s, &stats);
+            }, *out);
+        if (!success) return 1;
+        reducer.stats().print(outs());
+    }
+    if (!NoCheck) stats.print(outs());
+
+    if (!out->close()) return 1;
+    outs() << "Trace written to " << OutputFile << " (" <<
+        out->numEvents() << " events)\n";
+
+    return 0;
+}
@@ -0,0 +1,405 @@
+#include "PmemcheckLog.hpp"
+
+#include <cctype>
+#include <cstdint>
+#include <fstream>
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+using namespace pmfix::trace;
+
+namespace {
+
+#pragma region Matching
+
+/**
+ * These follow the regular expressions in parse-trace, which are all matched
+ * from the start of the string (re.match) but not anchored at the end.
+ */
+
+bool isWordChar(char c) {
+    return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+}
+
+bool isDigit(char c) {
+    return std::isdigit(static_cast<unsigned char>(c));
+}
+
+bool isSpace(char c) {
+    return std::isspace(static_cast<unsigned char>(c));
+}
+
+/**
+ * Consume a regex-style run of characters, returning how many there were.
+ */
+template<typename Pred>
+size_t consumeWhile(StringRef &s, Pred pred) {
+    size_t n = 0;
+    while (n < s.size() && pred(s[n])) ++n;
+    s = s.drop_front(n);
+    return n;
+}
+
+bool consumeUnsigned(StringRef &s, uint64_t &v) {
+    StringRef rest = s;
+    if (!consumeWhile(rest, isDigit)) return false;
+    if (s.take_front(s.size() - rest.size()).getAsInteger(10, v)) return false;
+    s = rest;
+    return true;
+}
+
+/**
+ * Python's int(s, base=16), which allows a "0x" prefix.
+ */
+bool parseHex(StringRef s, uint64_t &v) {
+    s = s.trim();
+    if (s.startswith("0x") || s.startswith("0X")) s = s.drop_front(2);
+    return !s.empty() && !s.getAsInteger(16, v);
+}
+
+/**
+ * "==\d+==\s+", the valgrind prefix on every summary line.
+ */
+bool consumePid(StringRef &s) {
+    if (!s.consume_front("==")) return false;
+    if (!consumeWhile(s, isDigit)) return false;
+    if (!s.consume_front("==")) return false;
+    return consumeWhile(s, isSpace) > 0;
+}
+
+/**
+ * "==\d+==\s+<text>(\d+)"
+ */
+bool matchCount(StringRef line, StringRef text, uint64_t &n) {
+    return consumePid(line) && line.consume_front(text) &&
+           consumeUnsigned(line, n);
+}
+
+/**
+ * TRACE_EVENT_RE ("\w+: (.+) \((.+):(\d+)\)") and then TRACE_IMPRECISE_RE
+ * ("\w+: (.+) \(in (.+)\)"). The groups are greedy, so the last " (" that
+ * works ends the function name.
+ */
+bool parseFrame(StringRef s, Frame &f) {
+    StringRef rest = s;
+    if (!consumeWhile(rest, isWordChar) || !rest.consume_front(": ")) {
+        return false;
+    }
+    size_t start = s.size() - rest.size();
+
+    for (size_t p = s.size(); p-- > start + 1; ) {
+        if (!s.substr(p).startswith(" (")) continue;
+
+        // The last ':' that is followed by digits and a ')'.
+        for (size_t q = s.size(); q-- > p + 3; ) {
+            if (s[q] != ':') continue;
+            StringRef digits = s.substr(q + 1);
+            StringRef after = digits;
+            if (!consumeWhile(after, isDigit) || !after.startswith(")")) {
+                continue;
+            }
+
+            f.function = s.slice(start, p).str();
+            f.file = s.slice(p + 2, q).str();
+            digits.take_front(digits.size() - after.size())
+                .getAsInteger(10, f.line);
+            return true;
+        }
+    }
+
+    // Happens in the linker
+    for (size_t p = s.size(); p-- > start + 1; ) {
+        if (!s.substr(p).startswith(" (in ")) continue;
+
+        size_t close = s.rfind(')');
+        if (close == StringRef::npos || close < p + 6) continue;
+
+        f.function = s.slice(start, p).str();
+        f.file = s.slice(p + 5, close).str();
+        f.line = -1;
+        return true;
+    }
+
+    return false;
+}
+
+/**
+ * line.split(sep)[-1].strip()
+ */
+StringRef afterLast(StringRef line, StringRef sep) {
+    size_t pos = line.rfind(sep);
+    if (pos != StringRef::npos) line = line.substr(pos + sep.size());
+    return line.trim();
+}
+
+#pragma endregion
+
+class LogParser {
+private:
+    enum State {
+        // Before the first trace event.
+        BEFORE,
+        // Between START and STOP.
+        TRACE,
+        // Looking for the "Number of ..." summary lines.
+        SUMMARY,
+        // Reading the reports that follow a summary line.
+        REPORTS
+    };
+
+    std::string path_;
+    RecordSink &sink_;
+    std::ifstream in_;
+    std::string line_;
+    uint64_t lineNo_ = 0;
+
+    State state_ = BEFORE;
+    uint64_t timestamp_ = 0;
+    uint64_t remaining_ = 0;
+    int64_t lastReport_ = -1;
+    bool isPerf_ = false;
+
+    Record record_;
+    Frame frame_;
+
+    bool next(void) {
+        if (!std::getline(in_, line_)) return false;
+        lineNo_++;
+        return true;
+    }
+
+    bool fail(const Twine &msg) {
+        errs() << path_ << ":" << lineNo_ << ": " << msg << "\n";
+        return false;
+    }
+
+    void emit(void) {
+        record_.timestamp = timestamp_++;
+        sink_.onRecord(record_);
+    }
+
+    /**
+     * Frames up to the first one that doesn't parse, like parse-trace.
+     */
+    template<typename Iter>
+    void parseStack(Iter begin, Iter end) {
+        for (Iter it = begin; it != end; ++it) {
+            if (!parseFrame(*it, frame_)) break;
+            record_.stack.push_back(frame_);
+        }
+    }
+
+    /**
+     * A line of "|"-separated trace events.
+     */
+    bool parseEvents(void) {
+        SmallVector<StringRef, 8> events;
+        StringRef(line_).split(events, '|');
+
+        SmallVector<StringRef, 16> parts;
+        for (StringRef event : events) {
+            event = event.trim();
+            if (event.find("START") != StringRef::npos) continue;
+            if (event.find("STOP") != StringRef::npos) break;
+
+            bool isFence = event.find("FENCE") != StringRef::npos;
+            bool isStore = event.find("STORE") != StringRef::npos;
+            bool isFlush = event.find("FLUSH") != StringRef::npos;
+            // REGISTER_FILE and friends.
+            if (!isFence && !isStore && !isFlush) continue;
+
+            parts.clear();
+            event.split(parts, ';');
+            record_.clear();
+
+            if (isFence) {
+                if (parts[0] != "FENCE") return fail("bad event: " + event);
+                record_.kind = EventKind::FENCE;
+                parseStack(parts.begin() + 1, parts.end());
+            } else {
+                // STORE;addr;value;size;frames... or FLUSH;addr;size;frames...
+                isStore = parts[0] == "STORE";
+                if (!isStore && parts[0] != "FLUSH") {
+                    return fail("bad event: " + event);
+                }
+
+                size_t nfields = isStore ? 4 : 3;
+                record_.kind = isStore ? EventKind::STORE : EventKind::FLUSH;
+                record_.numRanges = 1;
+                if (parts.size() < nfields ||
+                    !parseHex(parts[1], record_.address[0]) ||
+                    !parseHex(parts[nfields - 1], record_.length[0])) {
+                    return fail("bad event: " + event);
+                }
+                parseStack(parts.begin() + nfields, parts.end());
+            }
+
+            if (record_.stack.empty()) return fail("empty stack: " + event);
+            emit();
+        }
+
+        return true;
+    }
+
+    /**
+     * One report, e.g.:
+     *
+     *  ==42== [3]    at 0x4C2F: fn (file.c:12)
+     *  ==42==    by 0x4C30: caller (file.c:40)
+     *  ==42==    Address: 0x7f0000000040	size: 8	state: DIRTY
+     *
+     * There is no state for the performance (unnecessary flush) reports.
+     */
+    bool parseReport(void) {
+        record_.clear();
+        record_.kind = isPerf_ ? EventKind::REQUIRED_FLUSH
+                               : EventKind::ASSERT_PERSISTED;
+        record_.isBug = true;
+        record_.numRanges = 1;
+
+        StringRef header = line_;
+        uint64_t reportNo;
+        if (!consumePid(header) || !header.consume_front("[") ||
+            !consumeUnsigned(header, reportNo) || !header.startswith("]")) {
+            return fail("bad report: " + line_);
+        }
+        if ((int64_t)reportNo != lastReport_ + 1) {
+            return fail("expected report " + Twine(lastReport_ + 1) +
+                        ", found " + Twine(reportNo));
+        }
+        lastReport_ = reportNo;
+
+        bool stackDone = false;
+        if (!parseFrame(afterLast(line_, " at "), frame_)) {
+            return fail("bad stack frame: " + line_);
+        }
+        record_.stack.push_back(frame_);
+
+        while (true) {
+            if (!next()) return fail("unexpected end of report");
+            if (StringRef(line_).find("by") == StringRef::npos) break;
+            if (stackDone || !parseFrame(afterLast(line_, " by "), frame_)) {
+                stackDone = true;
+                continue;
+            }
+            record_.stack.push_back(frame_);
+        }
+
+        StringRef addr = line_;
+        if (!consumePid(addr) || !addr.consume_front("Address: ")) {
+            return fail("bad report: " + line_);
+        }
+        StringRef hex = addr;
+        consumeWhile(addr, isWordChar);
+        hex = hex.take_front(hex.size() - addr.size());
+        if (!parseHex(hex, record_.address[0]) ||
+            !consumeWhile(addr, isSpace) || !addr.consume_front("size: ") ||
+            !consumeUnsigned(addr, record_.length[0])) {
+            return fail("bad report: " + line_);
+        }
+
+        if (!isPerf_) {
+            if (!consumeWhile(addr, isSpace) ||
+                !addr.consume_front("state: ")) {
+                return fail("bad report: " + line_);
+            }
+            StringRef state = addr;
+            if (!consumeWhile(addr, isWordChar)) {
+                return fail("bad report: " + line_);
+            }
+            record_.state = state.take_front(state.size() - addr.size()).str();
+        }
+
+        emit();
+        return true;
+    }
+
+public:
+    LogParser(const std::string &path, RecordSink &sink)
+        : path_(path), sink_(sink), in_(path) {}
+
+    bool parse(void) {
+        if (!in_) {
+            errs() << "Could not open " << path_ << "\n";
+            return false;
+        }
+
+        YAML::Node metadata;
+        metadata["source"] = "GENERIC";
+        sink_.onMetadata(metadata);
+
+        while (next()) {
+            StringRef line(line_);
+            uint64_t n;
+
+            switch (state_) {
+                case BEFORE:
+                    if (line.find("START|") == StringRef::npos &&
+                        line.find("|STORE") == StringRef::npos &&
+                        line.find("|FLUSH") == StringRef::npos &&
+                        line.find("|FENCE") == StringRef::npos) {
+                        break;
+                    }
+                    state_ = TRACE;
+                    if (!parseEvents()) return false;
+                    break;
+
+                case TRACE:
+                    if (line.find("|STOP") != StringRef::npos) {
+                        state_ = SUMMARY;
+                    } else if (!parseEvents()) {
+                        return false;
+                    }
+                    break;
+
+                case SUMMARY:
+                    if (matchCount(line,
+                            "Number of stores not made persistent: ", n)) {
+                        // The reports have a header line. Without reports,
+                        // the next line may already be another summary.
+                        if (n) {
+                            if (!next() || StringRef(line_).find(
+                                    "Stores not made persistent properly") ==
+                                    StringRef::npos) {
+                                return fail("unexpected: " + line_);
+                            }
+                            remaining_ = n;
+                            isPerf_ = false;
+                            state_ = REPORTS;
+                        }
+                    } else if (matchCount(line,
+                            "Number of unnecessary flushes: ", n)) {
+                        remaining_ = n;
+                        isPerf_ = true;
+                        state_ = REPORTS;
+                    }
+                    break;
+
+                case REPORTS:
+                    // End of interesting stuff.
+                    if (!remaining_) return true;
+                    if (!parseReport()) return false;
+
+                    // There may be more summaries after the persistence
+                    // reports, but the performance reports come last.
+                    if (--remaining_ == 0 && !isPerf_) {
+                        state_ = SUMMARY;
+                        lastReport_ = -1;
+                    }
+                    break;
+            }
+        }
+
+        return true;
+    }
+};
+
+}
+
+bool pmfix::trace::readPmemcheckLog(const std::string &path, RecordSink &sink) {
+    LogParser parser(path, sink);
+    return parser.parse();
+}
@@ -0,0 +1,31 @@
+#pragma once
+/**
+ * A reader for pmemcheck logs (valgrind --tool=pmemcheck --print-summary=yes
+ * --log-stores=yes ...), the native version of parse-trace's pmemcheck mode.
+ */
+
+#include <string>
+
+#include "TraceFormat.hpp"
+#include "TraceYaml.hpp"
+
+namespace pmfix {
+namespace trace {
+
+/**
+ * Streams the events of a pmemcheck log into the sink, one line at a time, so
+ * memory use doesn't depend on the length of the log. The records are the
+ * same ones parse-trace creates (before Reports.py reduces them):
+ *
+ *  - The "|STORE;...|FLUSH;...|FENCE;..." trace between START and STOP.
+ *  - An ASSERT_PERSISTED for each "Stores not made persistent properly"
+ *    report, and a REQUIRED_FLUSH for each "unnecessary flushes" report.
+ *
+ * The metadata is always {source: GENERIC}.
+ *
+ * Returns false (and complains) if the log is malformed.
+ */
+bool readPmemcheckLog(const std::string &path, RecordSink &sink);
+
+}
+}
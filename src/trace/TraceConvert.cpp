@@ -0,0 +1,49 @@
+/**
+ * trace-convert: convert between the YAML trace format (parse-trace output)
+ * and the binary trace format. The input format is detected automatically.
+ *
+ *  trace-convert trace.yaml -o trace.bin
+ *  trace-convert trace.bin -o trace.yaml -to-yaml
+ */
+
+#include <string>
+
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "TraceFormat.hpp"
+#include "TraceIO.hpp"
+
+using namespace llvm;
+using namespace pmfix::trace;
+
+static cl::opt<std::string> InputFile(cl::Positional,
+    cl::desc("<input trace>"), cl::Required);
+
+static cl::opt<std::string> OutputFile("o",
+    cl::desc("Output trace file"), cl::value_desc("filename"), cl::Required);
+
+static cl::opt<bool> ToYaml("to-yaml",
+    cl::desc("Write YAML instead of the binary format"), cl::init(false));
+
+static int convert(bool toBinary) {
+    auto out = TraceOutput::create(OutputFile, toBinary);
+    if (!out) return 1;
+
+    if (!readTrace(InputFile, *out)) return 1;
+
+    return out->close() ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
+    cl::ParseCommandLineOptions(argc, argv,
+        "Convert between YAML and binary PM traces\n");
+
+    bool isBinary = BinaryTrace::isBinaryTrace(InputFile);
+    if (isBinary != ToYaml) {
+        errs() << InputFile << " is already in the requested format!\n";
+        return 1;
+    }
+
+    return convert(!isBinary);
+}
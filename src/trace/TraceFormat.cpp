@@ -0,0 +1,415 @@
+#include "TraceFormat.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+using namespace pmfix::trace;
+
+#pragma region EventKind
+
+EventKind pmfix::trace::kindFromString(std::string name) {
+    std::transform(name.begin(), name.end(), name.begin(),
+              [](unsigned char c) -> unsigned char { return std::tolower(c); });
+    if (name == "store") return EventKind::STORE;
+    if (name == "flush") return EventKind::FLUSH;
+    if (name == "fence") return EventKind::FENCE;
+    if (name == "assert_persisted") return EventKind::ASSERT_PERSISTED;
+    if (name == "assert_ordered") return EventKind::ASSERT_ORDERED;
+    if (name == "required_flush") return EventKind::REQUIRED_FLUSH;
+
+    return EventKind::INVALID;
+}
+
+const char *pmfix::trace::kindName(EventKind kind) {
+    switch (kind) {
+        case EventKind::STORE: return "STORE";
+        case EventKind::FLUSH: return "FLUSH";
+        case EventKind::FENCE: return "FENCE";
+        case EventKind::ASSERT_PERSISTED: return "ASSERT_PERSISTED";
+        case EventKind::ASSERT_ORDERED: return "ASSERT_ORDERED";
+        case EventKind::REQUIRED_FLUSH: return "REQUIRED_FLUSH";
+        default: return "INVALID";
+    }
+}
+
+void Record::clear() {
+    kind = EventKind::INVALID;
+    timestamp = 0;
+    isBug = false;
+    numRanges = 0;
+    address[0] = address[1] = 0;
+    length[0] = length[1] = 0;
+    thread = 0;
+    stack.clear();
+    state.clear();
+}
+
+#pragma endregion
+
+#pragma region BinaryTraceWriter
+
+BinaryTraceWriter::BinaryTraceWriter(std::unique_ptr<raw_fd_ostream> out)
+    : out_(std::move(out)) {
+    memset(&header_, 0, sizeof(header_));
+    memcpy(header_.magic, MAGIC, sizeof(MAGIC));
+    header_.version = VERSION;
+    header_.eventSize = sizeof(EventRecord);
+    header_.eventsOffset = sizeof(FileHeader);
+
+    // Placeholder, patched in close().
+    out_->write(reinterpret_cast<const char*>(&header_), sizeof(header_));
+}
+
+BinaryTraceWriter::~BinaryTraceWriter() {
+    if (!closed_) close();
+}
+
+std::unique_ptr<BinaryTraceWriter> BinaryTraceWriter::create(StringRef path) {
+    std::error_code ec;
+    std::unique_ptr<raw_fd_ostream> out(
+        new raw_fd_ostream(path, ec, sys::fs::F_None));
+    if (ec) {
+        errs() << "Could not open " << path << ": " << ec.message() << "\n";
+        return nullptr;
+    }
+
+    return std::unique_ptr<BinaryTraceWriter>(
+        new BinaryTraceWriter(std::move(out)));
+}
+
+uint32_t BinaryTraceWriter::internString(StringRef s) {
+    auto it = stringIds_.find(s);
+    if (it != stringIds_.end()) return it->second;
+
+    uint32_t off = strings_.size();
+    uint32_t len = s.size();
+    strings_.append(reinterpret_cast<const char*>(&len), sizeof(len));
+    strings_.append(s.data(), s.size());
+    strings_.push_back('\0');
+    assert(strings_.size() < UINT32_MAX && "string table overflow!");
+
+    stringIds_[s] = off;
+    return off;
+}
+
+uint32_t BinaryTraceWriter::internFrame(const Frame &f) {
+    FrameRecord fr;
+    fr.function = internString(f.function);
+    fr.file = internString(f.file);
+    fr.line = f.line;
+    fr.pc = f.pc;
+
+    auto key = std::make_tuple(fr.function, fr.file, fr.line, fr.pc);
+    auto it = frameIds_.find(key);
+    if (it != frameIds_.end()) return it->second;
+
+    uint32_t id = frames_.size();
+    frames_.push_back(fr);
+    frameIds_[key] = id;
+    return id;
+}
+
+void BinaryTraceWriter::addEvent(const Record &r) {
+    assert(!closed_ && "writer already closed!");
+    assert(r.kind != EventKind::INVALID && "bad record!");
+    assert(r.numRanges <= 2);
+
+    scratch_.clear();
+    for (const Frame &f : r.stack) {
+        scratch_.push_back(internFrame(f));
+    }
+
+    uint32_t stackId;
+    auto it = stackIds_.find(scratch_);
+    if (it != stackIds_.end()) {
+        stackId = it->second;
+    } else {
+        stackId = stacks_.size();
+        StackRecord sr;
+        sr.first = stackFrames_.size();
+        sr.depth = scratch_.size();
+        stacks_.push_back(sr);
+        stackFrames_.insert(stackFrames_.end(), scratch_.begin(), scratch_.end());
+        stackIds_[scratch_] = stackId;
+    }
+
+    EventRecord er;
+    memset(&er, 0, sizeof(er));
+    er.timestamp = r.timestamp;
+    er.stack = stackId;
+    er.kind = static_cast<uint8_t>(r.kind);
+    er.flags = r.isBug ? EventRecord::FLAG_BUG : 0;
+    er.numRanges = r.numRanges;
+    er.thread = r.thread;
+    for (uint32_t i = 0; i < r.numRanges; ++i) {
+        er.address[i] = r.address[i];
+        er.length[i] = r.length[i];
+    }
+
+    out_->write(reinterpret_cast<const char*>(&er), sizeof(er));
+    header_.numEvents++;
+}
+
+bool BinaryTraceWriter::close() {
+    if (closed_) return !out_->has_error();
+    closed_ = true;
+
+    uint64_t offset = header_.eventsOffset +
+                      header_.numEvents * sizeof(EventRecord);
+
+    header_.stringsOffset = offset;
+    header_.stringsSize = strings_.size();
+    out_->write(strings_.data(), strings_.size());
+    offset += strings_.size();
+
+    // Keep the tables aligned so the reader can use them in place.
+    uint64_t pad = (8 - (offset % 8)) % 8;
+    out_->write_zeros(pad);
+    offset += pad;
+
+    header_.framesOffset = offset;
+    header_.numFrames = frames_.size();
+    out_->write(reinterpret_cast<const char*>(frames_.data()),
+                frames_.size() * sizeof(FrameRecord));
+    offset += frames_.size() * sizeof(FrameRecord);
+
+    header_.stacksOffset = offset;
+    header_.numStacks = stacks_.size();
+    out_->write(reinterpret_cast<const char*>(stacks_.data()),
+                stacks_.size() * sizeof(StackRecord));
+    offset += stacks_.size() * sizeof(StackRecord);
+
+    header_.stackFramesOffset = offset;
+    header_.numStackFrames = stackFrames_.size();
+    out_->write(reinterpret_cast<const char*>(stackFrames_.data()),
+                stackFrames_.size() * sizeof(uint32_t));
+    offset += stackFrames_.size() * sizeof(uint32_t);
+
+    header_.metadataOffset = offset;
+    header_.metadataSize = metadata_.size();
+    out_->write(metadata_.data(), metadata_.size());
+
+    out_->seek(0);
+    out_->write(reinterpret_cast<const char*>(&header_), sizeof(header_));
+    out_->close();
+
+    if (out_->has_error()) {
+        errs() << "Error writing binary trace: " <<
+            out_->error().message() << "\n";
+        out_->clear_error();
+        return false;
+    }
+
+    return true;
+}
+
+#pragma endregion
+
+#pragma region BinaryTrace
+
+BinaryTrace::BinaryTrace(std::unique_ptr<MemoryBuffer> buffer)
+    : buffer_(std::move(buffer)), header_(nullptr) {
+    header_ = at<FileHeader>(0);
+}
+
+bool BinaryTrace::isBinaryTrace(StringRef path) {
+    char magic[sizeof(MAGIC)];
+    FILE *f = fopen(path.str().c_str(), "rb");
+    if (!f) return false;
+    size_t n = fread(magic, 1, sizeof(magic), f);
+    fclose(f);
+
+    return n == sizeof(magic) && !memcmp(magic, MAGIC, sizeof(MAGIC));
+}
+
+std::unique_ptr<BinaryTrace> BinaryTrace::open(StringRef path) {
+    // MemoryBuffer mmaps anything larger than a page. The trace is read-only.
+    auto bufOrErr = MemoryBuffer::getFile(path, /*FileSize*/ -1,
+                                          /*RequiresNullTerminator*/ false);
+    if (std::error_code ec = bufOrErr.getError()) {
+        errs() << "Could not open " << path << ": " << ec.message() << "\n";
+        return nullptr;
+    }
+
+    if ((*bufOrErr)->getBufferSize() < sizeof(FileHeader)) {
+        errs() << path << ": too small to be a binary trace!\n";
+        return nullptr;
+    }
+
+    std::unique_ptr<BinaryTrace> bt(new BinaryTrace(std::move(*bufOrErr)));
+    if (!bt->validate()) {
+        errs() << path << ": malformed binary trace!\n";
+        return nullptr;
+    }
+
+    if (bt->header_->version == 1) bt->upgrade();
+
+    return bt;
+}
+
+bool BinaryTrace::validate(void) const {
+    const FileHeader &h = *header_;
+    uint64_t sz = buffer_->getBufferSize();
+
+    if (memcmp(h.magic, MAGIC, sizeof(MAGIC))) return false;
+    if (h.version < 1 || h.version > VERSION) {
+        errs() << "Unsupported trace version " << h.version <<
+            " (expected at most " << VERSION << ")\n";
+        return false;
+    }
+    uint64_t eventSize = h.version == 1 ? sizeof(EventRecordV1) 
+                                        : sizeof(EventRecord);
+    if (h.eventSize != eventSize) return false;
+    uint64_t frameSize = h.version < 3 ? sizeof(FrameRecordV2)
+                                       : sizeof(FrameRecord);
+
+    // Counts are checked by dividing, so huge ones can't overflow.
+    auto inBounds = [sz] (uint64_t off, uint64_t count, uint64_t size) {
+        return off <= sz && count <= (sz - off) / size;
+    };
+
+    if (!inBounds(h.eventsOffset, h.numEvents, eventSize) ||
+        !inBounds(h.stringsOffset, h.stringsSize, 1) ||
+        !inBounds(h.framesOffset, h.numFrames, frameSize) ||
+        !inBounds(h.stacksOffset, h.numStacks, sizeof(StackRecord)) ||
+        !inBounds(h.stackFramesOffset, h.numStackFrames, sizeof(uint32_t)) ||
+        !inBounds(h.metadataOffset, h.metadataSize, 1)) {
+        return false;
+    }
+
+    // The side tables are small, so check every reference in them now rather
+    // than on each access. Events only refer to stacks.
+    auto validString = [this, &h] (uint32_t offset) {
+        if (h.stringsSize < sizeof(uint32_t) ||
+            offset > h.stringsSize - sizeof(uint32_t)) {
+            return false;
+        }
+        uint32_t len;
+        memcpy(&len, at<char>(h.stringsOffset + offset), sizeof(len));
+        return len <= h.stringsSize - sizeof(uint32_t) - offset;
+    };
+
+    for (uint64_t i = 0; i < h.numFrames; ++i) {
+        uint32_t function, file;
+        if (h.version < 3) {
+            const FrameRecordV2 &fr = at<FrameRecordV2>(h.framesOffset)[i];
+            function = fr.function;
+            file = fr.file;
+        } else {
+            const FrameRecord &fr = at<FrameRecord>(h.framesOffset)[i];
+            function = fr.function;
+            file = fr.file;
+        }
+        if (!validString(function) || !validString(file)) return false;
+    }
+
+    const uint32_t *stackFrames = at<uint32_t>(h.stackFramesOffset);
+    for (uint64_t i = 0; i < h.numStackFrames; ++i) {
+        if (stackFrames[i] >= h.numFrames) return false;
+    }
+
+    const StackRecord *stacks = at<StackRecord>(h.stacksOffset);
+    for (uint64_t i = 0; i < h.numStacks; ++i) {
+        if (stacks[i].first > h.numStackFrames ||
+            stacks[i].depth > h.numStackFrames - stacks[i].first) {
+            return false;
+        }
+    }
+
+    for (uint64_t i = 0; i < h.numEvents; ++i) {
+        uint32_t stack = h.version == 1 
+            ? at<EventRecordV1>(h.eventsOffset)[i].stack
+            : at<EventRecord>(h.eventsOffset)[i].stack;
+        if (stack >= h.numStacks) return false;
+    }
+
+    return true;
+}
+
+StringRef BinaryTrace::string(uint32_t offset) const {
+    assert(offset + sizeof(uint32_t) <= header_->stringsSize);
+    const char *base = at<char>(header_->stringsOffset + offset);
+    uint32_t len;
+    memcpy(&len, base, sizeof(len));
+    return StringRef(base + sizeof(len), len);
+}
+
+void BinaryTrace::upgrade(void) {
+    const EventRecordV1 *old = at<EventRecordV1>(header_->eventsOffset);
+
+    upgraded_.resize(header_->numEvents);
+    for (size_t i = 0; i < upgraded_.size(); ++i) {
+        EventRecord &er = upgraded_[i];
+        memset(&er, 0, sizeof(er));
+        er.timestamp = old[i].timestamp;
+        memcpy(er.address, old[i].address, sizeof(er.address));
+        memcpy(er.length, old[i].length, sizeof(er.length));
+        er.stack = old[i].stack;
+        er.kind = old[i].kind;
+        er.flags = old[i].flags;
+        er.numRanges = old[i].numRanges;
+    }
+}
+
+const EventRecord &BinaryTrace::event(size_t i) const {
+    assert(i < header_->numEvents && "out of bounds!");
+    if (!upgraded_.empty()) return upgraded_[i];
+    return at<EventRecord>(header_->eventsOffset)[i];
+}
+
+BinaryTrace::FrameRef BinaryTrace::frame(uint32_t id) const {
+    assert(id < header_->numFrames && "out of bounds!");
+    if (header_->version < 3) {
+        const FrameRecordV2 &fr = at<FrameRecordV2>(header_->framesOffset)[id];
+        return FrameRef{string(fr.function), string(fr.file), fr.line, 0};
+    }
+
+    const FrameRecord &fr = at<FrameRecord>(header_->framesOffset)[id];
+    return FrameRef{string(fr.function), string(fr.file), fr.line, fr.pc};
+}
+
+ArrayRef<uint32_t> BinaryTrace::stack(uint32_t id) const {
+    assert(id < header_->numStacks && "out of bounds!");
+    const StackRecord &sr = at<StackRecord>(header_->stacksOffset)[id];
+    assert((uint64_t)sr.first + sr.depth <= header_->numStackFrames);
+    return ArrayRef<uint32_t>(
+        at<uint32_t>(header_->stackFramesOffset) + sr.first, sr.depth);
+}
+
+StringRef BinaryTrace::metadata() const {
+    return StringRef(at<char>(header_->metadataOffset), header_->metadataSize);
+}
+
+void BinaryTrace::decode(size_t i, Record &r) const {
+    const EventRecord &er = event(i);
+
+    r.clear();
+    r.kind = er.getKind();
+    r.timestamp = er.timestamp;
+    r.isBug = er.isBug();
+    r.numRanges = er.numRanges;
+    r.thread = er.thread;
+    for (uint32_t j = 0; j < er.numRanges && j < 2; ++j) {
+        r.address[j] = er.address[j];
+        r.length[j] = er.length[j];
+    }
+
+    for (uint32_t fid : stack(er.stack)) {
+        FrameRef fr = frame(fid);
+        Frame f;
+        f.function = fr.function.str();
+        f.file = fr.file.str();
+        f.line = fr.line;
+        f.pc = fr.pc;
+        r.stack.emplace_back(std::move(f));
+    }
+}
+
+#pragma endregion
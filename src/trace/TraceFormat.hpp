@@ -0,0 +1,316 @@
+#pragma once
+/**
+ * The on-disk binary trace format.
+ *
+ * The YAML traces produced by parse-trace are easy to read, but they are slow
+ * to load and a parsed document takes several times the trace size in memory.
+ * The binary format stores every event as a fixed-size record and moves the
+ * (heavily repeated) source locations and call stacks into side tables, so a
+ * trace can be mmap'd and decoded one event at a time.
+ *
+ * Layout:
+ *
+ *  [FileHeader]
+ *  [EventRecord x numEvents]
+ *  [string blob]                 -- (uint32_t length, bytes, '\0') entries
+ *  [FrameRecord x numFrames]
+ *  [StackRecord x numStacks]
+ *  [uint32_t x numStackFrames]   -- frame ids, referenced by StackRecords
+ *  [metadata]                    -- the "metadata" map, as YAML text
+ *
+ * Everything is stored in native (x86-64) byte order.
+ */
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+namespace pmfix {
+namespace trace {
+
+/**
+ * The kinds of events in a trace. The values match TraceEvent::Type, and they
+ * are part of the file format, so don't reorder them.
+ */
+enum class EventKind : uint8_t {
+    STORE = 0, FLUSH, FENCE,
+    ASSERT_PERSISTED, ASSERT_ORDERED, REQUIRED_FLUSH,
+    INVALID = 0xff
+};
+
+/**
+ * Case-insensitive, returns INVALID for unknown names.
+ */
+EventKind kindFromString(std::string name);
+
+const char *kindName(EventKind kind);
+
+/**
+ * A source-level stack frame, as it appears in the trace.
+ */
+struct Frame {
+    std::string function;
+    std::string file;
+    // -1 represents unknown
+    int64_t line = -1;
+    // The raw code address, for traces that leave symbolization to the fixer
+    // (see TraceSymbolizer). Such frames have no function, file or line. 0
+    // if unknown. Frames after the first hold return addresses.
+    uint64_t pc = 0;
+
+    /**
+     * Is this just an address, waiting to be symbolized?
+     */
+    bool unsymbolized() const { return pc && function.empty(); }
+};
+
+/**
+ * A format-independent trace event. Readers fill these in and writers consume
+ * them, so tools can work on either format.
+ *
+ * The event location ("function", "file" and "line" in the YAML) is always
+ * stack[0], so it is not stored separately.
+ */
+struct Record {
+    EventKind kind = EventKind::INVALID;
+    uint64_t timestamp = 0;
+    bool isBug = false;
+    // ASSERT_ORDERED uses both ranges, the other address events only the first.
+    uint32_t numRanges = 0;
+    uint64_t address[2] = {0, 0};
+    uint64_t length[2] = {0, 0};
+    // The thread that ran the event. Traces that don't say (like pmemcheck's,
+    // or any single-threaded trace) leave it at 0.
+    uint32_t thread = 0;
+    std::vector<Frame> stack;
+    // pmemcheck's bug classification. Only the YAML format keeps it; the
+    // fixer doesn't need it.
+    std::string state;
+
+    /**
+     * Resets everything but keeps the stack storage around, so readers can
+     * reuse one record for a whole trace.
+     */
+    void clear();
+};
+
+#pragma region Layout
+
+static const char MAGIC[8] = {'P', 'M', 'T', 'R', 'A', 'C', 'E', '\0'};
+// Version 2 added EventRecord::thread and version 3 FrameRecord::pc. Older
+// traces can still be read.
+static const uint32_t VERSION = 3;
+
+struct FileHeader {
+    char magic[8];
+    uint32_t version;
+    // sizeof(EventRecord), as a sanity check.
+    uint32_t eventSize;
+    uint64_t numEvents;
+    uint64_t eventsOffset;
+    uint64_t stringsOffset;
+    uint64_t stringsSize;
+    uint64_t framesOffset;
+    uint64_t numFrames;
+    uint64_t stacksOffset;
+    uint64_t numStacks;
+    uint64_t stackFramesOffset;
+    uint64_t numStackFrames;
+    uint64_t metadataOffset;
+    uint64_t metadataSize;
+};
+
+struct EventRecord {
+    static const uint8_t FLAG_BUG = 0x1;
+
+    uint64_t timestamp;
+    uint64_t address[2];
+    uint64_t length[2];
+    // Index into the stack table.
+    uint32_t stack;
+    uint8_t kind;
+    uint8_t flags;
+    uint8_t numRanges;
+    uint8_t reserved;
+    uint32_t thread;
+    uint32_t reserved2;
+
+    EventKind getKind() const { return static_cast<EventKind>(kind); }
+    bool isBug() const { return flags & FLAG_BUG; }
+};
+
+static_assert(sizeof(EventRecord) == 56, "EventRecord is part of the format!");
+
+/**
+ * EventRecord in version 1 traces, which had no thread.
+ */
+struct EventRecordV1 {
+    uint64_t timestamp;
+    uint64_t address[2];
+    uint64_t length[2];
+    uint32_t stack;
+    uint8_t kind;
+    uint8_t flags;
+    uint8_t numRanges;
+    uint8_t reserved;
+};
+
+static_assert(sizeof(EventRecordV1) == 48, "EventRecordV1 is part of the format!");
+
+struct FrameRecord {
+    // Offsets into the string blob.
+    uint32_t function;
+    uint32_t file;
+    int64_t line;
+    uint64_t pc;
+};
+
+static_assert(sizeof(FrameRecord) == 24, "FrameRecord is part of the format!");
+
+/**
+ * FrameRecord in version 1 and 2 traces, which had no PCs.
+ */
+struct FrameRecordV2 {
+    uint32_t function;
+    uint32_t file;
+    int64_t line;
+};
+
+static_assert(sizeof(FrameRecordV2) == 16, "FrameRecordV2 is part of the format!");
+
+struct StackRecord {
+    // Index of the first frame id in the stack frame array.
+    uint32_t first;
+    uint32_t depth;
+};
+
+#pragma endregion
+
+/**
+ * Writes a binary trace. Events are streamed straight to disk; only the
+ * distinct strings, frames and stacks are kept in memory until close(), when
+ * the side tables are written and the header is patched.
+ */
+class BinaryTraceWriter {
+private:
+    std::unique_ptr<llvm::raw_fd_ostream> out_;
+    FileHeader header_;
+
+    std::string strings_;
+    llvm::StringMap<uint32_t> stringIds_;
+
+    std::vector<FrameRecord> frames_;
+    std::map<std::tuple<uint32_t, uint32_t, int64_t, uint64_t>, uint32_t> frameIds_;
+
+    std::vector<StackRecord> stacks_;
+    std::vector<uint32_t> stackFrames_;
+    std::map<std::vector<uint32_t>, uint32_t> stackIds_;
+    // Scratch space for addEvent, to avoid an allocation per event.
+    std::vector<uint32_t> scratch_;
+
+    std::string metadata_;
+    bool closed_ = false;
+
+    BinaryTraceWriter(std::unique_ptr<llvm::raw_fd_ostream> out);
+
+    uint32_t internString(llvm::StringRef s);
+
+    uint32_t internFrame(const Frame &f);
+
+public:
+    /**
+     * Returns nullptr (and complains) if the file can't be opened.
+     */
+    static std::unique_ptr<BinaryTraceWriter> create(llvm::StringRef path);
+
+    ~BinaryTraceWriter();
+
+    /**
+     * The "metadata" map of the trace, as YAML text.
+     */
+    void setMetadata(const std::string &yaml) { metadata_ = yaml; }
+
+    void addEvent(const Record &r);
+
+    uint64_t numEvents() const { return header_.numEvents; }
+
+    /**
+     * Write the side tables and the final header. Returns false on I/O errors.
+     */
+    bool close();
+};
+
+/**
+ * A read-only, memory-mapped binary trace. Nothing is decoded up front; the
+ * accessors read straight out of the mapping. open() checks every table
+ * offset, string and stack reference, so a truncated or corrupt file is
+ * rejected instead of being read out of bounds.
+ */
+class BinaryTrace {
+public:
+    struct FrameRef {
+        llvm::StringRef function;
+        llvm::StringRef file;
+        int64_t line;
+        uint64_t pc;
+    };
+
+private:
+    std::unique_ptr<llvm::MemoryBuffer> buffer_;
+    const FileHeader *header_;
+    // Version 1 events, converted on open. Empty for current traces, which
+    // are used in place.
+    std::vector<EventRecord> upgraded_;
+
+    void upgrade(void);
+
+    BinaryTrace(std::unique_ptr<llvm::MemoryBuffer> buffer);
+
+    template<typename T>
+    const T *at(uint64_t offset) const {
+        return reinterpret_cast<const T*>(buffer_->getBufferStart() + offset);
+    }
+
+    llvm::StringRef string(uint32_t offset) const;
+
+    bool validate(void) const;
+
+public:
+    /**
+     * Checks for the magic number, so callers can pick a reader.
+     */
+    static bool isBinaryTrace(llvm::StringRef path);
+
+    /**
+     * Returns nullptr (and complains) if the file is missing or malformed.
+     */
+    static std::unique_ptr<BinaryTrace> open(llvm::StringRef path);
+
+    size_t numEvents() const { return header_->numEvents; }
+    const EventRecord &event(size_t i) const;
+
+    size_t numFrames() const { return header_->numFrames; }
+    FrameRef frame(uint32_t id) const;
+
+    size_t numStacks() const { return header_->numStacks; }
+    llvm::ArrayRef<uint32_t> stack(uint32_t id) const;
+
+    llvm::StringRef metadata() const;
+
+    /**
+     * Decode the full event, strings and all. Mostly for the converters.
+     */
+    void decode(size_t i, Record &r) const;
+};
+
+}
+}
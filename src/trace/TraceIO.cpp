@@ -0,0 +1,74 @@
+#include "TraceIO.hpp"
+
+#include "llvm/Support/raw_ostream.h"
+
+#include "TracerLog.hpp"
+
+using namespace llvm;
+using namespace pmfix::trace;
+
+bool pmfix::trace::readTrace(const std::string &path, RecordSink &sink) {
+    if (isTracerLog(path)) {
+        return readTracerLog(path, sink);
+    }
+    if (!BinaryTrace::isBinaryTrace(path)) {
+        return readYamlTrace(path, sink);
+    }
+
+    auto bt = BinaryTrace::open(path);
+    if (!bt) return false;
+
+    try {
+        sink.onMetadata(YAML::Load(bt->metadata().str()));
+    } catch (const YAML::Exception &e) {
+        errs() << path << ": bad metadata: " << e.what() << "\n";
+        return false;
+    }
+
+    Record r;
+    for (size_t i = 0; i < bt->numEvents(); ++i) {
+        bt->decode(i, r);
+        sink.onRecord(r);
+    }
+
+    return true;
+}
+
+#pragma region TraceOutput
+
+std::unique_ptr<TraceOutput> TraceOutput::create(const std::string &path,
+                                                 bool binary) {
+    std::unique_ptr<TraceOutput> out(new TraceOutput());
+    if (binary) {
+        out->binary_ = BinaryTraceWriter::create(path);
+        if (!out->binary_) return nullptr;
+    } else {
+        out->yaml_ = YamlTraceWriter::create(path);
+        if (!out->yaml_) return nullptr;
+    }
+
+    return out;
+}
+
+void TraceOutput::onMetadata(const YAML::Node &metadata) {
+    if (yaml_) {
+        yaml_->setMetadata(metadata);
+        return;
+    }
+
+    YAML::Emitter meta;
+    meta << metadata;
+    binary_->setMetadata(meta.c_str());
+}
+
+void TraceOutput::onRecord(const Record &r) {
+    if (yaml_) yaml_->addEvent(r);
+    else binary_->addEvent(r);
+    numEvents_++;
+}
+
+bool TraceOutput::close() {
+    return yaml_ ? yaml_->close() : binary_->close();
+}
+
+#pragma endregion
@@ -0,0 +1,55 @@
+#pragma once
+/**
+ * Format-independent trace input and output, for tools that work on either
+ * YAML or binary traces.
+ */
+
+#include <memory>
+#include <string>
+
+#include "yaml-cpp/yaml.h"
+
+#include "TraceFormat.hpp"
+#include "TraceYaml.hpp"
+
+namespace pmfix {
+namespace trace {
+
+/**
+ * Streams a trace of either format, or a PM tracer log (see TracerLog.hpp),
+ * into the sink; the format is detected by the magic number. Binary traces
+ * and tracer logs hand over their metadata first.
+ *
+ * Returns false (and complains) if the trace can't be read.
+ */
+bool readTrace(const std::string &path, RecordSink &sink);
+
+/**
+ * A sink that writes whatever it receives to a YAML or binary trace.
+ */
+class TraceOutput : public RecordSink {
+private:
+    std::unique_ptr<BinaryTraceWriter> binary_;
+    std::unique_ptr<YamlTraceWriter> yaml_;
+    uint64_t numEvents_ = 0;
+
+    TraceOutput() {}
+
+public:
+    /**
+     * Returns nullptr (and complains) if the file can't be opened.
+     */
+    static std::unique_ptr<TraceOutput> create(const std::string &path,
+                                               bool binary);
+
+    void onMetadata(const YAML::Node &metadata) override;
+
+    void onRecord(const Record &r) override;
+
+    uint64_t numEvents() const { return numEvents_; }
+
+    bool close();
+};
+
+}
+}
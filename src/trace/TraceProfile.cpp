@@ -0,0 +1,205 @@
+#include "TraceProfile.hpp"
+
+#include <algorithm>
+
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/Format.h"
+
+using namespace llvm;
+using namespace pmfix::trace;
+
+#pragma region Counts
+
+void TraceProfile::Counts::add(const Record &r) {
+    switch (r.kind) {
+        case EventKind::STORE:
+            stores++;
+            bytes += r.length[0];
+            break;
+        case EventKind::FLUSH:
+            flushes++;
+            break;
+        case EventKind::FENCE:
+            fences++;
+            break;
+        case EventKind::REQUIRED_FLUSH:
+            redundantFlushes++;
+            break;
+        default:
+            break;
+    }
+
+    if (r.isBug) bugs++;
+}
+
+json::Object TraceProfile::Counts::toJSON() const {
+    return json::Object{
+        {"stores", int64_t(stores)},
+        {"flushes", int64_t(flushes)},
+        {"fences", int64_t(fences)},
+        {"bytes", int64_t(bytes)},
+        {"redundant_flushes", int64_t(redundantFlushes)},
+        {"redundancy", redundancyKnown() ? json::Value(redundancy())
+                                         : json::Value(nullptr)},
+        {"bugs", int64_t(bugs)},
+        {"bug_density", bugDensity()},
+    };
+}
+
+#pragma endregion
+
+#pragma region TraceProfile
+
+void TraceProfile::appendKey(std::string &key, const Frame &f) {
+    key += f.function;
+    key += '\0';
+    key += f.file;
+    key += '\0';
+    key += std::to_string(f.line);
+    key += '\0';
+    key += std::to_string(f.pc);
+    key += '\0';
+}
+
+void TraceProfile::onRecord(const Record &r) {
+    events_++;
+    total_.add(r);
+    if (r.stack.empty()) return;
+
+    key_.clear();
+    appendKey(key_, r.stack[0]);
+    auto loc = locationIds_.insert(std::make_pair(key_, locations_.size()));
+    if (loc.second) {
+        locations_.emplace_back();
+        locations_.back().frames.push_back(r.stack[0]);
+    }
+    locations_[loc.first->second].counts.add(r);
+
+    for (size_t i = 1; i < r.stack.size(); ++i) appendKey(key_, r.stack[i]);
+    auto stack = stackIds_.insert(std::make_pair(key_, stacks_.size()));
+    if (stack.second) {
+        stacks_.emplace_back();
+        stacks_.back().frames = r.stack;
+    }
+    stacks_[stack.first->second].counts.add(r);
+}
+
+std::vector<const TraceProfile::Row*> TraceProfile::sorted(
+    const std::vector<Row> &rows, SortKey by, size_t top) {
+
+    auto value = [by] (const Row *row) -> double {
+        const Counts &c = row->counts;
+        switch (by) {
+            case STORES: return c.stores;
+            case FLUSHES: return c.flushes;
+            case FENCES: return c.fences;
+            case BYTES: return c.bytes;
+            case REDUNDANCY: return c.redundancyKnown() ? c.redundancy() : -1;
+            case BUGS: return c.bugs;
+        }
+        return 0;
+    };
+
+    std::vector<const Row*> res;
+    for (const Row &row : rows) res.push_back(&row);
+    // Stable, so ties stay in trace order.
+    std::stable_sort(res.begin(), res.end(),
+        [&value] (const Row *a, const Row *b) { return value(a) > value(b); });
+
+    if (top && res.size() > top) res.resize(top);
+    return res;
+}
+
+void TraceProfile::printRows(raw_ostream &os, const char *title,
+                             const std::vector<const Row*> &rows) {
+    os << title << ":\n";
+    os << "      stores    flushes     fences          bytes  redund     bugs"
+          "   bugs/1k  where\n";
+
+    for (const Row *row : rows) {
+        const Counts &c = row->counts;
+        os << format("%12llu %10llu %10llu %14llu ",
+                     (unsigned long long)c.stores,
+                     (unsigned long long)c.flushes,
+                     (unsigned long long)c.fences,
+                     (unsigned long long)c.bytes);
+        if (c.redundancyKnown()) {
+            os << format("%6.1f%%", 100.0 * c.redundancy());
+        } else {
+            os << "    n/a";
+        }
+        os << format(" %8llu %9.2f  ", (unsigned long long)c.bugs,
+                     c.bugDensity());
+
+        auto name = [] (const Frame &f) -> std::string {
+            if (f.unsymbolized()) return "0x" + utohexstr(f.pc);
+            return f.function;
+        };
+
+        const Frame &f = row->frames[0];
+        os << name(f);
+        if (!f.unsymbolized()) os << " (" << f.file << ":" << f.line << ")";
+        for (size_t i = 1; i < row->frames.size(); ++i) {
+            os << " <- " << name(row->frames[i]);
+        }
+        os << "\n";
+    }
+    os << "\n";
+}
+
+void TraceProfile::printTable(raw_ostream &os, SortKey by, size_t top) const {
+    os << "Events: " << events_ << ", locations: " << locations_.size() <<
+        ", stacks: " << stacks_.size() << "\n";
+    os << "Stores: " << total_.stores << " (" << total_.bytes <<
+        " bytes), flushes: " << total_.flushes << ", fences: " <<
+        total_.fences << "\n";
+    os << "Redundant flushes: " << total_.redundantFlushes << " (";
+    if (total_.redundancyKnown()) {
+        os << format("%.1f", 100.0 * total_.redundancy()) << "%";
+    } else {
+        os << "n/a";
+    }
+    os << "), bugs: " << total_.bugs << "\n";
+    if (total_.flushesDropped()) {
+        os << "The trace is reduced, so its flushes are gone and the "
+            "redundancy is unknown.\nRun trace-stats on a trace written "
+            "with -no-reduce for it.\n";
+    }
+    os << "\n";
+
+    printRows(os, "By location", sorted(locations_, by, top));
+    printRows(os, "By call stack", sorted(stacks_, by, top));
+}
+
+json::Value TraceProfile::toJSON(SortKey by, size_t top) const {
+    auto rowsToJSON = [] (const std::vector<const Row*> &rows) {
+        json::Array arr;
+        for (const Row *row : rows) {
+            json::Array frames;
+            for (const Frame &f : row->frames) {
+                frames.push_back(json::Object{
+                    {"function", f.function},
+                    {"file", f.file},
+                    {"line", f.line},
+                    {"pc", int64_t(f.pc)},
+                });
+            }
+
+            json::Object obj = row->counts.toJSON();
+            obj["frames"] = std::move(frames);
+            arr.push_back(std::move(obj));
+        }
+        return arr;
+    };
+
+    json::Object total = total_.toJSON();
+    total["events"] = int64_t(events_);
+
+    return json::Object{
+        {"total", std::move(total)},
+        {"locations", rowsToJSON(sorted(locations_, by, top))},
+        {"stacks", rowsToJSON(sorted(stacks_, by, top))},
+    };
+}
+
+#pragma endregion
@@ -0,0 +1,122 @@
+#pragma once
+/**
+ * Where the PM traffic in a trace comes from: per source location and per
+ * call stack counts of stores, flushes and fences, bytes stored, redundant
+ * flushes and bugs. Used by trace-stats to pick fixer flags.
+ */
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "TraceFormat.hpp"
+#include "TraceYaml.hpp"
+
+namespace pmfix {
+namespace trace {
+
+/**
+ * A sink that aggregates the trace as it streams by, so only the distinct
+ * locations and stacks are kept in memory.
+ */
+class TraceProfile : public RecordSink {
+public:
+    struct Counts {
+        uint64_t stores = 0;
+        uint64_t flushes = 0;
+        uint64_t fences = 0;
+        // Sum of the store lengths.
+        uint64_t bytes = 0;
+        // REQUIRED_FLUSH reports, i.e. flushes that were not needed.
+        uint64_t redundantFlushes = 0;
+        // Every event marked as a bug (REQUIRED_FLUSH included).
+        uint64_t bugs = 0;
+
+        uint64_t operations() const { return stores + flushes + fences; }
+
+        /**
+         * Is there a redundancy() at all? Not without flushes, which is
+         * always the case in reduced traces (see TraceReducer): they keep the
+         * REQUIRED_FLUSH reports but drop every FLUSH.
+         */
+        bool redundancyKnown() const { return flushes; }
+
+        /**
+         * Is this a reduced trace's count, which has REQUIRED_FLUSH reports
+         * but no flushes?
+         */
+        bool flushesDropped() const { return !flushes && redundantFlushes; }
+
+        /**
+         * Fraction of the flushes later reported as REQUIRED_FLUSH.
+         */
+        double redundancy() const {
+            return flushes ? double(redundantFlushes) / flushes : 0.0;
+        }
+
+        /**
+         * Bugs per 1000 operations.
+         */
+        double bugDensity() const {
+            return operations() ? 1000.0 * bugs / operations() : 0.0;
+        }
+
+        void add(const Record &r);
+
+        llvm::json::Object toJSON() const;
+    };
+
+    struct Row {
+        // Innermost first; a single frame for locations.
+        std::vector<Frame> frames;
+        Counts counts;
+    };
+
+    enum SortKey { STORES, FLUSHES, FENCES, BYTES, REDUNDANCY, BUGS };
+
+private:
+    Counts total_;
+    uint64_t events_ = 0;
+
+    std::vector<Row> locations_;
+    llvm::StringMap<uint32_t> locationIds_;
+    std::vector<Row> stacks_;
+    llvm::StringMap<uint32_t> stackIds_;
+
+    // Reused for building keys.
+    std::string key_;
+
+    static void appendKey(std::string &key, const Frame &f);
+
+    static std::vector<const Row*> sorted(const std::vector<Row> &rows,
+                                          SortKey by, size_t top);
+
+    static void printRows(llvm::raw_ostream &os, const char *title,
+                          const std::vector<const Row*> &rows);
+
+public:
+    void onRecord(const Record &r) override;
+
+    const Counts &total() const { return total_; }
+
+    uint64_t numEvents() const { return events_; }
+
+    const std::vector<Row> &locations() const { return locations_; }
+
+    const std::vector<Row> &stacks() const { return stacks_; }
+
+    /**
+     * The top rows (all if top is 0) of both tables, sorted by the given
+     * key, largest first.
+     */
+    void printTable(llvm::raw_ostream &os, SortKey by, size_t top) const;
+
+    llvm::json::Value toJSON(SortKey by, size_t top) const;
+};
+
+}
+}
@@ -0,0 +1,73 @@
+/**
+ * trace-reduce: the trace reduction from Reports.py (BugReport._optimize) as
+ * a standalone tool, for traces that were written without it (or to re-run
+ * it with some steps turned off). Either format can be read or written.
+ *
+ *  trace-reduce trace.yaml -o reduced.yaml
+ *  trace-reduce trace.bin -o reduced.bin -no-drop-flushes
+ */
+
+#include <string>
+
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "TraceFormat.hpp"
+#include "TraceIO.hpp"
+#include "TraceReducer.hpp"
+
+using namespace llvm;
+using namespace pmfix::trace;
+
+static cl::opt<std::string> InputFile(cl::Positional,
+    cl::desc("<input trace>"), cl::Required);
+
+static cl::opt<std::string> OutputFile("o",
+    cl::desc("Output trace file"), cl::value_desc("filename"), cl::Required);
+
+enum OutputFormat { SAME, YAML_FORMAT, BINARY_FORMAT };
+
+static cl::opt<OutputFormat> Format("format",
+    cl::desc("Output format (default: same as the input)"),
+    cl::values(clEnumValN(YAML_FORMAT, "yaml", "YAML, as from parse-trace"),
+               clEnumValN(BINARY_FORMAT, "binary", "The binary format")),
+    cl::init(SAME));
+
+static cl::opt<bool> NoDedupBugs("no-dedup-bugs",
+    cl::desc("Keep every bug, not just the first for each call stack"),
+    cl::init(false));
+
+static cl::opt<bool> NoDropUnrelated("no-drop-unrelated",
+    cl::desc("Keep stores and flushes that don't touch a bug"),
+    cl::init(false));
+
+static cl::opt<bool> NoDropFlushes("no-drop-flushes",
+    cl::desc("Keep flushes"), cl::init(false));
+
+static cl::opt<bool> NoDedupFences("no-dedup-fences",
+    cl::desc("Keep repeated fences"), cl::init(false));
+
+int main(int argc, char **argv) {
+    cl::ParseCommandLineOptions(argc, argv, "Reduce a PM trace\n");
+
+    bool binary = Format == SAME ? BinaryTrace::isBinaryTrace(InputFile)
+                                 : Format == BINARY_FORMAT;
+
+    auto out = TraceOutput::create(OutputFile, binary);
+    if (!out) return 1;
+
+    TraceReducer::Options opts;
+    opts.dedupBugs = !NoDedupBugs;
+    opts.dropUnrelated = !NoDropUnrelated;
+    opts.dropFlushes = !NoDropFlushes;
+    opts.dedupFences = !NoDedupFences;
+
+    TraceReducer reducer(opts);
+    if (!reducer.reduce(InputFile, *out)) return 1;
+    reducer.stats().print(outs());
+
+    if (!out->close()) return 1;
+    outs() << "Reduced trace written to " << OutputFile << "\n";
+
+    return 0;
+}
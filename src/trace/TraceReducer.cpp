@@ -0,0 +1,191 @@
+#include "TraceReducer.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <iterator>
+
+#include "TraceIO.hpp"
+
+using namespace llvm;
+using namespace pmfix::trace;
+
+static bool isBugKind(EventKind kind) {
+    return kind == EventKind::ASSERT_PERSISTED ||
+           kind == EventKind::ASSERT_ORDERED ||
+           kind == EventKind::REQUIRED_FLUSH;
+}
+
+void TraceReducer::Stats::print(raw_ostream &os) const {
+    for (int i = 1; i < 5; ++i) {
+        os << "(Step " << i << ") Optimized from " << counts[i - 1] <<
+            " trace events to " << counts[i] << " trace events.\n";
+    }
+}
+
+std::string TraceReducer::stackKey(const Record &r) {
+    std::string key;
+    for (const Frame &f : r.stack) {
+        key += f.function;
+        key.push_back('\0');
+        key += f.file;
+        key.push_back('\0');
+        key += std::to_string(f.line);
+        key.push_back('\0');
+        key += std::to_string(f.pc);
+        key.push_back('\n');
+    }
+    return key;
+}
+
+void TraceReducer::addRange(uint64_t start, uint64_t length) {
+    // Reports.py can't represent empty ranges either.
+    if (!length) return;
+    uint64_t end = start + length;
+
+    auto it = bugRanges_.upper_bound(start);
+    if (it != bugRanges_.begin() && std::prev(it)->second >= start) {
+        --it;
+        start = it->first;
+        end = std::max(end, it->second);
+        it = bugRanges_.erase(it);
+    }
+
+    while (it != bugRanges_.end() && it->first <= end) {
+        end = std::max(end, it->second);
+        it = bugRanges_.erase(it);
+    }
+
+    bugRanges_[start] = end;
+}
+
+bool TraceReducer::overlapsBug(uint64_t start, uint64_t length) const {
+    // An empty range never overlaps anything in an IntervalTree.
+    if (!length) return false;
+    uint64_t end = start + length;
+
+    auto it = bugRanges_.upper_bound(start);
+    if (it != bugRanges_.begin() && std::prev(it)->second > start) return true;
+    return it != bugRanges_.end() && it->first < end;
+}
+
+void TraceReducer::scan(const Record &r) {
+    if (stats_.counts[0]++ && r.timestamp < lastTimestamp_) sorted_ = false;
+    lastTimestamp_ = r.timestamp;
+
+    if (!isBugKind(r.kind)) return;
+
+    bool keep = !opts_.dedupBugs || bugStacks_.insert(stackKey(r)).second;
+    keepBug_.push_back(keep);
+    if (!keep) return;
+
+    for (uint32_t i = 0; i < r.numRanges; ++i) {
+        addRange(r.address[i], r.length[i]);
+    }
+}
+
+bool TraceReducer::filter(const Record &r) {
+    if (isBugKind(r.kind)) {
+        assert(bugIdx_ < keepBug_.size() && "trace changed between passes!");
+        if (!keepBug_[bugIdx_++]) return false;
+
+        stats_.counts[1]++;
+        stats_.counts[2]++;
+        stats_.counts[3]++;
+        return true;
+    }
+
+    stats_.counts[1]++;
+
+    bool isStore = r.kind == EventKind::STORE;
+    bool isFlush = r.kind == EventKind::FLUSH;
+    if ((isStore || isFlush) && opts_.dropUnrelated &&
+        !overlapsBug(r.address[0], r.length[0])) {
+        return false;
+    }
+    stats_.counts[2]++;
+
+    if (isFlush && opts_.dropFlushes) return false;
+    stats_.counts[3]++;
+
+    return true;
+}
+
+void TraceReducer::emit(const Record &r, RecordSink &sink) {
+    if (opts_.dedupFences && !isBugKind(r.kind)) {
+        bool isFence = r.kind == EventKind::FENCE;
+        bool &prevFence = prevFence_[r.thread];
+        if (isFence && prevFence) {
+            if (dropped_) dropped_->onRecord(r);
+            return;
+        }
+        prevFence = isFence;
+    }
+
+    stats_.counts[4]++;
+    sink.onRecord(r);
+}
+
+bool TraceReducer::reduce(const std::string &path, RecordSink &sink) {
+    return reduce([&path] (RecordSink &s) { return readTrace(path, s); }, sink);
+}
+
+bool TraceReducer::reduce(Source source, RecordSink &sink) {
+    stats_ = Stats();
+    bugStacks_.clear();
+    keepBug_.clear();
+    bugRanges_.clear();
+    sorted_ = true;
+    lastTimestamp_ = 0;
+    bugIdx_ = 0;
+    prevFence_.clear();
+    pending_.clear();
+
+    struct ScanSink : public RecordSink {
+        TraceReducer &tr;
+        ScanSink(TraceReducer &tr) : tr(tr) {}
+        void onRecord(const Record &r) override { tr.scan(r); }
+    } scanSink(*this);
+
+    if (!source(scanSink)) return false;
+
+    /**
+     * Step 3 sorts by timestamp. The traces are written in timestamp order,
+     * so that is normally a no-op and we can stream; otherwise the survivors
+     * of steps 1-3 are buffered and (stably) sorted first.
+     */
+    bool buffer = !sorted_ && opts_.dropFlushes;
+
+    struct FilterSink : public RecordSink {
+        TraceReducer &tr;
+        RecordSink &out;
+        bool buffer;
+        FilterSink(TraceReducer &tr, RecordSink &out, bool buffer)
+            : tr(tr), out(out), buffer(buffer) {}
+
+        void onMetadata(const YAML::Node &metadata) override {
+            out.onMetadata(metadata);
+        }
+
+        void onRecord(const Record &r) override {
+            if (!tr.filter(r)) {
+                if (tr.dropped_) tr.dropped_->onRecord(r);
+                return;
+            }
+            if (buffer) tr.pending_.push_back(r);
+            else tr.emit(r, out);
+        }
+    } filterSink(*this, sink, buffer);
+
+    if (!source(filterSink)) return false;
+
+    if (buffer) {
+        std::stable_sort(pending_.begin(), pending_.end(),
+            [] (const Record &a, const Record &b) {
+                return a.timestamp < b.timestamp;
+            });
+        for (const Record &r : pending_) emit(r, sink);
+        pending_.clear();
+    }
+
+    return true;
+}
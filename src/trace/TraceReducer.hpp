@@ -0,0 +1,127 @@
+#pragma once
+/**
+ * A native version of BugReport._optimize (tools/Reports.py), which shrinks a
+ * trace down to the events the fixer needs.
+ *
+ * Reports.py loads the whole trace as a list of dicts and makes a copy per
+ * step. The reducer instead reads the input twice: the first pass records
+ * which bugs to keep and the address ranges they touch, the second pass
+ * filters the events and writes them out as it goes. Only the bug stacks and
+ * ranges are kept in memory.
+ */
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "TraceFormat.hpp"
+#include "TraceYaml.hpp"
+
+namespace pmfix {
+namespace trace {
+
+class TraceReducer {
+public:
+    /**
+     * The steps of _optimize, all on by default.
+     */
+    struct Options {
+        // Step 1: only keep the first bug reported for each call stack.
+        bool dedupBugs = true;
+        // Step 2: drop stores and flushes that don't touch a bug's range.
+        bool dropUnrelated = true;
+        // Step 3: drop flushes. Reports.py re-adds every store it tracks and
+        // never re-adds a flush, so all flushes go away.
+        bool dropFlushes = true;
+        // Step 4: collapse runs of fences (bugs don't break a run). A fence
+        // only orders its own thread, so each thread has its own runs.
+        bool dedupFences = true;
+    };
+
+    /**
+     * Number of events left after each step; counts[0] is the input size.
+     */
+    struct Stats {
+        uint64_t counts[5] = {0, 0, 0, 0, 0};
+
+        /**
+         * The same "(Step N) Optimized from..." lines as Reports.py.
+         */
+        void print(llvm::raw_ostream &os) const;
+    };
+
+private:
+    Options opts_;
+    Stats stats_;
+    RecordSink *dropped_ = nullptr;
+
+    // Filled in by the first pass.
+    std::unordered_set<std::string> bugStacks_;
+    std::vector<bool> keepBug_;
+    // Merged [start, end) ranges of the kept bugs.
+    std::map<uint64_t, uint64_t> bugRanges_;
+    bool sorted_ = true;
+    uint64_t lastTimestamp_ = 0;
+
+    // Used by the second pass.
+    size_t bugIdx_ = 0;
+    // Thread -> was its last (kept) operation a fence?
+    std::unordered_map<uint32_t, bool> prevFence_;
+    std::vector<Record> pending_;
+
+    static std::string stackKey(const Record &r);
+
+    void addRange(uint64_t start, uint64_t length);
+
+    bool overlapsBug(uint64_t start, uint64_t length) const;
+
+    void scan(const Record &r);
+
+    /**
+     * Steps 1-3 for one event. Returns false if it is dropped.
+     */
+    bool filter(const Record &r);
+
+    /**
+     * Step 4, which works on the sorted output of step 3.
+     */
+    void emit(const Record &r, RecordSink &sink);
+
+public:
+    TraceReducer() {}
+    TraceReducer(const Options &opts) : opts_(opts) {}
+
+    /**
+     * Streams the input trace into the given sink, returning false on errors.
+     * It is called once per pass, so it must produce the same trace each time.
+     */
+    typedef llvm::function_ref<bool(RecordSink&)> Source;
+
+    /**
+     * Reduce the trace from source into the sink. The metadata is passed
+     * through untouched. Returns false if the trace can't be read.
+     */
+    bool reduce(Source source, RecordSink &sink);
+
+    /**
+     * Reduce the trace at path (either format).
+     */
+    bool reduce(const std::string &path, RecordSink &sink);
+
+    /**
+     * Also pass the records that get dropped (by any step) to the given
+     * sink, in the order they are dropped. It never gets metadata.
+     */
+    void setDroppedSink(RecordSink *sink) { dropped_ = sink; }
+
+    const Stats &stats() const { return stats_; }
+};
+
+}
+}
@@ -0,0 +1,67 @@
+/**
+ * trace-stats: where the PM traffic in a trace comes from, per source
+ * location and per call stack. The trace (either format) is streamed, so
+ * multi-GB traces take one pass and little memory.
+ *
+ *  trace-stats trace.bin
+ *  trace-stats trace.yaml -sort=redundancy -top=50 -json=stats.json
+ */
+
+#include <string>
+
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "TraceIO.hpp"
+#include "TraceProfile.hpp"
+
+using namespace llvm;
+using namespace pmfix::trace;
+
+static cl::opt<std::string> InputFile(cl::Positional,
+    cl::desc("<input trace>"), cl::Required);
+
+static cl::opt<std::string> JsonFile("json",
+    cl::desc("Also write the statistics as JSON"),
+    cl::value_desc("filename"), cl::init(""));
+
+static cl::opt<TraceProfile::SortKey> SortBy("sort",
+    cl::desc("Sort the tables by (default: bytes)"),
+    cl::values(clEnumValN(TraceProfile::STORES, "stores", "Store count"),
+               clEnumValN(TraceProfile::FLUSHES, "flushes", "Flush count"),
+               clEnumValN(TraceProfile::FENCES, "fences", "Fence count"),
+               clEnumValN(TraceProfile::BYTES, "bytes", "Bytes stored"),
+               clEnumValN(TraceProfile::REDUNDANCY, "redundancy",
+                          "Fraction of redundant flushes"),
+               clEnumValN(TraceProfile::BUGS, "bugs", "Bug count")),
+    cl::init(TraceProfile::BYTES));
+
+static cl::opt<unsigned> Top("top",
+    cl::desc("Rows per table, 0 for all (default: 20)"), cl::init(20));
+
+int main(int argc, char **argv) {
+    cl::ParseCommandLineOptions(argc, argv,
+        "Report where the PM operations and bugs in a trace come from\n");
+
+    TraceProfile profile;
+    if (!readTrace(InputFile, profile)) return 1;
+
+    profile.printTable(outs(), SortBy, Top);
+
+    if (!JsonFile.empty()) {
+        std::error_code ec;
+        raw_fd_ostream out(JsonFile, ec, sys::fs::F_None);
+        if (ec) {
+            errs() << "Could not open " << JsonFile << ": " <<
+                ec.message() << "\n";
+            return 1;
+        }
+        // The JSON gets every row; -top is just for the tables.
+        out << formatv("{0:2}", profile.toJSON(SortBy, 0)) << "\n";
+        outs() << "Statistics written to " << JsonFile << "\n";
+    }
+
+    return 0;
+}
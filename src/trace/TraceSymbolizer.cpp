@@ -0,0 +1,125 @@
+#include "TraceSymbolizer.hpp"
+
+#include <algorithm>
+#include <cassert>
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+using namespace pmfix::trace;
+
+static symbolize::LLVMSymbolizer::Options symbolizerOptions(void) {
+    symbolize::LLVMSymbolizer::Options opts;
+    // The mapper matches both mangled and demangled names, but the linkage
+    // name is what the module has.
+    opts.PrintFunctions = symbolize::FunctionNameKind::LinkageName;
+    opts.Demangle = false;
+    return opts;
+}
+
+static bool toAddress(const YAML::Node &node, uint64_t &value) {
+    if (!node || !node.IsScalar()) return false;
+    // Radix 0 takes both hex and decimal.
+    return !StringRef(node.Scalar()).getAsInteger(0, value);
+}
+
+TraceSymbolizer::TraceSymbolizer(std::vector<Module> &&modules)
+    : modules_(std::move(modules)), symbolizer_(symbolizerOptions()) {}
+
+std::unique_ptr<TraceSymbolizer> TraceSymbolizer::create(
+    const YAML::Node &metadata) {
+    std::vector<Module> modules;
+    // A missing key gives an invalid node, which throws if asked its type.
+    if (!metadata.IsMap() || !metadata["modules"] ||
+        !metadata["modules"].IsSequence()) {
+        errs() << "The trace has PC frames but no \"modules\" metadata, so "
+            "they can't be symbolized\n";
+        return std::unique_ptr<TraceSymbolizer>(
+            new TraceSymbolizer(std::move(modules)));
+    }
+
+    for (const YAML::Node &m : metadata["modules"]) {
+        Module mod;
+        if (!m.IsMap() || !m["path"] || !toAddress(m["base"], mod.base)) {
+            errs() << "Skipping bad module entry in the trace metadata\n";
+            continue;
+        }
+        mod.path = m["path"].as<std::string>();
+        if (m["end"] && !toAddress(m["end"], mod.end)) mod.end = 0;
+        modules.push_back(std::move(mod));
+    }
+    if (modules.empty()) {
+        errs() << "The trace lists no valid modules, so its PC frames can't "
+            "be symbolized\n";
+    }
+
+    std::sort(modules.begin(), modules.end(),
+        [] (const Module &a, const Module &b) { return a.base < b.base; });
+
+    return std::unique_ptr<TraceSymbolizer>(
+        new TraceSymbolizer(std::move(modules)));
+}
+
+const TraceSymbolizer::Module *TraceSymbolizer::findModule(uint64_t pc) const {
+    auto it = std::upper_bound(modules_.begin(), modules_.end(), pc,
+        [] (uint64_t pc, const Module &m) { return pc < m.base; });
+    if (it == modules_.begin()) return nullptr;
+    --it;
+    if (it->end && pc >= it->end) return nullptr;
+    return &*it;
+}
+
+void TraceSymbolizer::lookup(uint64_t address, std::vector<Frame> &frames) {
+    const Module *mod = findModule(address);
+    if (mod) {
+        auto res = symbolizer_.symbolizeInlinedCode(mod->path,
+                                                    address - mod->base);
+        if (!res) {
+            if (!warned_) {
+                errs() << "Could not symbolize " << mod->path << ": " <<
+                    toString(res.takeError()) << "\n";
+                warned_ = true;
+            } else {
+                consumeError(res.takeError());
+            }
+        } else {
+            for (uint32_t i = 0; i < res->getNumberOfFrames(); ++i) {
+                const DILineInfo &info = res->getFrame(i);
+                Frame f;
+                if (info.FunctionName != "<invalid>") {
+                    f.function = info.FunctionName;
+                }
+                if (info.FileName != "<invalid>") f.file = info.FileName;
+                if (info.Line) f.line = info.Line;
+                frames.push_back(std::move(f));
+            }
+        }
+    }
+
+    if (frames.empty()) frames.emplace_back();
+}
+
+const std::vector<Frame> &TraceSymbolizer::symbolize(uint64_t pc,
+                                                     bool returnAddress) {
+    uint64_t address = returnAddress ? pc - 1 : pc;
+    auto it = cache_.find(address);
+    if (it != cache_.end()) return it->second;
+
+    std::vector<Frame> &frames = cache_[address];
+    lookup(address, frames);
+    return frames;
+}
+
+void TraceSymbolizer::expand(const std::vector<Frame> &stack,
+                             std::vector<Frame> &out) {
+    for (size_t i = 0; i < stack.size(); ++i) {
+        if (!stack[i].unsymbolized()) {
+            out.push_back(stack[i]);
+            continue;
+        }
+
+        const std::vector<Frame> &frames = symbolize(stack[i].pc, i > 0);
+        out.insert(out.end(), frames.begin(), frames.end());
+    }
+}
@@ -0,0 +1,95 @@
+#pragma once
+/**
+ * Offline symbolization of PC-only trace frames.
+ *
+ * Walking the stack and looking up debug info for every event is what makes
+ * tracing slow, so a tracer can just record raw code addresses instead
+ * (Frame::pc) and list the modules it saw in the metadata:
+ *
+ *  metadata:
+ *    modules:
+ *      - path: /usr/lib/libpmemobj.so.1
+ *        base: 0x7f3a12000000     # load bias: object address = pc - base
+ *        end: 0x7f3a12200000      # optional
+ *
+ * The fixer then symbolizes each distinct address once, from the modules'
+ * DWARF, instead of the tracer doing it per event.
+ */
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/DebugInfo/Symbolize/Symbolize.h"
+#include "yaml-cpp/yaml.h"
+
+#include "TraceFormat.hpp"
+
+namespace pmfix {
+namespace trace {
+
+class TraceSymbolizer {
+public:
+    struct Module {
+        std::string path;
+        uint64_t base = 0;
+        // 0 if unknown, in which case the module runs up to the next one.
+        uint64_t end = 0;
+    };
+
+private:
+    // Sorted by base.
+    std::vector<Module> modules_;
+    llvm::symbolize::LLVMSymbolizer symbolizer_;
+    // Lookup address -> source frames, innermost first.
+    llvm::DenseMap<uint64_t, std::vector<Frame>> cache_;
+    // Whether a failed lookup was reported. Only the first one is, per
+    // symbolizer: the traces are loaded in parallel, each with its own.
+    bool warned_ = false;
+
+    TraceSymbolizer(std::vector<Module> &&modules);
+
+    const Module *findModule(uint64_t pc) const;
+
+    void lookup(uint64_t address, std::vector<Frame> &frames);
+
+public:
+    /**
+     * If the metadata has no (valid) "modules" list, as in the log of a
+     * traced program that did not exit cleanly, this complains and returns a
+     * symbolizer that knows no modules, so every address is left unresolved
+     * like one outside every module.
+     */
+    static std::unique_ptr<TraceSymbolizer> create(const YAML::Node &metadata);
+
+    /**
+     * The source frames for a code address, innermost first; more than one
+     * if the code was inlined. Frames other than the first in a stack hold
+     * return addresses, which point past the call, so those are looked up at
+     * pc - 1.
+     *
+     * Addresses that can't be resolved give a single frame with no function.
+     */
+    const std::vector<Frame> &symbolize(uint64_t pc, bool returnAddress);
+
+    /**
+     * Append the stack to out with every unsymbolized frame replaced by its
+     * source frames.
+     */
+    void expand(const std::vector<Frame> &stack, std::vector<Frame> &out);
+
+    /**
+     * The modules from the metadata, sorted by base.
+     */
+    const std::vector<Module> &modules() const { return modules_; }
+
+    /**
+     * Number of distinct addresses looked up so far.
+     */
+    size_t numSymbolized() const { return cache_.size(); }
+};
+
+}
+}
@@ -0,0 +1,423 @@
+#include "TraceYaml.hpp"
+
+#include <cassert>
+#include <cstdlib>
+#include <vector>
+
+#include "llvm/Support/raw_ostream.h"
+
+#include "yaml-cpp/eventhandler.h"
+
+using namespace llvm;
+using namespace pmfix::trace;
+
+#pragma region Reading
+
+namespace {
+
+/**
+ * Tracks where we are in the document and fills in one Record at a time.
+ * The expected layout is:
+ *
+ *  metadata: {...}           -- forwarded to an emitter, given to the sink
+ *  trace:
+ *    - {key: scalar, ..., stack: [{function, file, line}, ...]}
+ */
+class TraceEventHandler : public YAML::EventHandler {
+private:
+    enum Context { TOP, TRACE, EVENT, STACK, FRAME, SKIP };
+
+    struct Level {
+        Context ctx;
+        bool isMap;
+        bool expectKey;
+        std::string key;
+    };
+
+    RecordSink &sink_;
+    std::vector<Level> levels_;
+    std::string error_;
+    YAML::Mark lastMark_;
+
+    // The metadata map is small, so we just re-emit it and load it as a node.
+    YAML::Emitter meta_;
+    int metaDepth_ = 0;
+
+    // The event being read.
+    Record record_;
+    Frame location_;
+    Frame frame_;
+    uint64_t addr_[3];
+    uint64_t len_[3];
+
+    void fail(const YAML::Mark &mark, const std::string &msg) {
+        if (!error_.empty()) return;
+        error_ = "line " + std::to_string(mark.line + 1) + ": " + msg;
+    }
+
+    static uint64_t toUnsigned(const std::string &v) {
+        bool hex = v.size() > 2 && v[0] == '0' && (v[1] == 'x' || v[1] == 'X');
+        return std::strtoull(v.c_str(), nullptr, hex ? 16 : 10);
+    }
+
+    static int64_t toSigned(const std::string &v) {
+        return std::strtoll(v.c_str(), nullptr, 10);
+    }
+
+    static bool toBool(const std::string &v) {
+        return v == "true" || v == "True" || v == "TRUE";
+    }
+
+    void startEvent() {
+        record_.clear();
+        location_ = Frame();
+        for (int i = 0; i < 3; ++i) addr_[i] = len_[i] = 0;
+    }
+
+    void finishEvent(const YAML::Mark &mark) {
+        if (record_.kind == EventKind::INVALID) {
+            fail(mark, "event with a missing or unknown type");
+            return;
+        }
+
+        // The event location is always the top of the stack.
+        if (record_.stack.empty()) {
+            record_.stack.push_back(location_);
+        }
+
+        switch (record_.kind) {
+            case EventKind::STORE:
+            case EventKind::FLUSH:
+            case EventKind::ASSERT_PERSISTED:
+            case EventKind::REQUIRED_FLUSH:
+                record_.numRanges = 1;
+                record_.address[0] = addr_[0];
+                record_.length[0] = len_[0];
+                break;
+            case EventKind::ASSERT_ORDERED:
+                record_.numRanges = 2;
+                record_.address[0] = addr_[1];
+                record_.length[0] = len_[1];
+                record_.address[1] = addr_[2];
+                record_.length[1] = len_[2];
+                break;
+            default:
+                break;
+        }
+
+        sink_.onRecord(record_);
+    }
+
+    void eventField(const std::string &key, const std::string &v) {
+        if (key == "event") record_.kind = kindFromString(v);
+        else if (key == "timestamp") record_.timestamp = toUnsigned(v);
+        else if (key == "is_bug") record_.isBug = toBool(v);
+        else if (key == "function") location_.function = v;
+        else if (key == "file") location_.file = v;
+        else if (key == "line") location_.line = toSigned(v);
+        else if (key == "address") addr_[0] = toUnsigned(v);
+        else if (key == "length") len_[0] = toUnsigned(v);
+        else if (key == "address_a") addr_[1] = toUnsigned(v);
+        else if (key == "length_a") len_[1] = toUnsigned(v);
+        else if (key == "address_b") addr_[2] = toUnsigned(v);
+        else if (key == "length_b") len_[2] = toUnsigned(v);
+        else if (key == "state") record_.state = v;
+        else if (key == "thread") record_.thread = toUnsigned(v);
+    }
+
+    void frameField(const std::string &key, const std::string &v) {
+        if (key == "function") frame_.function = v;
+        else if (key == "file") frame_.file = v;
+        else if (key == "line") frame_.line = toSigned(v);
+        else if (key == "pc") frame_.pc = toUnsigned(v);
+    }
+
+    /**
+     * The current map finished reading a value.
+     */
+    void valueDone() {
+        if (!levels_.empty() && levels_.back().isMap) {
+            levels_.back().expectKey = true;
+        }
+    }
+
+    /**
+     * Work out what a new collection is, based on where it starts.
+     */
+    Context childContext(bool isMap, const YAML::Mark &mark) {
+        if (levels_.empty()) {
+            if (!isMap) fail(mark, "expected a map at the top level");
+            return isMap ? TOP : SKIP;
+        }
+
+        const Level &parent = levels_.back();
+        switch (parent.ctx) {
+            case TOP:
+                if (!isMap && parent.key == "trace") return TRACE;
+                break;
+            case TRACE:
+                if (isMap) return EVENT;
+                fail(mark, "expected a map for each trace event");
+                break;
+            case EVENT:
+                if (!isMap && parent.key == "stack") return STACK;
+                break;
+            case STACK:
+                if (isMap) return FRAME;
+                fail(mark, "expected a map for each stack frame");
+                break;
+            default:
+                break;
+        }
+
+        return SKIP;
+    }
+
+    void startCollection(bool isMap, const YAML::Mark &mark) {
+        if (metaDepth_) {
+            meta_ << (isMap ? YAML::BeginMap : YAML::BeginSeq);
+            metaDepth_++;
+            return;
+        }
+
+        if (!levels_.empty() && levels_.back().ctx == TOP &&
+            levels_.back().key == "metadata") {
+            meta_ << (isMap ? YAML::BeginMap : YAML::BeginSeq);
+            metaDepth_ = 1;
+            return;
+        }
+
+        Context ctx = childContext(isMap, mark);
+        if (ctx == EVENT) startEvent();
+        if (ctx == FRAME) frame_ = Frame();
+
+        levels_.push_back(Level{ctx, isMap, true, std::string()});
+    }
+
+    void endCollection(bool isMap) {
+        if (metaDepth_) {
+            meta_ << (isMap ? YAML::EndMap : YAML::EndSeq);
+            if (--metaDepth_ == 0) {
+                sink_.onMetadata(YAML::Load(meta_.c_str()));
+                valueDone();
+            }
+            return;
+        }
+
+        Level done = levels_.back();
+        levels_.pop_back();
+
+        if (done.ctx == EVENT) finishEvent(lastMark_);
+        if (done.ctx == FRAME) record_.stack.push_back(frame_);
+
+        valueDone();
+    }
+
+public:
+    TraceEventHandler(RecordSink &sink) : sink_(sink) {}
+
+    const std::string &error() const { return error_; }
+
+    void OnDocumentStart(const YAML::Mark &mark) override {}
+    void OnDocumentEnd() override {}
+
+    void OnNull(const YAML::Mark &mark, YAML::anchor_t anchor) override {
+        OnScalar(mark, "", anchor, "~");
+    }
+
+    void OnAlias(const YAML::Mark &mark, YAML::anchor_t anchor) override {
+        fail(mark, "aliases are not supported in traces");
+    }
+
+    void OnScalar(const YAML::Mark &mark, const std::string &tag,
+                  YAML::anchor_t anchor, const std::string &value) override {
+        lastMark_ = mark;
+
+        if (metaDepth_) {
+            meta_ << value;
+            return;
+        }
+
+        if (levels_.empty()) {
+            fail(mark, "expected a map at the top level");
+            return;
+        }
+
+        Level &level = levels_.back();
+        if (!level.isMap) {
+            if (level.ctx != SKIP) fail(mark, "unexpected scalar");
+            return;
+        }
+
+        if (level.expectKey) {
+            level.key = value;
+            level.expectKey = false;
+            return;
+        }
+
+        if (level.ctx == EVENT) eventField(level.key, value);
+        else if (level.ctx == FRAME) frameField(level.key, value);
+        level.expectKey = true;
+    }
+
+    void OnSequenceStart(const YAML::Mark &mark, const std::string &tag,
+                         YAML::anchor_t anchor,
+                         YAML::EmitterStyle::value style) override {
+        lastMark_ = mark;
+        startCollection(false, mark);
+    }
+
+    void OnSequenceEnd() override { endCollection(false); }
+
+    void OnMapStart(const YAML::Mark &mark, const std::string &tag,
+                    YAML::anchor_t anchor,
+                    YAML::EmitterStyle::value style) override {
+        lastMark_ = mark;
+        startCollection(true, mark);
+    }
+
+    void OnMapEnd() override { endCollection(true); }
+};
+
+}
+
+bool pmfix::trace::readYamlTrace(const std::string &path, RecordSink &sink) {
+    std::ifstream in(path);
+    if (!in) {
+        errs() << "Could not open " << path << "\n";
+        return false;
+    }
+
+    TraceEventHandler handler(sink);
+    try {
+        YAML::Parser parser(in);
+        parser.HandleNextDocument(handler);
+    } catch (const YAML::Exception &e) {
+        errs() << path << ": " << e.what() << "\n";
+        return false;
+    }
+
+    if (!handler.error().empty()) {
+        errs() << path << ": " << handler.error() << "\n";
+        return false;
+    }
+
+    return true;
+}
+
+#pragma endregion
+
+#pragma region YamlTraceWriter
+
+YamlTraceWriter::YamlTraceWriter(const std::string &path,
+                                 const YAML::Node &metadata)
+    : out_(path), emitter_(out_), metadata_(metadata) {}
+
+YamlTraceWriter::~YamlTraceWriter() {
+    if (!closed_) close();
+}
+
+std::unique_ptr<YamlTraceWriter> YamlTraceWriter::create(
+    const std::string &path, const YAML::Node &metadata) {
+    std::unique_ptr<YamlTraceWriter> w(new YamlTraceWriter(path, metadata));
+    if (!w->out_) {
+        errs() << "Could not open " << path << "\n";
+        w->closed_ = true;
+        return nullptr;
+    }
+
+    return w;
+}
+
+void YamlTraceWriter::setMetadata(const YAML::Node &metadata) {
+    assert(!started_ && "metadata must come before the events!");
+    metadata_ = metadata;
+}
+
+void YamlTraceWriter::start(void) {
+    if (started_) return;
+    started_ = true;
+
+    emitter_ << YAML::BeginMap;
+    emitter_ << YAML::Key << "metadata" << YAML::Value;
+    if (metadata_.IsMap()) {
+        emitter_ << metadata_;
+    } else {
+        emitter_ << YAML::BeginMap << YAML::EndMap;
+    }
+    emitter_ << YAML::Key << "trace" << YAML::Value << YAML::BeginSeq;
+}
+
+static void emitFrame(YAML::Emitter &e, const Frame &f) {
+    e << YAML::Key << "file" << YAML::Value << f.file;
+    e << YAML::Key << "function" << YAML::Value << f.function;
+    e << YAML::Key << "line" << YAML::Value << f.line;
+    if (f.pc) {
+        e << YAML::Key << "pc" << YAML::Value << YAML::Hex << f.pc << YAML::Dec;
+    }
+}
+
+void YamlTraceWriter::addEvent(const Record &r) {
+    assert(!closed_ && "writer already closed!");
+    assert(!r.stack.empty() && "event without a location!");
+    start();
+
+    // Keys are sorted, the same as yaml.dump.
+    emitter_ << YAML::BeginMap;
+    if (r.kind == EventKind::ASSERT_ORDERED) {
+        emitter_ << YAML::Key << "address_a" << YAML::Value << r.address[0];
+        emitter_ << YAML::Key << "address_b" << YAML::Value << r.address[1];
+    } else if (r.numRanges) {
+        emitter_ << YAML::Key << "address" << YAML::Value << r.address[0];
+    }
+    emitter_ << YAML::Key << "event" << YAML::Value << kindName(r.kind);
+    emitter_ << YAML::Key << "file" << YAML::Value << r.stack[0].file;
+    emitter_ << YAML::Key << "function" << YAML::Value << r.stack[0].function;
+    emitter_ << YAML::Key << "is_bug" << YAML::Value << r.isBug;
+    if (r.kind == EventKind::ASSERT_ORDERED) {
+        emitter_ << YAML::Key << "length_a" << YAML::Value << r.length[0];
+        emitter_ << YAML::Key << "length_b" << YAML::Value << r.length[1];
+    } else if (r.numRanges) {
+        emitter_ << YAML::Key << "length" << YAML::Value << r.length[0];
+    }
+    emitter_ << YAML::Key << "line" << YAML::Value << r.stack[0].line;
+
+    emitter_ << YAML::Key << "stack" << YAML::Value << YAML::BeginSeq;
+    for (const Frame &f : r.stack) {
+        emitter_ << YAML::BeginMap;
+        emitFrame(emitter_, f);
+        emitter_ << YAML::EndMap;
+    }
+    emitter_ << YAML::EndSeq;
+
+    if (!r.state.empty()) {
+        emitter_ << YAML::Key << "state" << YAML::Value << r.state;
+    }
+    // Only multi-threaded traces have threads, which keeps the rest the same
+    // as parse-trace's.
+    if (r.thread) {
+        emitter_ << YAML::Key << "thread" << YAML::Value << r.thread;
+    }
+    emitter_ << YAML::Key << "timestamp" << YAML::Value << r.timestamp;
+    emitter_ << YAML::EndMap;
+}
+
+bool YamlTraceWriter::close() {
+    if (closed_) return out_.good();
+    closed_ = true;
+
+    start();
+    emitter_ << YAML::EndSeq;
+    emitter_ << YAML::EndMap;
+    out_ << "\n";
+    out_.close();
+
+    if (!emitter_.good()) {
+        errs() << "YAML emitter error: " << emitter_.GetLastError() << "\n";
+        return false;
+    }
+
+    return !out_.fail();
+}
+
+#pragma endregion
@@ -0,0 +1,88 @@
+#pragma once
+/**
+ * Conversion between the YAML traces written by parse-trace and trace Records.
+ */
+
+#include <fstream>
+#include <memory>
+#include <string>
+
+#include "yaml-cpp/yaml.h"
+
+#include "TraceFormat.hpp"
+
+namespace pmfix {
+namespace trace {
+
+/**
+ * Receives the contents of a trace as it is read.
+ */
+class RecordSink {
+public:
+    virtual ~RecordSink() {}
+
+    /**
+     * Called once, when the "metadata" map has been read. parse-trace always
+     * writes the metadata before the trace, but this isn't guaranteed.
+     */
+    virtual void onMetadata(const YAML::Node &metadata) {}
+
+    /**
+     * The record is reused for the next event, so copy what you need.
+     */
+    virtual void onRecord(const Record &r) = 0;
+};
+
+/**
+ * Reads a YAML trace with yaml-cpp's event (SAX) interface and hands each
+ * event to the sink as soon as it has been parsed. Unlike YAML::LoadFile,
+ * this never builds a node tree for the "trace" sequence, so memory use
+ * doesn't grow with the size of the document.
+ *
+ * Unknown keys are skipped.
+ *
+ * Returns false (and complains) if the trace is malformed.
+ */
+bool readYamlTrace(const std::string &path, RecordSink &sink);
+
+/**
+ * Writes traces in the same layout as Reports.py (metadata first, keys in
+ * sorted order), so the output can be fed to anything that reads the YAML.
+ * Events are emitted as they are added.
+ */
+class YamlTraceWriter {
+private:
+    std::ofstream out_;
+    YAML::Emitter emitter_;
+    YAML::Node metadata_;
+    bool started_ = false;
+    bool closed_ = false;
+
+    YamlTraceWriter(const std::string &path, const YAML::Node &metadata);
+
+    /**
+     * The metadata goes first, so this is deferred until the first event.
+     */
+    void start(void);
+
+public:
+    /**
+     * Returns nullptr (and complains) if the file can't be opened.
+     */
+    static std::unique_ptr<YamlTraceWriter> create(
+        const std::string &path, const YAML::Node &metadata = YAML::Node());
+
+    ~YamlTraceWriter();
+
+    /**
+     * Must be called before the first event is added.
+     */
+    void setMetadata(const YAML::Node &metadata);
+
+    void addEvent(const Record &r);
+
+    bool close();
+};
+
+}
+}
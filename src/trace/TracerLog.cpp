@@ -0,0 +1,159 @@
+#include "TracerLog.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "TracerRecord.h"
+
+using namespace llvm;
+using namespace pmfix::trace;
+
+bool pmfix::trace::isTracerLog(const std::string &path) {
+    char magic[8];
+    FILE *f = fopen(path.c_str(), "rb");
+    if (!f) return false;
+    size_t n = fread(magic, 1, sizeof(magic), f);
+    fclose(f);
+
+    return n == sizeof(magic) &&
+           !memcmp(magic, PMTRACER_MAGIC, sizeof(PMTRACER_MAGIC));
+}
+
+/**
+ * "<base> <end> <path>" lines, in hex.
+ */
+static YAML::Node parseModules(StringRef text) {
+    YAML::Node modules(YAML::NodeType::Sequence);
+
+    SmallVector<StringRef, 16> lines;
+    text.split(lines, '\n', -1, false);
+    for (StringRef line : lines) {
+        StringRef base, end, path, rest;
+        std::tie(base, rest) = line.split(' ');
+        std::tie(end, path) = rest.split(' ');
+
+        uint64_t b, e;
+        if (path.empty() || base.getAsInteger(16, b) ||
+            end.getAsInteger(16, e)) {
+            errs() << "Skipping bad module line: " << line << "\n";
+            continue;
+        }
+
+        YAML::Node m;
+        m["path"] = path.str();
+        m["base"] = "0x" + utohexstr(b);
+        m["end"] = "0x" + utohexstr(e);
+        modules.push_back(m);
+    }
+
+    return modules;
+}
+
+bool pmfix::trace::readTracerLog(const std::string &path, RecordSink &sink) {
+    auto bufOrErr = MemoryBuffer::getFile(path, /*FileSize*/ -1,
+                                          /*RequiresNullTerminator*/ false);
+    if (std::error_code ec = bufOrErr.getError()) {
+        errs() << "Could not open " << path << ": " << ec.message() << "\n";
+        return false;
+    }
+
+    const MemoryBuffer &buf = **bufOrErr;
+    uint64_t size = buf.getBufferSize();
+    const char *start = buf.getBufferStart();
+
+    pmtracer_header h;
+    if (size < sizeof(h)) {
+        errs() << path << ": too small to be a tracer log!\n";
+        return false;
+    }
+    memcpy(&h, start, sizeof(h));
+
+    if (memcmp(h.magic, PMTRACER_MAGIC, sizeof(PMTRACER_MAGIC))) {
+        errs() << path << ": not a tracer log!\n";
+        return false;
+    }
+    if (h.version != PMTRACER_VERSION ||
+        h.record_size != sizeof(pmtracer_record)) {
+        errs() << path << ": unsupported tracer log version " <<
+            h.version << "\n";
+        return false;
+    }
+
+    // The runtime fills in the rest of the header at exit.
+    bool finished = h.modules_offset != 0;
+    uint64_t numRecords = h.num_records;
+    if (!finished) {
+        errs() << path << ": the program did not exit cleanly, so the PCs "
+            "can't be symbolized\n";
+        numRecords = (size - sizeof(h)) / sizeof(pmtracer_record);
+    } else if (numRecords > (size - sizeof(h)) / sizeof(pmtracer_record) ||
+               h.modules_offset > size ||
+               h.modules_size > size - h.modules_offset) {
+        errs() << path << ": malformed tracer log!\n";
+        return false;
+    }
+
+    YAML::Node metadata;
+    metadata["source"] = "GENERIC";
+    if (finished) {
+        metadata["modules"] = parseModules(
+            StringRef(start + h.modules_offset, h.modules_size));
+    }
+    sink.onMetadata(metadata);
+
+    // Each thread's records are in order, but the threads are drained in
+    // chunks, so put them back in timestamp order. The records themselves
+    // stay in the (mmap'd) file. Records from different threads can have the
+    // same timestamp; the thread breaks the tie, so the order is stable.
+    const pmtracer_record *records =
+        reinterpret_cast<const pmtracer_record*>(start + sizeof(h));
+    std::vector<uint64_t> order(numRecords);
+    for (uint64_t i = 0; i < numRecords; ++i) order[i] = i;
+    std::sort(order.begin(), order.end(), [records] (uint64_t a, uint64_t b) {
+        if (records[a].timestamp != records[b].timestamp) {
+            return records[a].timestamp < records[b].timestamp;
+        }
+        return records[a].thread < records[b].thread;
+    });
+
+    // The timestamps are clock ticks, so number the records instead.
+    Record r;
+    uint64_t timestamp = 0;
+    for (uint64_t i : order) {
+        const pmtracer_record &pr = records[i];
+        r.clear();
+        switch (pr.kind) {
+            case PMTRACER_STORE: r.kind = EventKind::STORE; break;
+            case PMTRACER_FLUSH: r.kind = EventKind::FLUSH; break;
+            case PMTRACER_FENCE: r.kind = EventKind::FENCE; break;
+            default:
+                errs() << path << ": bad record kind " <<
+                    unsigned(pr.kind) << "\n";
+                return false;
+        }
+
+        r.timestamp = timestamp++;
+        r.thread = pr.thread;
+        if (r.kind != EventKind::FENCE) {
+            r.numRanges = 1;
+            r.address[0] = pr.address;
+            r.length[0] = pr.length;
+        }
+
+        Frame f;
+        f.pc = pr.pc;
+        r.stack.push_back(f);
+
+        sink.onRecord(r);
+    }
+
+    return true;
+}
@@ -0,0 +1,34 @@
+#pragma once
+/**
+ * A reader for the logs of the PM tracer runtime (src/tracer), the native
+ * alternative to running under pmemcheck.
+ */
+
+#include <string>
+
+#include "TraceFormat.hpp"
+#include "TraceYaml.hpp"
+
+namespace pmfix {
+namespace trace {
+
+/**
+ * Streams the STOREs, FLUSHes and FENCEs of a tracer log into the sink, in
+ * timestamp order. Each event has a single, unsymbolized frame (its PC); the
+ * metadata lists the modules the program had loaded, so the fixer can
+ * symbolize them (see TraceSymbolizer). The metadata is {source: GENERIC,
+ * modules: ...}.
+ *
+ * The log has no bug reports; those come from checking the operations.
+ *
+ * Returns false (and complains) if the log is malformed.
+ */
+bool readTracerLog(const std::string &path, RecordSink &sink);
+
+/**
+ * Does the file start with the tracer log magic?
+ */
+bool isTracerLog(const std::string &path);
+
+}
+}
@@ -0,0 +1,64 @@
+#pragma once
+/**
+ * The raw log written by the PM tracer runtime (src/tracer). Shared by the
+ * runtime, which is C, and the trace library, which reads it (TracerLog.hpp).
+ *
+ * Layout:
+ *
+ *  [pmtracer_header]
+ *  [pmtracer_record x num_records]   -- in drain order, not time order
+ *  [module map]                      -- "<base> <end> <path>\n" lines, hex
+ *
+ * Records from one thread are in timestamp order, but the runtime drains the
+ * per-thread buffers in chunks, so the threads are interleaved arbitrarily.
+ * num_records and the module map are filled in when the program exits; a
+ * log with modules_offset == 0 was cut short, but the records can still be
+ * recovered from the file size.
+ *
+ * Everything is stored in native (x86-64) byte order.
+ */
+
+#include <stdint.h>
+
+#define PMTRACER_MAGIC "PMTRRAW"
+#define PMTRACER_VERSION 1
+
+enum pmtracer_kind {
+    /* The values match pmfix::trace::EventKind. */
+    PMTRACER_STORE = 0,
+    PMTRACER_FLUSH = 1,
+    PMTRACER_FENCE = 2,
+};
+
+struct pmtracer_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t num_records;
+    uint64_t modules_offset;
+    uint64_t modules_size;
+};
+
+struct pmtracer_record {
+    /* Time stamp counter, so the threads can be merged. Increasing within
+     * a thread; across threads, only as exact as the cores' counters. */
+    uint64_t timestamp;
+    /* Address of the instrumented instruction. */
+    uint64_t pc;
+    /* Flushes: the start of the flushed line. Fences: 0. */
+    uint64_t address;
+    /* Stores: bytes written. Flushes: the cache line size. Fences: 0. */
+    uint32_t length;
+    /* Assigned by the runtime, in the order threads first trace something. */
+    uint16_t thread;
+    uint8_t kind;
+    uint8_t reserved;
+};
+
+#ifdef __cplusplus
+static_assert(sizeof(pmtracer_header) == 40, "part of the format!");
+static_assert(sizeof(pmtracer_record) == 32, "part of the format!");
+#else
+_Static_assert(sizeof(struct pmtracer_header) == 40, "part of the format!");
+_Static_assert(sizeof(struct pmtracer_record) == 32, "part of the format!");
+#endif
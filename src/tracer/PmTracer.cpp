@@ -0,0 +1,183 @@
+/**
+ * The PM tracer: instruments stores, flushes and fences with calls into the
+ * tracer runtime (pmtracer_rt.c), which logs the ones that touch PM, at
+ * native speed. The STORE/FLUSH/FENCE events are the same as pmemcheck's,
+ * but each one only has the PC of its instruction, not a call stack, so the
+ * fixer can only fix bugs where the operations are: it can't lift a fix
+ * into a caller (see resolveCall and insertPersistentSubProgram).
+ *
+ *  opt -load PMTRACER.so -pm-tracer prog.bc -o traced.bc
+ *  clang traced.bc -lpmtracer_rt -lpthread -ldl -o traced
+ */
+
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/Transforms/IPO/PassManagerBuilder.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/DebugInfoMetadata.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+
+#include "llvm/Support/CommandLine.h"
+
+#include <vector>
+
+#include "PassUtils.hpp"
+
+using namespace llvm;
+
+namespace pmtracer {
+
+static cl::opt<bool> TraceAllStores("pm-tracer-all-stores",
+    cl::desc("Also instrument stores to the stack and to globals"),
+    cl::init(false));
+
+struct PmTracer : public ModulePass {
+    static char ID; // For LLVM purposes.
+
+    PmTracer() : ModulePass(ID) {}
+
+private:
+    // The runtime entry points.
+    Function *storeFn_ = nullptr;
+    Function *storeNTFn_ = nullptr;
+    Function *flushFn_ = nullptr;
+    Function *fenceFn_ = nullptr;
+
+    size_t nstores_ = 0, nflushes_ = 0, nfences_ = 0;
+
+    static Function *getRuntimeFunction(Module &m, StringRef name,
+                                        FunctionType *type) {
+        if (Function *f = m.getFunction(name)) return f;
+        return Function::Create(type, GlobalValue::ExternalLinkage, name, &m);
+    }
+
+    void declareRuntime(Module &m) {
+        LLVMContext &ctx = m.getContext();
+        Type *voidTy = Type::getVoidTy(ctx);
+        Type *ptrTy = Type::getInt8PtrTy(ctx);
+        Type *i64Ty = Type::getInt64Ty(ctx);
+
+        storeFn_ = getRuntimeFunction(m, "__pmtracer_store",
+            FunctionType::get(voidTy, {ptrTy, i64Ty}, false));
+        storeNTFn_ = getRuntimeFunction(m, "__pmtracer_store_nt",
+            FunctionType::get(voidTy, {ptrTy, i64Ty}, false));
+        flushFn_ = getRuntimeFunction(m, "__pmtracer_flush",
+            FunctionType::get(voidTy, {ptrTy}, false));
+        fenceFn_ = getRuntimeFunction(m, "__pmtracer_fence",
+            FunctionType::get(voidTy, {}, false));
+    }
+
+    /**
+     * Stack slots and globals are never PM, so don't bother the runtime.
+     */
+    static bool maybePM(Value *ptr, const DataLayout &dl) {
+        if (TraceAllStores) return true;
+        Value *obj = GetUnderlyingObject(ptr, dl);
+        return !isa<AllocaInst>(obj) && !isa<GlobalVariable>(obj);
+    }
+
+    static bool isFence(const Instruction &i) {
+        if (auto *fi = dyn_cast<FenceInst>(&i)) {
+            // Just a compiler barrier.
+            return fi->getSyncScopeID() != SyncScope::SingleThread;
+        }
+        return pmfix::utils::isFence(i) ||
+               pmfix::utils::checkInstrinicInst(&i, "mfence", nullptr);
+    }
+
+    /**
+     * The (pointer, length) of the memory i writes, if it writes memory we
+     * should trace.
+     */
+    static bool getStore(Instruction &i, const DataLayout &dl,
+                         Value *&ptr, Value *&len) {
+        LLVMContext &ctx = i.getContext();
+        Type *i64Ty = Type::getInt64Ty(ctx);
+
+        if (auto *si = dyn_cast<StoreInst>(&i)) {
+            ptr = si->getPointerOperand();
+            len = ConstantInt::get(i64Ty,
+                dl.getTypeStoreSize(si->getValueOperand()->getType()));
+        } else if (auto *rmw = dyn_cast<AtomicRMWInst>(&i)) {
+            ptr = rmw->getPointerOperand();
+            len = ConstantInt::get(i64Ty,
+                dl.getTypeStoreSize(rmw->getValOperand()->getType()));
+        } else if (auto *cx = dyn_cast<AtomicCmpXchgInst>(&i)) {
+            ptr = cx->getPointerOperand();
+            len = ConstantInt::get(i64Ty,
+                dl.getTypeStoreSize(cx->getNewValOperand()->getType()));
+        } else if (auto *mi = dyn_cast<MemIntrinsic>(&i)) {
+            ptr = mi->getRawDest();
+            len = mi->getLength();
+        } else {
+            return false;
+        }
+
+        return maybePM(ptr, dl);
+    }
+
+    void instrument(Instruction &i, const DataLayout &dl) {
+        Value *ptr = nullptr, *len = nullptr;
+        CallInst *call = nullptr;
+        IRBuilder<> builder(&i);
+        Type *ptrTy = Type::getInt8PtrTy(i.getContext());
+
+        if (getStore(i, dl, ptr, len)) {
+            Value *addr = builder.CreatePointerCast(ptr, ptrTy);
+            Value *n = builder.CreateZExtOrTrunc(len, builder.getInt64Ty());
+            // Non-temporal stores bypass the cache, so the runtime logs them
+            // as already flushed.
+            bool nt = isa<StoreInst>(i) &&
+                      i.getMetadata(LLVMContext::MD_nontemporal);
+            call = builder.CreateCall(nt ? storeNTFn_ : storeFn_, {addr, n});
+            nstores_++;
+        } else if (pmfix::utils::isFlush(i)) {
+            // clflush and friends, as intrinsics or inline asm, all take
+            // the address first.
+            CallInst &ci = cast<CallInst>(i);
+            Value *addr = builder.CreatePointerCast(ci.getArgOperand(0), ptrTy);
+            call = builder.CreateCall(flushFn_, {addr});
+            nflushes_++;
+        } else if (isFence(i)) {
+            call = builder.CreateCall(fenceFn_, {});
+            nfences_++;
+        }
+
+        // The runtime logs its return address, so the call should map to
+        // the same source location as the operation.
+        if (call) call->setDebugLoc(i.getDebugLoc());
+    }
+
+public:
+    bool runOnModule(Module &m) override {
+        declareRuntime(m);
+        const DataLayout &dl = m.getDataLayout();
+
+        std::vector<Instruction*> insts;
+        for (Function &f : m) {
+            if (f.isDeclaration() || f.getName().startswith("__pmtracer")) {
+                continue;
+            }
+            for (BasicBlock &b : f) {
+                for (Instruction &i : b) {
+                    insts.push_back(&i);
+                }
+            }
+        }
+
+        for (Instruction *i : insts) instrument(*i, dl);
+
+        outs() << "Instrumented " << nstores_ << " stores, " << nflushes_ <<
+            " flushes and " << nfences_ << " fences\n";
+        return nstores_ || nflushes_ || nfences_;
+    }
+};
+
+}
+
+char pmtracer::PmTracer::ID = 0;
+static RegisterPass<pmtracer::PmTracer> X("pm-tracer", "PM Operation Tracer",
+                                         false /* Only looks at CFG */,
+                                         false /* Analysis Pass */);
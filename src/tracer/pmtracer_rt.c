@@ -0,0 +1,484 @@
+/**
+ * The PM tracer runtime. Code instrumented by the -pm-tracer pass calls
+ * __pmtracer_store/store_nt/flush/fence; the operations that touch PM are appended to
+ * a per-thread ring buffer, and a background thread drains the rings to the
+ * log (see TracerRecord.h). Convert the log with parse-tracer.
+ *
+ * PM is whatever is mmap'd from a file under PMTRACER_PM_DIR, or registered
+ * with pmtracer_register(). Pointing PMTRACER_PM_DIR at a tmpfs (e.g.,
+ * /dev/shm) traces a DRAM-backed pool, so no real PM is needed.
+ *
+ * Environment:
+ *  PMTRACER_LOG      the log file (default: pmtracer.<pid>.log)
+ *  PMTRACER_PM_DIR   files mapped from under here are PM (default: /mnt/pmem)
+ *  PMTRACER_RING     records per thread ring, a power of 2 (default: 65536)
+ *  PMTRACER_SAMPLE   only log some of the stores, see pmtracer_sample.h
+ */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <link.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include <x86intrin.h>
+
+#include "TracerRecord.h"
+#include "pmtracer_sample.h"
+
+#define CACHE_LINE 64
+#define MAX_RANGES 256
+#define DRAIN_BUFFER (1 << 20)
+
+/**
+ * The PM ranges, [start, end). Slots are never moved, so the hot path can
+ * scan them without a lock; end == 0 marks a free slot.
+ */
+static struct {
+    _Atomic uintptr_t start;
+    _Atomic uintptr_t end;
+} ranges[MAX_RANGES];
+static _Atomic int nranges;
+static pthread_mutex_t ranges_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *pm_dir;
+static size_t pm_dir_len;
+
+static inline int is_pm(uintptr_t addr, uint64_t len) {
+    int n = atomic_load_explicit(&nranges, memory_order_acquire);
+    for (int i = 0; i < n; ++i) {
+        uintptr_t end = atomic_load_explicit(&ranges[i].end,
+                                             memory_order_acquire);
+        uintptr_t start = atomic_load_explicit(&ranges[i].start,
+                                               memory_order_relaxed);
+        if (addr < end && addr + len > start) return 1;
+    }
+    return 0;
+}
+
+void pmtracer_register(const void *addr, size_t len) {
+    pthread_mutex_lock(&ranges_lock);
+    int n = atomic_load_explicit(&nranges, memory_order_relaxed);
+    int slot = n;
+    for (int i = 0; i < n; ++i) {
+        if (!atomic_load_explicit(&ranges[i].end, memory_order_relaxed)) {
+            slot = i;
+            break;
+        }
+    }
+
+    if (slot == MAX_RANGES) {
+        fprintf(stderr, "pmtracer: too many PM ranges, not tracing %p\n", addr);
+    } else {
+        atomic_store_explicit(&ranges[slot].start, (uintptr_t)addr,
+                              memory_order_relaxed);
+        atomic_store_explicit(&ranges[slot].end, (uintptr_t)addr + len,
+                              memory_order_release);
+        if (slot == n) {
+            atomic_store_explicit(&nranges, n + 1, memory_order_release);
+        }
+    }
+    pthread_mutex_unlock(&ranges_lock);
+}
+
+void pmtracer_unregister(const void *addr, size_t len) {
+    uintptr_t start = (uintptr_t)addr;
+    pthread_mutex_lock(&ranges_lock);
+    int n = atomic_load_explicit(&nranges, memory_order_relaxed);
+    for (int i = 0; i < n; ++i) {
+        if (atomic_load_explicit(&ranges[i].start, memory_order_relaxed) ==
+                start &&
+            atomic_load_explicit(&ranges[i].end, memory_order_relaxed) ==
+                start + len) {
+            atomic_store_explicit(&ranges[i].end, 0, memory_order_release);
+        }
+    }
+    pthread_mutex_unlock(&ranges_lock);
+}
+
+static int is_pm_file(int fd) {
+    char link[64], path[PATH_MAX];
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+    ssize_t n = readlink(link, path, sizeof(path) - 1);
+    if (n < 0) return 0;
+    path[n] = '\0';
+    return !strncmp(path, pm_dir, pm_dir_len);
+}
+
+/**
+ * PMDK (and everything else) maps its pools with mmap, so catch the file
+ * mappings under PMTRACER_PM_DIR here. Goes straight to the system call, so
+ * this works before the dynamic linker is done, too.
+ */
+void *mmap(void *addr, size_t len, int prot, int flags, int fd, off_t off) {
+    void *res = (void*)syscall(SYS_mmap, addr, len, prot, flags, fd, off);
+    if ((long)res < 0 && (long)res > -4096) {
+        errno = -(long)res;
+        return MAP_FAILED;
+    }
+
+    if (fd >= 0 && pm_dir && is_pm_file(fd)) pmtracer_register(res, len);
+    return res;
+}
+
+void *mmap64(void *addr, size_t len, int prot, int flags, int fd, off_t off)
+    __attribute__((alias("mmap")));
+
+int munmap(void *addr, size_t len) {
+    pmtracer_unregister(addr, len);
+    long res = syscall(SYS_munmap, addr, len);
+    if (res < 0) {
+        errno = -res;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * A single-producer, single-consumer ring. The owning thread moves head,
+ * the drain thread moves tail.
+ */
+struct ring {
+    _Atomic uint64_t head;
+    char pad0[CACHE_LINE - sizeof(uint64_t)];
+    _Atomic uint64_t tail;
+    char pad1[CACHE_LINE - sizeof(uint64_t)];
+    // Set when the owner exits, so a new thread can take the ring over.
+    _Atomic int free;
+    struct ring *next;
+    struct pmtracer_record records[];
+};
+
+static _Atomic(struct ring*) rings;
+static uint64_t ring_mask;
+
+static _Atomic uint32_t next_thread;
+// Times a thread waited for the drain thread, for the exit summary.
+static _Atomic uint64_t stalls;
+
+static __thread struct ring *my_ring;
+static __thread uint16_t my_thread;
+static __thread uint64_t last_timestamp;
+static pthread_key_t ring_key;
+
+static int log_fd = -1;
+static pthread_t drain_thread;
+static _Atomic int stopping;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+static void release_ring(void *r) {
+    atomic_store_explicit(&((struct ring*)r)->free, 1, memory_order_release);
+}
+
+static struct ring *get_ring(void) {
+    struct ring *r;
+    for (r = atomic_load(&rings); r; r = r->next) {
+        int expected = 1;
+        if (atomic_compare_exchange_strong(&r->free, &expected, 0)) break;
+    }
+
+    if (!r) {
+        size_t size = sizeof(struct ring) +
+                      (ring_mask + 1) * sizeof(struct pmtracer_record);
+        r = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (r == MAP_FAILED) {
+            perror("pmtracer: could not allocate a ring");
+            abort();
+        }
+
+        r->next = atomic_load(&rings);
+        while (!atomic_compare_exchange_weak(&rings, &r->next, r)) {}
+    }
+
+    my_thread = (uint16_t)atomic_fetch_add(&next_thread, 1);
+    pthread_setspecific(ring_key, r);
+    return r;
+}
+
+static void init(void);
+
+/**
+ * The time stamp counter, which is cheap to read and agrees across cores, so
+ * the threads can be merged without sharing a counter. Bumped if need be to
+ * keep each thread's timestamps distinct.
+ */
+static inline uint64_t next_timestamp(void) {
+    unsigned int aux;
+    uint64_t t = __rdtscp(&aux);
+    if (t <= last_timestamp) t = last_timestamp + 1;
+    return last_timestamp = t;
+}
+
+static inline void log_op(uint8_t kind, const void *pc, uintptr_t addr,
+                          uint64_t len) {
+    struct ring *r = my_ring;
+    if (__builtin_expect(!r, 0)) {
+        pthread_once(&init_once, init);
+        r = my_ring = get_ring();
+    }
+
+    uint64_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    while (head - atomic_load_explicit(&r->tail, memory_order_acquire) >
+           ring_mask) {
+        atomic_fetch_add_explicit(&stalls, 1, memory_order_relaxed);
+        sched_yield();
+    }
+
+    struct pmtracer_record *rec = &r->records[head & ring_mask];
+    rec->timestamp = next_timestamp();
+    // The call maps to the same source location as the operation, and the
+    // return address is just past it.
+    rec->pc = (uint64_t)(uintptr_t)pc - 1;
+    rec->address = addr;
+    rec->length = (uint32_t)len;
+    rec->thread = my_thread;
+    rec->kind = kind;
+    rec->reserved = 0;
+
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+static char buffer[DRAIN_BUFFER];
+static size_t buffered;
+static uint64_t nrecords;
+
+static void write_all(const void *data, size_t len) {
+    const char *p = data;
+    while (len) {
+        ssize_t n = write(log_fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("pmtracer: could not write the log");
+            abort();
+        }
+        p += n;
+        len -= n;
+    }
+}
+
+static void flush_buffer(void) {
+    write_all(buffer, buffered);
+    buffered = 0;
+}
+
+/**
+ * Copy out everything in the rings. Returns the number of records.
+ */
+static uint64_t drain(void) {
+    uint64_t total = 0;
+    for (struct ring *r = atomic_load(&rings); r; r = r->next) {
+        uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+        uint64_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        for (; tail != head; ++tail) {
+            if (buffered + sizeof(struct pmtracer_record) > sizeof(buffer)) {
+                flush_buffer();
+            }
+            memcpy(buffer + buffered, &r->records[tail & ring_mask],
+                   sizeof(struct pmtracer_record));
+            buffered += sizeof(struct pmtracer_record);
+            total++;
+        }
+        atomic_store_explicit(&r->tail, tail, memory_order_release);
+    }
+
+    nrecords += total;
+    return total;
+}
+
+static void *drain_loop(void *arg) {
+    (void)arg;
+    const struct timespec nap = {0, 100000};
+    while (!atomic_load(&stopping)) {
+        if (!drain()) {
+            flush_buffer();
+            nanosleep(&nap, NULL);
+        }
+    }
+    return NULL;
+}
+
+static int write_module(struct dl_phdr_info *info, size_t size, void *data) {
+    (void)size;
+    FILE *out = data;
+
+    char exe[PATH_MAX];
+    const char *path = info->dlpi_name;
+    if (!path || !*path) {
+        // The main program.
+        ssize_t n = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+        if (n < 0) return 0;
+        exe[n] = '\0';
+        path = exe;
+    }
+    // The vDSO and friends have no file to symbolize from.
+    if (path[0] != '/') return 0;
+
+    uintptr_t end = 0;
+    for (int i = 0; i < info->dlpi_phnum; ++i) {
+        const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+        if (ph->p_type != PT_LOAD) continue;
+        uintptr_t e = info->dlpi_addr + ph->p_vaddr + ph->p_memsz;
+        if (e > end) end = e;
+    }
+
+    fprintf(out, "%lx %lx %s\n", (unsigned long)info->dlpi_addr,
+            (unsigned long)end, path);
+    return 0;
+}
+
+static void finish(void) {
+    atomic_store(&stopping, 1);
+    pthread_join(drain_thread, NULL);
+    drain();
+    flush_buffer();
+
+    // The module map, for symbolizing the PCs.
+    char *modules = NULL;
+    size_t modules_size = 0;
+    FILE *out = open_memstream(&modules, &modules_size);
+    dl_iterate_phdr(write_module, out);
+    fclose(out);
+
+    struct pmtracer_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, PMTRACER_MAGIC, sizeof(h.magic));
+    h.version = PMTRACER_VERSION;
+    h.record_size = sizeof(struct pmtracer_record);
+    h.num_records = nrecords;
+    h.modules_offset = sizeof(h) + nrecords * sizeof(struct pmtracer_record);
+    h.modules_size = modules_size;
+
+    write_all(modules, modules_size);
+    free(modules);
+    if (pwrite(log_fd, &h, sizeof(h), 0) != sizeof(h)) {
+        perror("pmtracer: could not finish the log");
+    }
+    close(log_fd);
+
+    char sampling[128];
+    pmtracer_sample_summary(sampling, sizeof(sampling));
+    fprintf(stderr, "pmtracer: %llu records, %llu stalls%s%s\n",
+            (unsigned long long)nrecords, (unsigned long long)stalls,
+            *sampling ? ", " : "", sampling);
+}
+
+static void init(void) {
+    const char *ring = getenv("PMTRACER_RING");
+    uint64_t size = ring ? strtoull(ring, NULL, 0) : 65536;
+    if (!size || (size & (size - 1))) {
+        fprintf(stderr, "pmtracer: PMTRACER_RING must be a power of 2\n");
+        abort();
+    }
+    ring_mask = size - 1;
+
+    char path[PATH_MAX];
+    const char *log = getenv("PMTRACER_LOG");
+    if (!log) {
+        snprintf(path, sizeof(path), "pmtracer.%d.log", (int)getpid());
+        log = path;
+    }
+
+    log_fd = open(log, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (log_fd < 0) {
+        perror("pmtracer: could not open the log");
+        abort();
+    }
+
+    // The counts are filled in by finish().
+    struct pmtracer_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, PMTRACER_MAGIC, sizeof(h.magic));
+    h.version = PMTRACER_VERSION;
+    h.record_size = sizeof(struct pmtracer_record);
+    write_all(&h, sizeof(h));
+
+    pthread_key_create(&ring_key, release_ring);
+    if (pthread_create(&drain_thread, NULL, drain_loop, NULL)) {
+        fprintf(stderr, "pmtracer: could not start the drain thread\n");
+        abort();
+    }
+    atexit(finish);
+}
+
+__attribute__((constructor))
+static void init_config(void) {
+    pm_dir = getenv("PMTRACER_PM_DIR");
+    if (!pm_dir) pm_dir = "/mnt/pmem";
+    pm_dir_len = strlen(pm_dir);
+
+    if (!pmtracer_sample_init()) abort();
+}
+
+/**
+ * Log as much of a store as sampling lets through. Returns 0 if none of it
+ * was logged.
+ */
+static int log_store(const void *pc, uintptr_t addr, uint64_t len) {
+    switch (pmtracer_sample_store((uintptr_t)pc, addr, len)) {
+        case PMTRACER_SAMPLE_SKIP:
+            return 0;
+        case PMTRACER_SAMPLE_LOG:
+            log_op(PMTRACER_STORE, pc, addr, len);
+            return 1;
+        case PMTRACER_SAMPLE_CLIP:
+            break;
+    }
+
+    // One record per tracked line, since the tracked lines may have gaps.
+    uintptr_t end = addr + len;
+    for (uintptr_t line = addr & ~(uintptr_t)(CACHE_LINE - 1); line < end;
+         line += CACHE_LINE) {
+        if (!pmtracer_sample_tracked(line)) continue;
+        uintptr_t start = line > addr ? line : addr;
+        uintptr_t stop = line + CACHE_LINE < end ? line + CACHE_LINE : end;
+        log_op(PMTRACER_STORE, pc, start, stop - start);
+    }
+    return 1;
+}
+
+void __pmtracer_store(void *addr, uint64_t len) {
+    if (!is_pm((uintptr_t)addr, len)) return;
+    log_store(__builtin_return_address(0), (uintptr_t)addr, len);
+}
+
+void __pmtracer_store_nt(void *addr, uint64_t len) {
+    if (!is_pm((uintptr_t)addr, len)) return;
+    void *pc = __builtin_return_address(0);
+    if (!log_store(pc, (uintptr_t)addr, len)) return;
+
+    // The store skips the cache, so only a fence is left to persist it. Log a
+    // flush of each line it wrote.
+    uintptr_t end = (uintptr_t)addr + (len ? len : 1);
+    for (uintptr_t line = (uintptr_t)addr & ~(uintptr_t)(CACHE_LINE - 1);
+         line < end; line += CACHE_LINE) {
+        if (!pmtracer_sample_flush(line, CACHE_LINE)) continue;
+        log_op(PMTRACER_FLUSH, pc, line, CACHE_LINE);
+    }
+}
+
+void __pmtracer_flush(void *addr) {
+    if (!is_pm((uintptr_t)addr, 1)) return;
+    // The flush takes any address in the line, but logging it as is would
+    // make the line look like it straddles the next one.
+    uintptr_t line = (uintptr_t)addr & ~(uintptr_t)(CACHE_LINE - 1);
+    if (!pmtracer_sample_flush(line, CACHE_LINE)) return;
+    log_op(PMTRACER_FLUSH, __builtin_return_address(0), line, CACHE_LINE);
+}
+
+void __pmtracer_fence(void) {
+    // Fences don't have an address; only bother once there is PM.
+    if (!atomic_load_explicit(&nranges, memory_order_relaxed)) return;
+    if (!pmtracer_sample_fence()) return;
+    log_op(PMTRACER_FENCE, __builtin_return_address(0), 0, 0);
+}
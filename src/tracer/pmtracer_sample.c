@@ -0,0 +1,321 @@
+#define _GNU_SOURCE
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "pmtracer_sample.h"
+
+#define CACHE_LINE 64
+#define MAX_SITES (1 << 16)
+
+enum policy { SAMPLE_ALL, SAMPLE_SITE, SAMPLE_WINDOW, SAMPLE_ADDRESS };
+
+static enum policy policy = SAMPLE_ALL;
+static uint64_t site_limit;
+static uint64_t window_on_ns, window_period_ns;
+static uint64_t address_modulus;
+
+/**
+ * Lines with a sampled store, in buckets of BUCKET slots (a cache line) by a
+ * hash of the line. A slot holds the line address, with DIRTY set while a
+ * logged store to the line has no logged flush yet, or 0 if it is empty.
+ * Once a flushed line is fenced it retires and its slot is emptied again.
+ *
+ * Only 3/4 of the slots are ever in use, and a lookup only reads the line's
+ * bucket, so lookups stay short, even when the table is full.
+ */
+#define BUCKET 8
+#define DIRTY ((uintptr_t)1)
+
+static _Atomic uintptr_t *tracked;
+static uint64_t bucket_mask, bucket_size, tracked_limit;
+static _Atomic uint64_t tracked_count;
+
+/**
+ * PC -> stores seen, for the site policy.
+ */
+static struct {
+    _Atomic uintptr_t pc;
+    _Atomic uint64_t count;
+} sites[MAX_SITES];
+
+static _Atomic uint64_t seen, sampled, table_full, retired;
+
+/**
+ * Whether this thread logged a flush since its last logged fence. Other
+ * fences persist nothing the checker knows about.
+ */
+static __thread int flush_pending;
+
+/**
+ * The lines of this thread's logged flushes since its last logged fence,
+ * which retire at that fence. Lines that don't fit just stay tracked.
+ */
+#define MAX_PENDING 64
+static __thread uintptr_t pending[MAX_PENDING];
+static __thread int npending;
+
+static inline uint64_t mix(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdull;
+    x ^= x >> 33;
+    return x;
+}
+
+static inline uintptr_t first_line(uintptr_t addr) {
+    return addr & ~(uintptr_t)(CACHE_LINE - 1);
+}
+
+static inline uintptr_t last_line(uintptr_t addr, uint64_t len) {
+    return first_line(addr + (len ? len : 1) - 1);
+}
+
+static inline uintptr_t slot_line(uintptr_t v) {
+    return v & ~(uintptr_t)(CACHE_LINE - 1);
+}
+
+static inline _Atomic uintptr_t *bucket(uintptr_t line) {
+    return tracked + (mix(line) & bucket_mask) * bucket_size;
+}
+
+/**
+ * The slot of a tracked line, or NULL.
+ */
+static _Atomic uintptr_t *find(uintptr_t line) {
+    _Atomic uintptr_t *b = bucket(line);
+    for (uint64_t i = 0; i < bucket_size; ++i) {
+        if (slot_line(atomic_load_explicit(&b[i], memory_order_relaxed)) ==
+            line) {
+            return &b[i];
+        }
+    }
+    return NULL;
+}
+
+static int is_tracked(uintptr_t line) {
+    return find(line) != NULL;
+}
+
+/**
+ * Set or clear DIRTY. Returns 0 if the line retired meanwhile.
+ */
+static int set_dirty(_Atomic uintptr_t *slot, uintptr_t line, int dirty) {
+    uintptr_t want = dirty ? (line | DIRTY) : line;
+    uintptr_t v = atomic_load_explicit(slot, memory_order_relaxed);
+    while (slot_line(v) == line) {
+        if (v == want || atomic_compare_exchange_weak(slot, &v, want)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Track the line, if it isn't already, and mark it dirty. Returns 0 if there
+ * is no room for it.
+ */
+static int track(uintptr_t line) {
+    for (;;) {
+        _Atomic uintptr_t *slot = find(line);
+        if (slot) {
+            if (set_dirty(slot, line, 1)) return 1;
+            continue;
+        }
+
+        _Atomic uintptr_t *b = bucket(line);
+        for (uint64_t i = 0; !slot && i < bucket_size; ++i) {
+            if (!atomic_load_explicit(&b[i], memory_order_relaxed)) {
+                slot = &b[i];
+            }
+        }
+        if (!slot) return 0;
+
+        if (atomic_fetch_add_explicit(&tracked_count, 1,
+                                      memory_order_relaxed) >= tracked_limit) {
+            atomic_fetch_sub_explicit(&tracked_count, 1, memory_order_relaxed);
+            return 0;
+        }
+        // Two threads can both add the line this way. Lookups only see the
+        // first copy, and the other one takes over once that retires.
+        uintptr_t v = 0;
+        if (atomic_compare_exchange_strong(slot, &v, line | DIRTY)) return 1;
+        atomic_fetch_sub_explicit(&tracked_count, 1, memory_order_relaxed);
+    }
+}
+
+static int site_sampled(uintptr_t pc) {
+    uint64_t i = mix(pc) & (MAX_SITES - 1);
+    for (int n = 0; n < MAX_SITES; ++n, i = (i + 1) & (MAX_SITES - 1)) {
+        uintptr_t v = atomic_load_explicit(&sites[i].pc, memory_order_relaxed);
+        if (!v) {
+            atomic_compare_exchange_strong(&sites[i].pc, &v, pc);
+            if (!v) v = pc;
+        }
+        if (v == pc) {
+            return atomic_fetch_add_explicit(&sites[i].count, 1,
+                                             memory_order_relaxed) <
+                   site_limit;
+        }
+    }
+    // Too many sites to count; this one is past its share anyway.
+    return 0;
+}
+
+static int in_window(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    uint64_t ns = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    return ns % window_period_ns < window_on_ns;
+}
+
+static int address_sampled(uintptr_t addr, uint64_t len) {
+    for (uintptr_t line = first_line(addr); line <= last_line(addr, len);
+         line += CACHE_LINE) {
+        if (mix(line) % address_modulus == 0) return 1;
+    }
+    return 0;
+}
+
+int pmtracer_sample_init(void) {
+    const char *spec = getenv("PMTRACER_SAMPLE");
+    if (!spec || !*spec || !strcmp(spec, "all")) return 1;
+
+    unsigned long long a, b;
+    if (sscanf(spec, "site:%llu", &a) == 1 && a) {
+        policy = SAMPLE_SITE;
+        site_limit = a;
+    } else if (sscanf(spec, "window:%llu/%llu", &a, &b) == 2 && a && a < b) {
+        policy = SAMPLE_WINDOW;
+        window_on_ns = a * 1000000ull;
+        window_period_ns = b * 1000000ull;
+    } else if (sscanf(spec, "address:%llu", &a) == 1 && a) {
+        policy = SAMPLE_ADDRESS;
+        address_modulus = a;
+    } else {
+        fprintf(stderr, "pmtracer: bad PMTRACER_SAMPLE \"%s\"\n", spec);
+        return 0;
+    }
+
+    const char *lines = getenv("PMTRACER_SAMPLE_LINES");
+    uint64_t size = lines ? strtoull(lines, NULL, 0) : (1 << 20);
+    if (!size || (size & (size - 1))) {
+        fprintf(stderr, "pmtracer: PMTRACER_SAMPLE_LINES must be a power of 2\n");
+        return 0;
+    }
+
+    // Untouched pages cost nothing.
+    tracked = mmap(NULL, size * sizeof(*tracked), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (tracked == MAP_FAILED) {
+        perror("pmtracer: could not allocate the sampling table");
+        return 0;
+    }
+    bucket_size = size < BUCKET ? size : BUCKET;
+    bucket_mask = size / bucket_size - 1;
+    tracked_limit = size - size / 4;
+    return 1;
+}
+
+enum pmtracer_sample_result pmtracer_sample_store(uintptr_t pc, uintptr_t addr,
+                                                  uint64_t len) {
+    if (policy == SAMPLE_ALL) return PMTRACER_SAMPLE_LOG;
+    atomic_fetch_add_explicit(&seen, 1, memory_order_relaxed);
+
+    int sample = 0;
+    for (uintptr_t line = first_line(addr);
+         !sample && line <= last_line(addr, len); line += CACHE_LINE) {
+        sample = is_tracked(line);
+    }
+
+    if (!sample) {
+        switch (policy) {
+            case SAMPLE_SITE:
+                sample = site_sampled(pc);
+                break;
+            case SAMPLE_WINDOW:
+                sample = in_window();
+                break;
+            default:
+                sample = address_sampled(addr, len);
+                break;
+        }
+    }
+    if (!sample) return PMTRACER_SAMPLE_SKIP;
+
+    // Follow all the lines from now on, even for the address policy: a store
+    // can straddle a line that hashes out. If they don't all fit, only the
+    // tracked lines get the store: a missing store can only hide bugs, but a
+    // store whose flushes go missing would look like one, and so would a
+    // flush of a tracked line whose store went missing.
+    int some = 0, all = 1;
+    for (uintptr_t line = first_line(addr); line <= last_line(addr, len);
+         line += CACHE_LINE) {
+        if (track(line)) {
+            some = 1;
+        } else {
+            all = 0;
+        }
+    }
+
+    if (!all) atomic_fetch_add_explicit(&table_full, 1, memory_order_relaxed);
+    if (!some) return PMTRACER_SAMPLE_SKIP;
+
+    atomic_fetch_add_explicit(&sampled, 1, memory_order_relaxed);
+    return all ? PMTRACER_SAMPLE_LOG : PMTRACER_SAMPLE_CLIP;
+}
+
+int pmtracer_sample_tracked(uintptr_t line) {
+    return policy == SAMPLE_ALL || is_tracked(line);
+}
+
+int pmtracer_sample_flush(uintptr_t addr, uint64_t len) {
+    if (policy == SAMPLE_ALL) return 1;
+
+    int sample = 0;
+    for (uintptr_t line = first_line(addr); line <= last_line(addr, len);
+         line += CACHE_LINE) {
+        _Atomic uintptr_t *slot = find(line);
+        if (!slot || !set_dirty(slot, line, 0)) continue;
+        sample = 1;
+        if (npending < MAX_PENDING) pending[npending++] = line;
+    }
+
+    flush_pending |= sample;
+    return sample;
+}
+
+int pmtracer_sample_fence(void) {
+    if (policy == SAMPLE_ALL) return 1;
+    int sample = flush_pending;
+    flush_pending = 0;
+
+    // The flushed lines are persistent now, so stop following them, unless
+    // a store dirtied them again since. A store that races with another
+    // thread's flush of its line can lose its own flush this way, but that
+    // is a race in the program anyway.
+    for (int i = 0; i < npending; ++i) {
+        uintptr_t v = pending[i];
+        _Atomic uintptr_t *slot = find(v);
+        if (slot && atomic_compare_exchange_strong(slot, &v, 0)) {
+            atomic_fetch_sub_explicit(&tracked_count, 1, memory_order_relaxed);
+            atomic_fetch_add_explicit(&retired, 1, memory_order_relaxed);
+        }
+    }
+    npending = 0;
+
+    return sample;
+}
+
+void pmtracer_sample_summary(char *buf, size_t size) {
+    if (policy == SAMPLE_ALL) {
+        buf[0] = '\0';
+        return;
+    }
+
+    snprintf(buf, size, "sampled %llu of %llu PM stores, retired %llu lines%s",
+             (unsigned long long)sampled, (unsigned long long)seen,
+             (unsigned long long)retired, table_full ? " (the line table filled up)" : "");
+}
@@ -0,0 +1,66 @@
+#pragma once
+/**
+ * Sampling for the PM tracer runtime, so long runs produce traces small
+ * enough to fix. Selected with PMTRACER_SAMPLE:
+ *
+ *  site:N       the first N stores from each PC
+ *  window:ON/P  stores in the first ON ms of every P ms
+ *  address:K    stores to 1 in K cache lines, by a hash of the line address
+ *
+ * Sampling is by cache line, so the checker still sees the whole story of
+ * every line it sees at all: once a store is sampled, its lines are tracked
+ * and all their later stores and flushes are logged too, along with the
+ * fences that follow a logged flush. A line retires once its stores are
+ * flushed and fenced, and is only followed again if it is sampled again, so
+ * the sample rate holds on long runs.
+ *
+ * The tracked lines are kept in a table of PMTRACER_SAMPLE_LINES slots (a
+ * power of 2, default 1M), in buckets of 8 by a hash of the line. At most
+ * 3/4 of the slots are in use at once, and a lookup only reads the line's
+ * bucket, a single cache line. A line that finds no room is not sampled,
+ * though the tracked ones are still followed, even through stores that also
+ * touch lines that didn't fit.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Read the environment. Returns 0 if PMTRACER_SAMPLE is malformed.
+ */
+int pmtracer_sample_init(void);
+
+enum pmtracer_sample_result {
+    PMTRACER_SAMPLE_SKIP = 0,
+    PMTRACER_SAMPLE_LOG = 1,
+    /* The line table filled up partway through the store: only log the parts
+     * of it in lines that pmtracer_sample_tracked() accepts. */
+    PMTRACER_SAMPLE_CLIP = 2,
+};
+
+/**
+ * Should this store be logged?
+ */
+enum pmtracer_sample_result pmtracer_sample_store(uintptr_t pc, uintptr_t addr,
+                                                  uint64_t len);
+
+/**
+ * Are the stores and flushes of this line logged?
+ */
+int pmtracer_sample_tracked(uintptr_t line);
+
+/**
+ * Should this flush be logged?
+ */
+int pmtracer_sample_flush(uintptr_t addr, uint64_t len);
+
+/**
+ * Should this fence be logged? Only if it may persist a logged flush of the
+ * calling thread.
+ */
+int pmtracer_sample_fence(void);
+
+/**
+ * One line for the exit summary, empty if not sampling.
+ */
+void pmtracer_sample_summary(char *buf, size_t size);
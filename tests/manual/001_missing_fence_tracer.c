@@ -0,0 +1,47 @@
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <immintrin.h>
+
+#include "pmtracer_pool.h"
+
+/**
+ * The PM tracer version of 001_missing_fence_pmemcheck.c. Build it with
+ * add-tracer, then run it with PMTRACER_PM_DIR set to a directory it can
+ * create its pool in (a tmpfs is fine).
+ */
+
+void correct(char *arr) {
+	*arr = 'c';
+	_mm_clwb(arr);
+	_mm_sfence();
+}
+
+void incorrect(char *arr) {
+	*arr = 'i';
+	_mm_clwb(arr);
+	// _mm_sfence();
+}
+
+int main(int argc, char *argv[]) {
+	char *arr = map_pm("001_missing_fence.pool", 1024);
+
+	printf("Starting testing...\n");
+
+	correct(&arr[0]);
+	incorrect(&arr[64]);
+
+	printf("Test complete!\n");
+
+	munmap(arr, 1024);
+
+	return 0;
+}
@@ -0,0 +1,46 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <immintrin.h>
+
+#include <valgrind/pmemcheck.h>
+
+/**
+ * The pmemcheck version of 003_extra_flush_pmtest.c. The second flush of
+ * arr[4] is the bug.
+ */
+
+void incorrect(char *arr) {
+	*(int*)(&arr[0]) = 7;
+	_mm_clwb(&arr[0]);
+	_mm_sfence();
+
+	*(int*)(&arr[4]) = 7;
+	_mm_clwb(&arr[4]);
+
+	// begin extra
+	_mm_clwb(&arr[4]);
+	// end extra
+
+	_mm_sfence();
+}
+
+int main(int argc, char *argv[]) {
+	char arr[1024];
+	VALGRIND_PMC_REGISTER_PMEM_MAPPING(arr, sizeof(arr));
+
+	printf("Starting testing...\n");
+
+	incorrect(&arr[0]);
+
+	printf("Test complete!\n");
+
+	VALGRIND_PMC_REMOVE_PMEM_MAPPING(arr, sizeof(arr));
+
+	return 0;
+}
@@ -0,0 +1,49 @@
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <immintrin.h>
+
+#include "pmtracer_pool.h"
+
+/**
+ * The PM tracer version of 003_extra_flush_pmemcheck.c. Build it with
+ * add-tracer, then run it with PMTRACER_PM_DIR set to a directory it can
+ * create its pool in (a tmpfs is fine).
+ */
+
+void incorrect(char *arr) {
+	*(int*)(&arr[0]) = 7;
+	_mm_clwb(&arr[0]);
+	_mm_sfence();
+
+	*(int*)(&arr[4]) = 7;
+	_mm_clwb(&arr[4]);
+
+	// begin extra
+	_mm_clwb(&arr[4]);
+	// end extra
+
+	_mm_sfence();
+}
+
+int main(int argc, char *argv[]) {
+	char *arr = map_pm("003_extra_flush.pool", 1024);
+
+	printf("Starting testing...\n");
+
+	incorrect(&arr[0]);
+
+	printf("Test complete!\n");
+
+	munmap(arr, 1024);
+
+	return 0;
+}
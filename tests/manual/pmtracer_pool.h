@@ -0,0 +1,37 @@
+#pragma once
+/**
+ * Shared by the PM tracer versions of the tests.
+ */
+
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/**
+ * The tracer takes the files mapped from under PMTRACER_PM_DIR as PM, so map
+ * one from there rather than registering a stack array.
+ */
+static char *map_pm(const char *name, size_t len) {
+	const char *dir = getenv("PMTRACER_PM_DIR");
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", dir ? dir : "/mnt/pmem", name);
+
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0 || ftruncate(fd, len)) {
+		perror(path);
+		exit(1);
+	}
+
+	char *arr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (arr == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+
+	close(fd);
+	unlink(path);
+	return arr;
+}